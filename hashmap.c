@@ -2,18 +2,60 @@
 // Use of this source code is governed by an MIT-style
 // license that can be found in the LICENSE file.
 
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L // pthread_rwlock_t, clock_gettime, mmap
+#endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // madvise
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
+#include <errno.h>
 #include "hashmap.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MADV_HUGEPAGE)
+#define HASHMAP_MADVISE
+#endif
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HASHMAP_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if !defined(HASHMAP_NO_THREADS) && !defined(__GNUC__)
+#error "HASHMAP_THREADS needs the __atomic builtins of GCC or Clang"
+#endif
+
+#if !defined(HASHMAP_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define HASHMAP_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASHMAP_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define HASHMAP_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 static void *(*_malloc)(size_t) = NULL;
 static void *(*_realloc)(void *, size_t) = NULL;
 static void (*_free)(void *) = NULL;
 
-void hashmap_set_allocator(void *(*malloc)(size_t), void (*free)(void*)) 
+void hashmap_set_allocator(void *(*malloc)(size_t), void (*free)(void*))
 {
     _malloc = malloc;
     _free = free;
@@ -24,16 +66,103 @@ void hashmap_set_allocator(void *(*malloc)(size_t), void (*free)(void*))
     exit(1); \
 }
 
+// A bucket keeps the low HASH_BITS of the hash of its item and the distance
+// of the bucket from the home bucket of the item, plus one, or zero when the
+// bucket is empty. With HASHMAP_WIDE_BUCKETS the whole hash is kept, which
+// keeps the hashes of the items in a cluster apart on tables that use many
+// of the low bits for the home bucket, and a distance that can't overflow.
+#ifdef HASHMAP_WIDE_BUCKETS
+struct bucket {
+    uint64_t hash;
+    uint32_t dib;
+    uint32_t reserved;
+};
+#define HASH_BITS 64
+#define DIB_MAX UINT32_MAX
+#else
 struct bucket {
     uint64_t hash:48;
     uint64_t dib:16;
 };
+#define HASH_BITS 48
+#define DIB_MAX 0xFFFF
+#endif
+
+// Returns the part of a hash that buckets keep.
+static uint64_t clip_hash(uint64_t hash) {
+    return hash << (64-HASH_BITS) >> (64-HASH_BITS);
+}
+
+// Element storage for HASHMAP_LAYOUT_INDIRECT. Elements live in fixed-size
+// chunks that never move, and freed elements are linked into a free list.
+struct slab {
+    char **chunks;
+    size_t nchunks;
+    size_t chunkcap; // capacity of the chunks array
+    int shift;       // log2 of the number of elements in a chunk
+    size_t stride;
+    size_t len;      // number of elements ever handed out
+    size_t free;     // head of the free list, or SIZE_MAX
+};
+
+// Counters of the operations on a map, which are only kept when built with
+// HASHMAP_STATS. Probes count towards the operation that started last.
+#ifdef HASHMAP_STATS
+struct counters {
+    uint64_t gets, sets, deletes;
+    uint64_t get_probes, set_probes, delete_probes;
+    uint64_t compares;
+    uint64_t *probes; // of the current operation
+};
+
+// Adds n to a counter. The readers of a sharded map count at the same time,
+// which may lose counts but never tears them.
+static void stat_add(uint64_t *counter, uint64_t n) {
+#if defined(__GNUC__)
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+n,
+                     __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
+
+static void stat_op(struct counters *ctr, uint64_t *ops, uint64_t *probes) {
+    stat_add(ops, 1);
+#if defined(__GNUC__)
+    __atomic_store_n(&ctr->probes, probes, __ATOMIC_RELAXED);
+#else
+    ctr->probes = probes;
+#endif
+}
+
+static void stat_probe(struct counters *ctr) {
+#if defined(__GNUC__)
+    stat_add(__atomic_load_n(&ctr->probes, __ATOMIC_RELAXED), 1);
+#else
+    stat_add(ctr->probes, 1);
+#endif
+}
+
+#define STAT_OP(map, op) \
+    stat_op((map)->ctr, &(map)->ctr->op##s, &(map)->ctr->op##_probes)
+#define STAT_PROBE(map) stat_probe((map)->ctr)
+#define STAT_COMPARE(map) stat_add(&(map)->ctr->compares, 1)
+#else
+#define STAT_OP(map, op) ((void)0)
+#define STAT_PROBE(map) ((void)0)
+#define STAT_COMPARE(map) ((void)0)
+#endif
 
 struct hashmap {
     void *(*malloc)(size_t);
     void *(*realloc)(void *, size_t);
     void (*free)(void *);
+    struct hashmap_allocator allocator; // takes precedence when set
+    size_t align;     // alignment of tables, or zero
+    bool hugepages;
+    void **recycled;  // released tables by log2 of their size, or NULL
     bool oom;
+    enum hashmap_layout layout;
     size_t elsize;
     size_t cap;
     uint64_t seed0;
@@ -42,722 +171,6317 @@ struct hashmap {
     int (*compare)(const void *a, const void *b, void *udata);
     void (*elfree)(void *item);
     void *udata;
-    size_t bucketsz;
+    size_t bucketsz; // stride of the buckets array
+    size_t entrysz;  // size of a bucket header followed by its item
     size_t nbuckets;
     size_t count;
     size_t mask;
     size_t growat;
     size_t shrinkat;
+    double max_load;
+    double min_load;
+    double hysteresis;
+    size_t growth;
+    bool shrink;
+    bool incremental;
+    struct hashmap *old; // table being drained by an incremental resize
+    size_t migrated;     // buckets of the old table that are drained
+    bool migrating;      // items of the old table are being moved over
     void *buckets;
+    void *items;     // element array for HASHMAP_LAYOUT_SPLIT
+    struct slab slab; // elements for HASHMAP_LAYOUT_INDIRECT
+    uint8_t *ctrl;   // control bytes for HASHMAP_PROBE_GROUP
+    uint64_t *occupied; // a bit for each bucket that holds an item
+    uint64_t *referenced; // CLOCK bits for each bucket of a bounded map
+    size_t max_count;     // of a bounded map, or zero
+    size_t hand;          // steps taken by the CLOCK hand
+    bool expiry;          // every bucket ends with a deadline
+    uint64_t (*clock)(void *udata);
+    size_t swept;         // next bucket of hashmap_expire_step
+    void *mapping;        // snapshot file that the table lives in, or NULL
+    size_t mapsize;
+    void *small;          // table inside the allocation of the map, or NULL
+    size_t smallcap;      // buckets of the small table
+    size_t max_probe;     // longest probe of an insert before reseeding
+    uint64_t (*reseed_hash)(const void *item, uint64_t seed0, uint64_t seed1);
+    size_t reseeds;       // times the map picked new seeds
+    size_t grows;
+    size_t shrinks;
+    uint64_t resize_ns;   // time spent in resize
+    size_t keysize;       // of the keys of a key/value map, or zero
+    size_t valoff;        // offset of the values of a key/value map
+    size_t keycmp;        // bytes of the keys that memcmp compares, or zero
+#ifdef HASHMAP_STATS
+    struct counters counters;
+    struct counters *ctr; // shared with the old table and copies of the map
+#endif
+    uint32_t (*group_match)(const uint8_t *ctrl, uint8_t tag, uint32_t *empty);
+    size_t group_width;
+    struct concurrent *conc; // readers of a concurrent map
     void *spare;
     void *edata;
 };
 
-static struct bucket *bucket_at(struct hashmap *map, size_t index) {
-    return (struct bucket*)(((char*)map->buckets)+(map->bucketsz*index));
+//-----------------------------------------------------------------------------
+// Control bytes
+//
+// For HASHMAP_PROBE_GROUP every bucket also has a control byte that is either
+// CTRL_EMPTY or the top 7 bits of the stored hash. The robin-hood invariant
+// guarantees that an item is located before the first empty bucket following
+// its home bucket, which allows for comparing whole groups of control bytes at
+// once. The first GROUP_MAX bytes are mirrored after the last bucket so that a
+// group can always be loaded with a single unaligned read.
+//-----------------------------------------------------------------------------
+#define CTRL_EMPTY 0x80
+#define GROUP_MAX 32
+
+static uint8_t ctrl_tag(uint64_t hash) {
+    return (hash >> (HASH_BITS-7)) & 0x7F;
 }
 
-static void *bucket_item(struct bucket *entry) {
-    return ((char*)entry)+sizeof(struct bucket);
+static int ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
 }
 
-static uint64_t get_hash(struct hashmap *map, const void *key) {
-    return map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+static int ctz32(uint32_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
 }
 
-struct hashmap *hashmap_new_with_allocator(
-                            void *(*_malloc)(size_t), 
-                            void *(*_realloc)(void*, size_t), 
-                            void (*_free)(void*),
-                            size_t elsize, size_t cap, 
-                            uint64_t seed0, uint64_t seed1,
-                            uint64_t (*hash)(const void *item, 
-                                             uint64_t seed0, uint64_t seed1),
-                            int (*compare)(const void *a, const void *b, 
-                                           void *udata),
-                            void (*elfree)(void *item),
-                            void *udata)
+static uint32_t group_match_scalar(const uint8_t *ctrl, uint8_t tag,
+                                   uint32_t *empty)
 {
-    _malloc = _malloc ? _malloc : malloc;
-    _realloc = _realloc ? _realloc : realloc;
-    _free = _free ? _free : free;
-    size_t ncap = 16;
-    if (cap < ncap) {
-        cap = ncap;
-    } else {
-        while (ncap < cap) {
-            ncap *= 2;
-        }
-        cap = ncap;
-    }
-    size_t bucketsz = sizeof(struct bucket) + elsize;
-    while (bucketsz & (sizeof(uintptr_t)-1)) {
-        bucketsz++;
-    }
-    // hashmap + spare + edata
-    size_t size = sizeof(struct hashmap)+bucketsz*2;
-    struct hashmap *map = _malloc(size);
-    if (!map) {
-        return NULL;
-    }
-    memset(map, 0, sizeof(struct hashmap));
-    map->elsize = elsize;
-    map->bucketsz = bucketsz;
-    map->seed0 = seed0;
-    map->seed1 = seed1;
-    map->hash = hash;
-    map->compare = compare;
-    map->elfree = elfree;
-    map->udata = udata;
-    map->spare = ((char*)map)+sizeof(struct hashmap);
-    map->edata = (char*)map->spare+bucketsz;
-    map->cap = cap;
-    map->nbuckets = cap;
-    map->mask = map->nbuckets-1;
-    map->buckets = _malloc(map->bucketsz*map->nbuckets);
-    if (!map->buckets) {
-        _free(map);
-        return NULL;
+    const uint64_t lsbs = UINT64_C(0x0101010101010101);
+    const uint64_t msbs = UINT64_C(0x8080808080808080);
+    uint32_t match = 0;
+    *empty = 0;
+    for (int i = 0; i < 2; i++) {
+        uint64_t word;
+        memcpy(&word, ctrl+i*8, 8);
+        // Bytes equal to tag become zero. This may yield false positives,
+        // which is fine because the bucket hash is always checked too.
+        uint64_t x = word ^ (lsbs * tag);
+        uint64_t m = (x - lsbs) & ~x & msbs;
+        uint64_t e = word & msbs;
+        // gather the high bit of each byte into the low 8 bits.
+#define MSBS_TO_BITS(m) ((uint32_t)((((m) >> 7) * UINT64_C(0x0102040810204080)) >> 56))
+        match |= MSBS_TO_BITS(m) << (i*8);
+        *empty |= MSBS_TO_BITS(e) << (i*8);
+#undef MSBS_TO_BITS
     }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
-    map->growat = map->nbuckets*0.75;
-    map->shrinkat = map->nbuckets*0.10;
-    map->malloc = _malloc;
-    map->realloc = _realloc;
-    map->free = _free;
-    return map;  
+    return match;
 }
 
-struct hashmap *hashmap_new(size_t elsize, size_t cap, 
-                            uint64_t seed0, uint64_t seed1,
-                            uint64_t (*hash)(const void *item, 
-                                             uint64_t seed0, uint64_t seed1),
-                            int (*compare)(const void *a, const void *b, 
-                                           void *udata),
-                            void (*elfree)(void *item),
-                            void *udata)
+#ifdef HASHMAP_SSE2
+static uint32_t group_match_sse2(const uint8_t *ctrl, uint8_t tag,
+                                 uint32_t *empty)
 {
-    return hashmap_new_with_allocator(
-        (_malloc?_malloc:malloc),
-        (_realloc?_realloc:realloc),
-        (_free?_free:free),
-        elsize, cap, seed0, seed1, hash, compare, elfree, udata
-    );
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    *empty = _mm_movemask_epi8(group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
 }
+#endif
 
-static void free_elements(struct hashmap *map) {
-    if (map->elfree) {
-        for (size_t i = 0; i < map->nbuckets; i++) {
-            struct bucket *bucket = bucket_at(map, i);
-            if (bucket->dib) map->elfree(bucket_item(bucket));
-        }
-    }
+#ifdef HASHMAP_AVX2
+__attribute__((target("avx2")))
+static uint32_t group_match_avx2(const uint8_t *ctrl, uint8_t tag,
+                                 uint32_t *empty)
+{
+    __m256i group = _mm256_loadu_si256((const __m256i*)ctrl);
+    *empty = _mm256_movemask_epi8(group);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(group,
+                                                  _mm256_set1_epi8(tag)));
 }
+#endif
 
-void hashmap_clear(struct hashmap *map, bool update_cap) {
-    map->count = 0;
-    free_elements(map);
-    if (update_cap) {
-        map->cap = map->nbuckets;
-    } else if (map->nbuckets != map->cap) {
-        void *new_buckets = map->malloc(map->bucketsz*map->cap);
-        if (new_buckets) {
-            map->free(map->buckets);
-            map->buckets = new_buckets;
-        }
-        map->nbuckets = map->cap;
-    }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
-    map->mask = map->nbuckets-1;
-    map->growat = map->nbuckets*0.75;
-    map->shrinkat = map->nbuckets*0.10;
+#ifdef HASHMAP_NEON
+static uint32_t neon_movemask(uint8x16_t v) {
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t m = vandq_u8(v, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
 }
 
+static uint32_t group_match_neon(const uint8_t *ctrl, uint8_t tag,
+                                 uint32_t *empty)
+{
+    uint8x16_t group = vld1q_u8(ctrl);
+    *empty = neon_movemask(vtstq_u8(group, vdupq_n_u8(CTRL_EMPTY)));
+    return neon_movemask(vceqq_u8(group, vdupq_n_u8(tag)));
+}
+#endif
 
-static bool resize(struct hashmap *map, size_t new_cap) {
-    struct hashmap *map2 = hashmap_new_with_allocator(map->malloc, map->realloc, map->free,
-                                                      map->elsize, new_cap, map->seed0, 
-                                                      map->seed1, map->hash, map->compare,
-                                                      map->elfree, map->udata);
-    if (!map2) {
-        return false;
+// Picks the widest group matcher supported by the running cpu.
+static void group_select(struct hashmap *map) {
+    map->group_match = group_match_scalar;
+    map->group_width = 16;
+#if defined(HASHMAP_SSE2)
+    map->group_match = group_match_sse2;
+#endif
+#if defined(HASHMAP_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        map->group_match = group_match_avx2;
+        map->group_width = 32;
     }
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        struct bucket *entry = bucket_at(map, i);
-        if (!entry->dib) {
-            continue;
-        }
-        entry->dib = 1;
-        size_t j = entry->hash & map2->mask;
-        for (;;) {
-            struct bucket *bucket = bucket_at(map2, j);
-            if (bucket->dib == 0) {
-                memcpy(bucket, entry, map->bucketsz);
-                break;
-            }
-            if (bucket->dib < entry->dib) {
-                memcpy(map2->spare, bucket, map->bucketsz);
-                memcpy(bucket, entry, map->bucketsz);
-                memcpy(entry, map2->spare, map->bucketsz);
-            }
-            j = (j + 1) & map2->mask;
-            entry->dib += 1;
-        }
-	}
-    map->free(map->buckets);
-    map->buckets = map2->buckets;
-    map->nbuckets = map2->nbuckets;
-    map->mask = map2->mask;
-    map->growat = map2->growat;
-    map->shrinkat = map2->shrinkat;
-    map->free(map2);
-    return true;
+#endif
+#if defined(HASHMAP_NEON)
+    map->group_match = group_match_neon;
+#endif
 }
 
-void *hashmap_set(struct hashmap *map, const void *item) {
-    if (!item) {
-        panic("item is null");
+static void ctrl_set(struct hashmap *map, size_t index, uint8_t tag) {
+    map->ctrl[index] = tag;
+    for (size_t i = index+map->nbuckets; i < map->nbuckets+GROUP_MAX;
+         i += map->nbuckets)
+    {
+        map->ctrl[i] = tag;
     }
-    map->oom = false;
-    if (map->count == map->growat) {
-        if (!resize(map, map->nbuckets*2)) {
-            map->oom = true;
-            return NULL;
-        }
+}
+
+static struct bucket *bucket_at(struct hashmap *map, size_t index) {
+    return (struct bucket*)(((char*)map->buckets)+(map->bucketsz*index));
+}
+
+static void *bucket_item(struct bucket *entry) {
+    return ((char*)entry)+sizeof(struct bucket);
+}
+
+static void *map_malloc(struct hashmap *map, size_t size) {
+    if (map->allocator.malloc) {
+        return map->allocator.malloc(size, map->allocator.udata);
     }
+    return map->malloc(size);
+}
 
-    
-    struct bucket *entry = map->edata;
-    entry->hash = get_hash(map, item);
-    entry->dib = 1;
-    memcpy(bucket_item(entry), item, map->elsize);
-    
-    size_t i = entry->hash & map->mask;
-	for (;;) {
-        struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib == 0) {
-            memcpy(bucket, entry, map->bucketsz);
-            map->count++;
-			return NULL;
-		}
-        if (entry->hash == bucket->hash && 
-            map->compare(bucket_item(entry), bucket_item(bucket), 
-                         map->udata) == 0)
-        {
-            memcpy(map->spare, bucket_item(bucket), map->elsize);
-            memcpy(bucket_item(bucket), bucket_item(entry), map->elsize);
-            return map->spare;
-		}
-        if (bucket->dib < entry->dib) {
-            memcpy(map->spare, bucket, map->bucketsz);
-            memcpy(bucket, entry, map->bucketsz);
-            memcpy(entry, map->spare, map->bucketsz);
-		}
-		i = (i + 1) & map->mask;
-        entry->dib += 1;
-	}
+static void map_free(struct hashmap *map, void *ptr, size_t size) {
+    if (map->allocator.free) {
+        map->allocator.free(ptr, size, map->allocator.udata);
+    } else {
+        map->free(ptr);
+    }
 }
 
-void *hashmap_get(struct hashmap *map, const void *key) {
-    if (!key) {
-        panic("key is null");
+//-----------------------------------------------------------------------------
+// Slab
+//
+// With HASHMAP_LAYOUT_INDIRECT a bucket holds the index of its element in the
+// slab, where the element stays until it's deleted. Bucket moves then only
+// copy the header and the index.
+//-----------------------------------------------------------------------------
+#define SLAB_CHUNK_SIZE 16384
+
+static void slab_init(struct slab *slab, size_t elsize) {
+    memset(slab, 0, sizeof(struct slab));
+    slab->stride = elsize;
+    while (slab->stride < sizeof(size_t) ||
+           (slab->stride & (sizeof(uintptr_t)-1)))
+    {
+        slab->stride++;
     }
-    uint64_t hash = get_hash(map, key);
-	size_t i = hash & map->mask;
-	for (;;) {
-        struct bucket *bucket = bucket_at(map, i);
-		if (!bucket->dib) {
-			return NULL;
-		}
-		if (bucket->hash == hash && 
-            map->compare(key, bucket_item(bucket), map->udata) == 0)
-        {
-            return bucket_item(bucket);
-		}
-		i = (i + 1) & map->mask;
-	}
+    slab->shift = 4;
+    while ((slab->stride << slab->shift) < SLAB_CHUNK_SIZE) {
+        slab->shift++;
+    }
+    slab->free = SIZE_MAX;
 }
 
-void *hashmap_probe(struct hashmap *map, uint64_t position) {
-    size_t i = position & map->mask;
-    struct bucket *bucket = bucket_at(map, i);
-    if (!bucket->dib) {
-		return NULL;
-	}
-    return bucket_item(bucket);
+static void *slab_item(struct slab *slab, size_t index) {
+    size_t mask = ((size_t)1 << slab->shift) - 1;
+    return slab->chunks[index >> slab->shift] + (index & mask)*slab->stride;
 }
 
-void *hashmap_delete(struct hashmap *map, void *key) {
-    if (!key) {
-        panic("key is null");
+// Returns the index of an unused element, or SIZE_MAX when out of memory.
+static size_t slab_alloc(struct hashmap *map) {
+    struct slab *slab = &map->slab;
+    if (slab->free != SIZE_MAX) {
+        size_t index = slab->free;
+        memcpy(&slab->free, slab_item(slab, index), sizeof(size_t));
+        return index;
     }
-    map->oom = false;
-    uint64_t hash = get_hash(map, key);
-	size_t i = hash & map->mask;
-	for (;;) {
-        struct bucket *bucket = bucket_at(map, i);
-		if (!bucket->dib) {
-			return NULL;
-		}
-		if (bucket->hash == hash && 
-            map->compare(key, bucket_item(bucket), map->udata) == 0)
-        {
-            memcpy(map->spare, bucket_item(bucket), map->elsize);
-            bucket->dib = 0;
-            for (;;) {
-                struct bucket *prev = bucket;
-                i = (i + 1) & map->mask;
-                bucket = bucket_at(map, i);
-                if (bucket->dib <= 1) {
-                    prev->dib = 0;
-                    break;
-                }
-                memcpy(prev, bucket, map->bucketsz);
-                prev->dib--;
+    if ((slab->len >> slab->shift) == slab->nchunks) {
+        if (slab->nchunks == slab->chunkcap) {
+            size_t cap = slab->chunkcap ? slab->chunkcap*2 : 16;
+            char **chunks = map_malloc(map, cap*sizeof(char*));
+            if (!chunks) {
+                return SIZE_MAX;
             }
-            map->count--;
-            if (map->nbuckets > map->cap && map->count <= map->shrinkat) {
-                // Ignore the return value. It's ok for the resize operation to
-                // fail to allocate enough memory because a shrink operation
-                // does not change the integrity of the data.
-                resize(map, map->nbuckets/2);
+            if (slab->nchunks) {
+                memcpy(chunks, slab->chunks, slab->nchunks*sizeof(char*));
+                map_free(map, slab->chunks, slab->chunkcap*sizeof(char*));
             }
-			return map->spare;
-		}
-		i = (i + 1) & map->mask;
-	}
+            slab->chunks = chunks;
+            slab->chunkcap = cap;
+        }
+        char *chunk = map_malloc(map, slab->stride << slab->shift);
+        if (!chunk) {
+            return SIZE_MAX;
+        }
+        slab->chunks[slab->nchunks++] = chunk;
+    }
+    return slab->len++;
 }
 
-size_t hashmap_count(struct hashmap *map) {
-    return map->count;
+static void slab_release(struct slab *slab, size_t index) {
+    memcpy(slab_item(slab, index), &slab->free, sizeof(size_t));
+    slab->free = index;
 }
 
-void hashmap_free(struct hashmap *map) {
-    if (!map) return;
-    free_elements(map);
-    map->free(map->buckets);
-    map->free(map);
+// Forgets all elements, keeping the chunks for reuse.
+static void slab_reset(struct slab *slab) {
+    slab->len = 0;
+    slab->free = SIZE_MAX;
 }
 
-bool hashmap_oom(struct hashmap *map) {
-    return map->oom;
+static void slab_destroy(struct hashmap *map) {
+    struct slab *slab = &map->slab;
+    for (size_t i = 0; i < slab->nchunks; i++) {
+        map_free(map, slab->chunks[i], slab->stride << slab->shift);
+    }
+    if (slab->chunks) {
+        map_free(map, slab->chunks, slab->chunkcap*sizeof(char*));
+    }
 }
 
-bool hashmap_scan(struct hashmap *map, 
-                  bool (*iter)(const void *item, void *udata), void *udata)
-{
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib) {
-            if (!iter(bucket_item(bucket), udata)) {
-                return false;
-            }
-        }
+static size_t *bucket_slab_index(struct bucket *bucket) {
+    return (size_t*)bucket_item(bucket);
+}
+
+static void *item_at(struct hashmap *map, size_t index) {
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        return ((char*)map->items)+(map->elsize*index);
     }
-    return true;
+    if (map->layout == HASHMAP_LAYOUT_INDIRECT) {
+        return slab_item(&map->slab, *bucket_slab_index(bucket_at(map, index)));
+    }
+    return bucket_item(bucket_at(map, index));
 }
 
-bool hashmap_iter(struct hashmap *map, size_t *i, void **item)
+// Tells if the keys a and b of n bytes differ. The common sizes are given to
+// memcmp as constants, which then compiles to a few loads.
+static int keys_differ(const void *a, const void *b, size_t n) {
+    switch (n) {
+    case 4:
+        return memcmp(a, b, 4) != 0;
+    case 8:
+        return memcmp(a, b, 8) != 0;
+    case 16:
+        return memcmp(a, b, 16) != 0;
+    default:
+        return memcmp(a, b, n) != 0;
+    }
+}
+
+// Compares key with an item, without calling out for a key/value map that
+// has no compare function.
+static int compare_item(struct hashmap *map, const void *key,
+                        const void *item)
 {
-    struct bucket *bucket;
+    if (map->keycmp) {
+        return keys_differ(key, item, map->keycmp);
+    }
+    return map->compare(key, item, map->udata);
+}
 
-    do {
-        if (*i >= map->nbuckets) return false;
+// Compares key with the item in the bucket at index.
+static int compare_at(struct hashmap *map, const void *key, size_t index) {
+    STAT_COMPARE(map);
+    return compare_item(map, key, item_at(map, index));
+}
 
-        bucket = bucket_at(map, *i);
-        (*i)++;
-    } while (!bucket->dib);
+// The deadline of an expiring item is kept in the last 8 bytes of its bucket,
+// and in those of an entry, or directly after the item of an entry of a
+// split map. Zero is no deadline.
+static uint64_t *bucket_deadline(struct hashmap *map, struct bucket *bucket) {
+    return (uint64_t*)((char*)bucket+map->bucketsz-sizeof(uint64_t));
+}
 
-    *item = bucket_item(bucket);
+static uint64_t *entry_deadline(struct hashmap *map, struct bucket *entry) {
+    size_t size = map->layout == HASHMAP_LAYOUT_SPLIT ? map->entrysz :
+                  map->bucketsz;
+    return (uint64_t*)((char*)entry+size-sizeof(uint64_t));
+}
 
-    return true;
+// Copies the bucket at index, header and item, into a contiguous entry.
+static void load_entry(struct hashmap *map, size_t index, struct bucket *entry)
+{
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        *entry = *bucket_at(map, index);
+        memcpy(bucket_item(entry), item_at(map, index), map->elsize);
+        if (map->expiry) {
+            *entry_deadline(map, entry) =
+                *bucket_deadline(map, bucket_at(map, index));
+        }
+    } else {
+        memcpy(entry, bucket_at(map, index), map->bucketsz);
+    }
 }
 
+static void occupy(struct hashmap *map, size_t index) {
+    if (map->occupied) {
+        map->occupied[index/64] |= (uint64_t)1 << (index%64);
+    }
+}
 
-//-----------------------------------------------------------------------------
-// SipHash reference C implementation
-//
-// Copyright (c) 2012-2016 Jean-Philippe Aumasson
-// <jeanphilippe.aumasson@gmail.com>
-// Copyright (c) 2012-2014 Daniel J. Bernstein <djb@cr.yp.to>
-//
-// To the extent possible under law, the author(s) have dedicated all copyright
-// and related and neighboring rights to this software to the public domain
-// worldwide. This software is distributed without any warranty.
-//
-// You should have received a copy of the CC0 Public Domain Dedication along
-// with this software. If not, see
-// <http://creativecommons.org/publicdomain/zero/1.0/>.
-//
-// default: SipHash-2-4
-//-----------------------------------------------------------------------------
-static uint64_t SIP64(const uint8_t *in, const size_t inlen, 
-                      uint64_t seed0, uint64_t seed1) 
+// Marks the item in the bucket at index as recently used. Readers of a
+// sharded map may do so at the same time.
+static void reference(struct hashmap *map, size_t index) {
+    if (map->referenced) {
+        uint64_t *word = &map->referenced[index/64];
+        uint64_t bit = (uint64_t)1 << (index%64);
+        if (!(*word & bit)) {
+#if defined(__GNUC__)
+            __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+#else
+            *word |= bit;
+#endif
+        }
+    }
+}
+
+// Returns the first bucket at or after index that holds an item, or nbuckets.
+static size_t next_occupied(struct hashmap *map, size_t index) {
+    size_t nwords = (map->nbuckets+63)/64;
+    size_t w = index/64;
+    if (w >= nwords) {
+        return map->nbuckets;
+    }
+    uint64_t bits = map->occupied[w] & (~(uint64_t)0 << (index%64));
+    while (!bits) {
+        if (++w == nwords) {
+            return map->nbuckets;
+        }
+        bits = map->occupied[w];
+    }
+    return w*64+ctz64(bits);
+}
+
+static void store_entry(struct hashmap *map, size_t index,
+                        const struct bucket *entry)
 {
-#define U8TO64_LE(p) \
-    {  (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | \
-        ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | \
-        ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | \
-        ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56)) }
-#define U64TO8_LE(p, v) \
-    { U32TO8_LE((p), (uint32_t)((v))); \
-      U32TO8_LE((p) + 4, (uint32_t)((v) >> 32)); }
-#define U32TO8_LE(p, v) \
-    { (p)[0] = (uint8_t)((v)); \
-      (p)[1] = (uint8_t)((v) >> 8); \
-      (p)[2] = (uint8_t)((v) >> 16); \
-      (p)[3] = (uint8_t)((v) >> 24); }
-#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
-#define SIPROUND \
-    { v0 += v1; v1 = ROTL(v1, 13); \
-      v1 ^= v0; v0 = ROTL(v0, 32); \
-      v2 += v3; v3 = ROTL(v3, 16); \
-      v3 ^= v2; \
-      v0 += v3; v3 = ROTL(v3, 21); \
-      v3 ^= v0; \
-      v2 += v1; v1 = ROTL(v1, 17); \
-      v1 ^= v2; v2 = ROTL(v2, 32); }
-    uint64_t k0 = U8TO64_LE((uint8_t*)&seed0);
-    uint64_t k1 = U8TO64_LE((uint8_t*)&seed1);
-    uint64_t v3 = UINT64_C(0x7465646279746573) ^ k1;
-    uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ k0;
-    uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ k1;
-    uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ k0;
-    const uint8_t *end = in + inlen - (inlen % sizeof(uint64_t));
-    for (; in != end; in += 8) {
-        uint64_t m = U8TO64_LE(in);
-        v3 ^= m;
-        SIPROUND; SIPROUND;
-        v0 ^= m;
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        *bucket_at(map, index) = *entry;
+        memcpy(item_at(map, index), bucket_item((struct bucket*)entry),
+               map->elsize);
+        if (map->expiry) {
+            *bucket_deadline(map, bucket_at(map, index)) =
+                *entry_deadline(map, (struct bucket*)entry);
+        }
+    } else {
+        memcpy(bucket_at(map, index), entry, map->bucketsz);
     }
-    const int left = inlen & 7;
-    uint64_t b = ((uint64_t)inlen) << 56;
-    switch (left) {
-    case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
-    case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
-    case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
-    case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
-    case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
-    case 2: b |= ((uint64_t)in[1]) << 8; /* fall through */
-    case 1: b |= ((uint64_t)in[0]); break;
-    case 0: break;
+    if (map->ctrl) {
+        ctrl_set(map, index, ctrl_tag(entry->hash));
     }
-    v3 ^= b;
-    SIPROUND; SIPROUND;
-    v0 ^= b;
-    v2 ^= 0xff;
-    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
-    b = v0 ^ v1 ^ v2 ^ v3;
-    uint64_t out = 0;
-    U64TO8_LE((uint8_t*)&out, b);
-    return out;
+    occupy(map, index);
 }
 
-//-----------------------------------------------------------------------------
-// MurmurHash3 was written by Austin Appleby, and is placed in the public
-// domain. The author hereby disclaims copyright to this source code.
-//
-// Murmur3_86_128
-//-----------------------------------------------------------------------------
-static uint64_t MM86128(const void *key, const int len, uint32_t seed) {
-#define	ROTL32(x, r) ((x << r) | (x >> (32 - r)))
-#define FMIX32(h) h^=h>>16; h*=0x85ebca6b; h^=h>>13; h*=0xc2b2ae35; h^=h>>16;
-    const uint8_t * data = (const uint8_t*)key;
-    const int nblocks = len / 16;
-    uint32_t h1 = seed;
-    uint32_t h2 = seed;
-    uint32_t h3 = seed;
-    uint32_t h4 = seed;
-    uint32_t c1 = 0x239b961b; 
-    uint32_t c2 = 0xab0e9789;
-    uint32_t c3 = 0x38b34ae5; 
-    uint32_t c4 = 0xa1e38b93;
-    const uint32_t * blocks = (const uint32_t *)(data + nblocks*16);
-    for (int i = -nblocks; i; i++) {
-        uint32_t k1 = blocks[i*4+0];
-        uint32_t k2 = blocks[i*4+1];
-        uint32_t k3 = blocks[i*4+2];
-        uint32_t k4 = blocks[i*4+3];
-        k1 *= c1; k1  = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
-        h1 = ROTL32(h1,19); h1 += h2; h1 = h1*5+0x561ccd1b;
-        k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
-        h2 = ROTL32(h2,17); h2 += h3; h2 = h2*5+0x0bcaa747;
-        k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3;
-        h3 = ROTL32(h3,15); h3 += h4; h3 = h3*5+0x96cd1c35;
-        k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4;
-        h4 = ROTL32(h4,13); h4 += h1; h4 = h4*5+0x32ac3b17;
+static void move_bucket(struct hashmap *map, size_t dst, size_t src) {
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        *bucket_at(map, dst) = *bucket_at(map, src);
+        memcpy(item_at(map, dst), item_at(map, src), map->elsize);
+        if (map->expiry) {
+            *bucket_deadline(map, bucket_at(map, dst)) =
+                *bucket_deadline(map, bucket_at(map, src));
+        }
+    } else {
+        memcpy(bucket_at(map, dst), bucket_at(map, src), map->bucketsz);
     }
-    const uint8_t * tail = (const uint8_t*)(data + nblocks*16);
-    uint32_t k1 = 0;
-    uint32_t k2 = 0;
-    uint32_t k3 = 0;
-    uint32_t k4 = 0;
-    switch(len & 15) {
-    case 15: k4 ^= tail[14] << 16; /* fall through */
-    case 14: k4 ^= tail[13] << 8; /* fall through */
-    case 13: k4 ^= tail[12] << 0;
-             k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4;
-             /* fall through */
-    case 12: k3 ^= tail[11] << 24; /* fall through */
-    case 11: k3 ^= tail[10] << 16; /* fall through */
-    case 10: k3 ^= tail[ 9] << 8; /* fall through */
-    case  9: k3 ^= tail[ 8] << 0;
-             k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3;
-             /* fall through */
-    case  8: k2 ^= tail[ 7] << 24; /* fall through */
-    case  7: k2 ^= tail[ 6] << 16; /* fall through */
-    case  6: k2 ^= tail[ 5] << 8; /* fall through */
-    case  5: k2 ^= tail[ 4] << 0;
-             k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
-             /* fall through */
-    case  4: k1 ^= tail[ 3] << 24; /* fall through */
-    case  3: k1 ^= tail[ 2] << 16; /* fall through */
-    case  2: k1 ^= tail[ 1] << 8; /* fall through */
-    case  1: k1 ^= tail[ 0] << 0;
-             k1 *= c1; k1  = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
-             /* fall through */
-    };
-    h1 ^= len; h2 ^= len; h3 ^= len; h4 ^= len;
-    h1 += h2; h1 += h3; h1 += h4;
-    h2 += h1; h3 += h1; h4 += h1;
-    FMIX32(h1); FMIX32(h2); FMIX32(h3); FMIX32(h4);
-    h1 += h2; h1 += h3; h1 += h4;
-    h2 += h1; h3 += h1; h4 += h1;
-    return (((uint64_t)h2)<<32)|h1;
+    if (map->ctrl) {
+        ctrl_set(map, dst, map->ctrl[src]);
+    }
+    occupy(map, dst);
+    if (map->referenced) {
+        uint64_t bit = (uint64_t)1 << (dst%64);
+        if ((map->referenced[src/64] >> (src%64)) & 1) {
+            map->referenced[dst/64] |= bit;
+        } else {
+            map->referenced[dst/64] &= ~bit;
+        }
+    }
+}
+
+static void clear_bucket(struct hashmap *map, size_t index) {
+    bucket_at(map, index)->dib = 0;
+    if (map->ctrl) {
+        ctrl_set(map, index, CTRL_EMPTY);
+    }
+    if (map->occupied) {
+        map->occupied[index/64] &= ~((uint64_t)1 << (index%64));
+    }
+    if (map->referenced) {
+        map->referenced[index/64] &= ~((uint64_t)1 << (index%64));
+    }
+}
+
+// Returns the size of the allocation that holds a table with nbuckets.
+static size_t table_size(struct hashmap *map, size_t nbuckets) {
+    size_t size = map->bucketsz*nbuckets;
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        size += map->elsize*nbuckets;
+    }
+    if (map->group_match) {
+        size += nbuckets+GROUP_MAX;
+    }
+    size_t nbitmaps = map->max_count ? 2 : 1;
+    return size+(nbuckets+63)/64*sizeof(uint64_t)*nbitmaps;
+}
+
+#define HUGEPAGE_SIZE (2*1024*1024)
+#define SNAPSHOT_HEADER 256 // bytes in front of the table in a snapshot file
+#define RECYCLE_CLASSES 64
+
+// Returns the alignment of a table allocation of size bytes, or zero.
+static size_t table_align(struct hashmap *map, size_t size) {
+    size_t align = map->align;
+    if (map->hugepages && size >= HUGEPAGE_SIZE && align < HUGEPAGE_SIZE) {
+        align = HUGEPAGE_SIZE;
+    }
+    return align;
+}
+
+static int table_class(size_t nbuckets) {
+    int n = 0;
+    while (nbuckets > 1) {
+        nbuckets >>= 1;
+        n++;
+    }
+    return n;
+}
+
+// Allocates a zeroed table with nbuckets. The default allocator uses calloc,
+// which may provide lazily zeroed pages rather than touching the whole table
+// up front. Aligned tables keep the pointer to their allocation right in
+// front of them.
+static void *table_alloc(struct hashmap *map, size_t nbuckets) {
+    size_t size = table_size(map, nbuckets);
+    if (map->small && nbuckets == map->smallcap && map->buckets != map->small) {
+        memset(map->small, 0, size);
+        return map->small;
+    }
+    if (map->recycled && map->recycled[table_class(nbuckets)]) {
+        void *buckets = map->recycled[table_class(nbuckets)];
+        map->recycled[table_class(nbuckets)] = NULL;
+        memset(buckets, 0, size);
+        return buckets;
+    }
+    size_t align = table_align(map, size);
+    size_t msize = align ? size+align+sizeof(void*) : size;
+    void *mem;
+    if (map->malloc == malloc && !map->allocator.malloc) {
+        mem = calloc(1, msize);
+    } else {
+        mem = map_malloc(map, msize);
+        if (mem) {
+            memset(mem, 0, msize);
+        }
+    }
+    if (!mem || !align) {
+        return mem;
+    }
+    uintptr_t addr = ((uintptr_t)mem+sizeof(void*)+align-1) & ~(align-1);
+    char *buckets = (char*)addr;
+    memcpy(buckets-sizeof(void*), &mem, sizeof(void*));
+#ifdef HASHMAP_MADVISE
+    if (align >= HUGEPAGE_SIZE) {
+        madvise(buckets, size & ~(size_t)(HUGEPAGE_SIZE-1), MADV_HUGEPAGE);
+    }
+#endif
+    return buckets;
+}
+
+static void table_release(struct hashmap *map, void *buckets,
+                          size_t nbuckets)
+{
+#ifdef HASHMAP_MMAP
+    if (map->mapping && (char*)buckets == (char*)map->mapping+SNAPSHOT_HEADER) {
+        munmap(map->mapping, map->mapsize);
+        map->mapping = NULL;
+        return;
+    }
+#endif
+    if (buckets == map->small) {
+        return;
+    }
+    size_t size = table_size(map, nbuckets);
+    size_t align = table_align(map, size);
+    if (align) {
+        void *mem;
+        memcpy(&mem, (char*)buckets-sizeof(void*), sizeof(void*));
+        map_free(map, mem, size+align+sizeof(void*));
+    } else {
+        map_free(map, buckets, size);
+    }
+}
+
+// Returns true when the table can be resized to nbuckets within its own
+// allocation. Split tables, aligned tables, recycled tables and mapped tables
+// are always replaced, as are the tables of concurrent maps that readers may
+// still use, and a small table or one that becomes small.
+static bool table_reallocable(struct hashmap *map, size_t nbuckets) {
+    if (map->layout == HASHMAP_LAYOUT_SPLIT || map->recycled || map->mapping) {
+        return false;
+    }
+    if (map->small &&
+        (map->buckets == map->small || nbuckets == map->smallcap))
+    {
+        return false;
+    }
+#ifndef HASHMAP_NO_THREADS
+    if (map->conc) {
+        return false;
+    }
+#endif
+    if (table_align(map, table_size(map, map->nbuckets)) ||
+        table_align(map, table_size(map, nbuckets)))
+    {
+        return false;
+    }
+    if (map->allocator.malloc) {
+        return map->allocator.realloc != NULL;
+    }
+    return map->realloc != NULL;
+}
+
+static void *table_realloc(struct hashmap *map, void *buckets, size_t size,
+                           size_t new_size)
+{
+    if (map->allocator.malloc) {
+        return map->allocator.realloc(buckets, size, new_size,
+                                      map->allocator.udata);
+    }
+    return map->realloc(buckets, new_size);
+}
+
+// Frees a table, or keeps it for reuse when recycling.
+static void table_free(struct hashmap *map, void *buckets, size_t nbuckets) {
+    if (map->recycled && buckets != map->small &&
+        !map->recycled[table_class(nbuckets)])
+    {
+        map->recycled[table_class(nbuckets)] = buckets;
+        return;
+    }
+    table_release(map, buckets, nbuckets);
+}
+
+// Points the map to the parts of a table with nbuckets. The bucket headers,
+// items, control bytes and occupancy bits all share this one allocation.
+static void table_attach(struct hashmap *map, void *buckets, size_t nbuckets) {
+    map->buckets = buckets;
+    map->nbuckets = nbuckets;
+    map->mask = nbuckets-1;
+    char *p = (char*)buckets+map->bucketsz*nbuckets;
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        map->items = p;
+        p += map->elsize*nbuckets;
+    }
+    if (map->group_match) {
+        map->ctrl = (uint8_t*)p;
+        p += nbuckets+GROUP_MAX;
+    }
+    map->occupied = (uint64_t*)p;
+    if (map->max_count) {
+        map->referenced = map->occupied+(nbuckets+63)/64;
+    }
+    map->growat = map->nbuckets*map->max_load;
+    map->shrinkat = map->nbuckets*map->min_load;
+    if (map->growat == 0) {
+        map->growat = 1;
+    }
+    if (map->max_count) {
+        // a bounded map evicts rather than grows
+        map->growat = SIZE_MAX;
+    }
+}
+
+// Points the map to a table with zeroed buckets.
+static void table_init(struct hashmap *map, void *buckets, size_t nbuckets) {
+    table_attach(map, buckets, nbuckets);
+    if (map->group_match) {
+        memset(map->ctrl, CTRL_EMPTY, nbuckets+GROUP_MAX);
+    }
+    memset(map->occupied, 0, (nbuckets+63)/64*sizeof(uint64_t));
+    if (map->max_count) {
+        memset(map->referenced, 0, (nbuckets+63)/64*sizeof(uint64_t));
+    }
+}
+
+// Returns the number of buckets to shrink to when the load dropped to
+// min_load, which is the current number when the map doesn't shrink. The
+// table halves while the load stays at least hysteresis below max_load.
+static size_t shrink_target(struct hashmap *map) {
+    size_t nbuckets = map->nbuckets;
+    if (!map->shrink || map->count > map->shrinkat) {
+        return nbuckets;
+    }
+    while (nbuckets > map->cap &&
+           map->count <= nbuckets/2*(map->max_load-map->hysteresis))
+    {
+        nbuckets /= 2;
+    }
+    return nbuckets;
+}
+
+static uint64_t get_hash(struct hashmap *map, const void *key) {
+    if (!map->hash) {
+        // a key/value map hashes the bytes of its keys by default
+        return clip_hash(hashmap_xxhash3(key, map->keysize, map->seed0,
+                                         map->seed1));
+    }
+    return clip_hash(map->hash(key, map->seed0, map->seed1));
 }
 
 //-----------------------------------------------------------------------------
+// Concurrent reads
 //
-// xxHash3
-//
+// A concurrent map has a single writer and any number of lock-free readers.
+// Every write is bracketed by a sequence counter that is odd while the table
+// is being changed, and readers retry a probe that overlapped with a write.
+// Readers reach the table through a view that is published by the writer. A
+// bucket array that was replaced is freed after a grace period: each reader
+// announces itself in one of two epochs, and the writer flips the epoch and
+// waits for the readers of the previous one to leave.
 //-----------------------------------------------------------------------------
-#define XXH_PRIME_1 11400714785074694791ULL
-#define XXH_PRIME_2 14029467366897019727ULL
-#define XXH_PRIME_3 1609587929392839161ULL
-#define XXH_PRIME_4 9650029242287828579ULL
-#define XXH_PRIME_5 2870177450012600261ULL
+#ifndef HASHMAP_NO_THREADS
 
-uint64_t XXH_read64(const void* memptr) {
-    uint64_t val;
-    memcpy(&val, memptr, sizeof(val));
-    return val;
+#include <sched.h>
+
+#define READER_STRIPES 16
+
+struct view {
+    char *buckets;
+    char *items;
+    size_t mask;
+};
+
+struct concurrent {
+    size_t seq;
+    size_t epoch;
+    struct view *view;
+    struct view views[2];
+    // the readers of each epoch, spread over cache lines by thread
+    struct {
+        size_t n;
+        char pad[64-sizeof(size_t)];
+    } readers[2][READER_STRIPES];
+};
+
+static void write_begin(struct hashmap *map) {
+    if (map->conc) {
+        __atomic_store_n(&map->conc->seq, map->conc->seq+1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static void write_end(struct hashmap *map) {
+    if (map->conc) {
+        __atomic_store_n(&map->conc->seq, map->conc->seq+1, __ATOMIC_RELEASE);
+    }
+}
+
+// Publishes the current table to the readers. The views alternate, which is
+// safe because every replaced view is followed by a grace period.
+static void view_publish(struct hashmap *map) {
+    struct concurrent *c = map->conc;
+    struct view *view = c->view == &c->views[0] ? &c->views[1] : &c->views[0];
+    view->buckets = map->buckets;
+    view->items = map->items;
+    view->mask = map->mask;
+    __atomic_store_n(&c->view, view, __ATOMIC_SEQ_CST);
+}
+
+static void grace_period(struct concurrent *c) {
+    size_t epoch = c->epoch;
+    __atomic_store_n(&c->epoch, epoch^1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < READER_STRIPES; i++) {
+        while (__atomic_load_n(&c->readers[epoch][i].n, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+    }
+}
+
+static bool read_valid(struct concurrent *c, size_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Probes a view for a reader. Candidates are copied into item and validated
+// before they are compared. Returns -1 if the probe overlapped with a write.
+static int view_get(struct hashmap *map, struct view *view, const void *key,
+                    uint64_t hash, void *item, size_t seq)
+{
+    struct concurrent *c = map->conc;
+    size_t i = hash & view->mask;
+    for (size_t n = 0; n <= view->mask; n++) {
+        char *b = view->buckets+map->bucketsz*i;
+        struct bucket bucket;
+        memcpy(&bucket, b, sizeof(struct bucket));
+        if (!bucket.dib) {
+            break;
+        }
+        if (bucket.hash == hash) {
+            if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+                memcpy(item, view->items+map->elsize*i, map->elsize);
+            } else {
+                memcpy(item, b+sizeof(struct bucket), map->elsize);
+            }
+            if (!read_valid(c, seq)) {
+                return -1;
+            }
+            if (compare_item(map, key, item) == 0) {
+                return 1;
+            }
+        }
+        i = (i + 1) & view->mask;
+    }
+    return read_valid(c, seq) ? 0 : -1;
+}
+
+bool hashmap_get_concurrent(struct hashmap *map, const void *key, void *item) {
+    if (!key) {
+        panic("key is null");
+    }
+    if (!item) {
+        panic("item is null");
+    }
+    if (!map->conc) {
+        panic("map is not concurrent");
+    }
+    struct concurrent *c = map->conc;
+    uint64_t hash = get_hash(map, key);
+    // threads have separate stacks
+    uint64_t stripe = (uintptr_t)&hash >> 16;
+    stripe = (stripe * UINT64_C(0x9E3779B97F4A7C15) >> 32) % READER_STRIPES;
+    for (int retries = 1; ; retries++) {
+        size_t epoch = __atomic_load_n(&c->epoch, __ATOMIC_SEQ_CST);
+        size_t *readers = &c->readers[epoch][stripe].n;
+        __atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+        int found = -1;
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            struct view *view = __atomic_load_n(&c->view, __ATOMIC_SEQ_CST);
+            found = view_get(map, view, key, hash, item, seq);
+        }
+        // Leave before retrying, or a writer in a grace period would wait
+        // on this reader.
+        __atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+        if (found >= 0) {
+            return found;
+        }
+        if (retries % 64 == 0) {
+            // the writer may have been preempted
+            sched_yield();
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+#else
+
+static void write_begin(struct hashmap *map) { (void)map; }
+static void write_end(struct hashmap *map) { (void)map; }
+
+#endif // HASHMAP_NO_THREADS
+
+// Frees a bucket array that the map no longer uses.
+static void retire_table(struct hashmap *map, void *buckets, size_t nbuckets)
+{
+#ifndef HASHMAP_NO_THREADS
+    if (map->conc) {
+        view_publish(map);
+        grace_period(map->conc);
+    }
+#endif
+    table_free(map, buckets, nbuckets);
+}
+
+static size_t buckets_for(struct hashmap *map, size_t nbuckets, size_t n);
+
+// Returns the time of a monotonic clock in nanoseconds. Without one, this
+// falls back to the calendar time in whole seconds, which still orders the
+// deadlines of expiry. A reseed then changes the seeds by mixing in the
+// previous ones, the address of the map and its number of reseeds.
+static uint64_t clock_ns(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+#else
+    return (uint64_t)time(NULL)*1000000000;
+#endif
+}
+
+// Returns the time of a monotonic clock in milliseconds.
+static uint64_t clock_ms(void *udata) {
+    (void)udata;
+    return clock_ns()/1000000;
+}
+
+struct hashmap *hashmap_new_with_options(
+                            const struct hashmap_options *opts,
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    struct hashmap_options defopts = { 0 };
+    if (!opts) {
+        opts = &defopts;
+    }
+#ifdef HASHMAP_NO_THREADS
+    if (opts->concurrent) {
+        return NULL;
+    }
+#endif
+    if (opts->concurrent && opts->incremental) {
+        return NULL;
+    }
+    if (opts->layout == HASHMAP_LAYOUT_INDIRECT &&
+        (opts->concurrent || opts->incremental))
+    {
+        return NULL;
+    }
+    if (opts->max_count && (opts->concurrent || opts->incremental)) {
+        return NULL;
+    }
+    if (opts->expiry && opts->concurrent) {
+        return NULL;
+    }
+    if ((opts->max_probe || opts->reseed_hash) && opts->concurrent) {
+        // readers would hash with the seeds they started out with
+        return NULL;
+    }
+    if (opts->small && (opts->concurrent || opts->incremental ||
+        opts->align || opts->hugepages || opts->probe == HASHMAP_PROBE_GROUP))
+    {
+        return NULL;
+    }
+    if ((opts->align & (opts->align-1)) || (opts->allocator &&
+        (!opts->allocator->malloc || !opts->allocator->free)))
+    {
+        return NULL;
+    }
+    double max_load = opts->max_load ? opts->max_load : 0.75;
+    double min_load = opts->min_load ? opts->min_load : 0.10;
+    double hysteresis = opts->hysteresis ? opts->hysteresis :
+                        max_load-2*min_load;
+    size_t growth = opts->growth ? opts->growth : 2;
+    if (!(max_load > 0 && max_load < 1) || !(min_load > 0) ||
+        (!opts->no_shrink && !(min_load < max_load &&
+         hysteresis > 0 && hysteresis < max_load)) ||
+        growth < 2 || (growth & (growth-1)))
+    {
+        return NULL;
+    }
+    void *(*_malloc)(size_t) = opts->malloc;
+    void *(*_realloc)(void*, size_t) = opts->realloc;
+    void (*_free)(void*) = opts->free;
+    _malloc = _malloc ? _malloc : malloc;
+    if (!_realloc && (!opts->malloc || opts->malloc == malloc)) {
+        _realloc = realloc;
+    }
+    _free = _free ? _free : free;
+    size_t entrysz = sizeof(struct bucket) + elsize;
+    while (entrysz & (sizeof(uintptr_t)-1)) {
+        entrysz++;
+    }
+    size_t bucketsz = entrysz;
+    if (opts->layout == HASHMAP_LAYOUT_SPLIT) {
+        bucketsz = sizeof(struct bucket);
+    } else if (opts->layout == HASHMAP_LAYOUT_INDIRECT) {
+        bucketsz = sizeof(struct bucket)+sizeof(size_t);
+        if (entrysz < bucketsz) {
+            entrysz = bucketsz;
+        }
+    }
+    if (opts->expiry) {
+        // room for a deadline at the end of every bucket and entry
+        entrysz = (entrysz+7)/8*8+sizeof(uint64_t);
+        if (opts->layout == HASHMAP_LAYOUT_INLINE) {
+            bucketsz = entrysz;
+        } else {
+            bucketsz = (bucketsz+7)/8*8+sizeof(uint64_t);
+        }
+    }
+    size_t small = 0, smallsz = 0;
+    if (opts->small) {
+        // The table of a small map follows the entries in the allocation of
+        // the map, which takes its place until the map grows past it.
+        struct hashmap tmp = {
+            .layout = opts->layout, .elsize = elsize, .bucketsz = bucketsz,
+            .entrysz = entrysz, .max_load = max_load,
+            .max_count = opts->max_count,
+        };
+        small = buckets_for(&tmp, 2, opts->small);
+        if (!small) {
+            return NULL;
+        }
+        smallsz = table_size(&tmp, small);
+    }
+    size_t ncap = small ? small : 16;
+    if (cap < ncap) {
+        cap = ncap;
+    } else {
+        while (ncap < cap) {
+            ncap *= 2;
+        }
+        cap = ncap;
+    }
+    // hashmap + spare + edata + an entry for resizing + the small table
+    size_t size = sizeof(struct hashmap)+entrysz*3+smallsz;
+    struct hashmap *map;
+    if (opts->allocator) {
+        map = opts->allocator->malloc(size, opts->allocator->udata);
+    } else {
+        map = _malloc(size);
+    }
+    if (!map) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(struct hashmap));
+    if (opts->allocator) {
+        map->allocator = *opts->allocator;
+    }
+#ifdef HASHMAP_STATS
+    map->ctr = &map->counters;
+    map->ctr->probes = &map->ctr->get_probes;
+#endif
+    map->align = opts->align;
+    map->hugepages = opts->hugepages;
+    map->max_load = max_load;
+    map->min_load = min_load;
+    map->hysteresis = hysteresis;
+    map->growth = growth;
+    map->shrink = !opts->no_shrink;
+    map->layout = opts->layout;
+    map->elsize = elsize;
+    slab_init(&map->slab, elsize);
+    map->bucketsz = bucketsz;
+    map->entrysz = entrysz;
+    map->seed0 = seed0;
+    map->seed1 = seed1;
+    map->hash = hash;
+    map->compare = compare;
+    map->elfree = elfree;
+    map->udata = udata;
+    map->spare = ((char*)map)+sizeof(struct hashmap);
+    map->edata = (char*)map->spare+entrysz;
+    if (small) {
+        map->small = (char*)map->edata+entrysz*2;
+        map->smallcap = small;
+    }
+    map->cap = cap;
+    map->incremental = opts->incremental;
+    map->expiry = opts->expiry;
+    map->clock = opts->clock ? opts->clock : clock_ms;
+    map->max_probe = opts->max_probe ? opts->max_probe : SIZE_MAX;
+    map->reseed_hash = opts->reseed_hash;
+    map->malloc = _malloc;
+    map->realloc = _realloc;
+    map->free = _free;
+    if (opts->probe == HASHMAP_PROBE_GROUP) {
+        group_select(map);
+    }
+    if (opts->max_count) {
+        // the table holds max_count items from the start and never shrinks
+        map->max_count = opts->max_count;
+        map->shrink = false;
+        cap = buckets_for(map, cap, opts->max_count);
+        if (!cap) {
+            map_free(map, map, size);
+            return NULL;
+        }
+        map->cap = cap;
+    }
+    if (opts->recycle) {
+        map->recycled = map_malloc(map, RECYCLE_CLASSES*sizeof(void*));
+        if (!map->recycled) {
+            map_free(map, map, size);
+            return NULL;
+        }
+        memset(map->recycled, 0, RECYCLE_CLASSES*sizeof(void*));
+    }
+    void *buckets = table_alloc(map, cap);
+    if (!buckets) {
+        hashmap_free(map);
+        return NULL;
+    }
+    table_init(map, buckets, cap);
+#ifndef HASHMAP_NO_THREADS
+    if (opts->concurrent) {
+        map->conc = map_malloc(map, sizeof(struct concurrent));
+        if (!map->conc) {
+            hashmap_free(map);
+            return NULL;
+        }
+        memset(map->conc, 0, sizeof(struct concurrent));
+        view_publish(map);
+    }
+#endif
+    return map;
+}
+
+struct hashmap *hashmap_new_with_allocator(
+                            void *(*_malloc)(size_t),
+                            void *(*_realloc)(void*, size_t),
+                            void (*_free)(void*),
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    struct hashmap_options opts = {
+        .malloc = _malloc,
+        .realloc = _realloc,
+        .free = _free,
+    };
+    return hashmap_new_with_options(&opts, elsize, cap, seed0, seed1, hash,
+                                    compare, elfree, udata);
+}
+
+struct hashmap *hashmap_new(size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    return hashmap_new_with_allocator(
+        (_malloc?_malloc:malloc),
+        (_malloc?_realloc:realloc),
+        (_free?_free:free),
+        elsize, cap, seed0, seed1, hash, compare, elfree, udata
+    );
+}
+
+// Makes map a key/value map whose keys are the first keysize bytes of its
+// items, and whose values start at valoff.
+static void kv_init(struct hashmap *map, size_t keysize, size_t valoff) {
+    map->keysize = keysize;
+    map->valoff = valoff;
+    map->keycmp = map->compare ? 0 : keysize;
+}
+
+struct hashmap *hashmap_kv_new_with_options(
+                            const struct hashmap_options *opts,
+                            size_t keysize, size_t valsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *key,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata)
+{
+    if (!keysize) {
+        return NULL;
+    }
+    // The value is aligned like a type of its size would be, up to 8 bytes.
+    // Its size is a multiple of that, so the values of split items line up
+    // too.
+    size_t align = valsize & (~valsize+1);
+    align = align > 8 ? 8 : align ? align : 1;
+    size_t valoff = (keysize+align-1)/align*align;
+    if (valsize > SIZE_MAX-valoff) {
+        return NULL;
+    }
+    struct hashmap *map = hashmap_new_with_options(opts, valoff+valsize, cap,
+                                                   seed0, seed1, hash,
+                                                   compare, NULL, udata);
+    if (map) {
+        kv_init(map, keysize, valoff);
+    }
+    return map;
+}
+
+struct hashmap *hashmap_kv_new(size_t keysize, size_t valsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *key,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata)
+{
+    struct hashmap_options opts = {
+        .malloc = _malloc ? _malloc : malloc,
+        .realloc = _malloc ? _realloc : realloc,
+        .free = _free ? _free : free,
+    };
+    return hashmap_kv_new_with_options(&opts, keysize, valsize, cap, seed0,
+                                       seed1, hash, compare, udata);
+}
+
+static void free_old(struct hashmap *map);
+
+static void free_elements(struct hashmap *map) {
+    if (map->old) {
+        free_elements(map->old);
+    }
+    if (map->elfree) {
+        for (size_t i = next_occupied(map, 0); i < map->nbuckets;
+             i = next_occupied(map, i+1))
+        {
+            map->elfree(item_at(map, i));
+        }
+    }
+}
+
+void hashmap_clear(struct hashmap *map, bool update_cap) {
+    write_begin(map);
+    map->count = 0;
+    free_elements(map);
+    free_old(map);
+    slab_reset(&map->slab);
+    void *buckets = map->buckets;
+    size_t nbuckets = map->nbuckets;
+    if (update_cap) {
+        map->cap = map->nbuckets;
+    } else if (map->nbuckets != map->cap) {
+        void *new_buckets = table_alloc(map, map->cap);
+        if (new_buckets) {
+            buckets = new_buckets;
+            nbuckets = map->cap;
+        }
+    }
+    void *old_buckets = map->buckets;
+    size_t old_nbuckets = map->nbuckets;
+    if (buckets == old_buckets) {
+        memset(buckets, 0, map->bucketsz*nbuckets);
+    }
+    table_init(map, buckets, nbuckets);
+    if (buckets != old_buckets) {
+        retire_table(map, old_buckets, old_nbuckets);
+    }
+    write_end(map);
+}
+
+
+static bool begin_migration(struct hashmap *map, size_t new_cap);
+static void migrate(struct hashmap *map, size_t nbuckets);
+
+#define DIB_UNPLACED DIB_MAX
+
+// Rehashes the items into the first nbuckets buckets of the table, which must
+// have room for both the current and the new number of buckets. All items are
+// marked as unplaced and then inserted again. An insert takes the bucket of an
+// unplaced item as if it were empty and goes on with inserting that item
+// instead. The control bytes and occupancy bits are left for the caller to
+// rebuild, and the reference bits of a bounded map start over.
+static void rehash_in_place(struct hashmap *map, size_t nbuckets) {
+    size_t old_nbuckets = map->nbuckets;
+    for (size_t i = 0; i < old_nbuckets; i++) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib) {
+            bucket->dib = DIB_UNPLACED;
+        }
+    }
+    if (nbuckets > old_nbuckets) {
+        memset(bucket_at(map, old_nbuckets), 0,
+               map->bucketsz*(nbuckets-old_nbuckets));
+    }
+    map->nbuckets = nbuckets;
+    map->mask = nbuckets-1;
+    map->ctrl = NULL;
+    map->occupied = NULL;
+    map->referenced = NULL;
+    struct bucket *entry = map->edata;
+    struct bucket *spare = (struct bucket*)((char*)map->edata+map->entrysz);
+    for (size_t i = 0; i < old_nbuckets; i++) {
+        if (bucket_at(map, i)->dib != DIB_UNPLACED) {
+            continue;
+        }
+        load_entry(map, i, entry);
+        bucket_at(map, i)->dib = 0;
+        entry->dib = 1;
+        size_t j = entry->hash & map->mask;
+        for (;;) {
+            struct bucket *bucket = bucket_at(map, j);
+            if (bucket->dib == 0) {
+                store_entry(map, j, entry);
+                break;
+            }
+            if (bucket->dib == DIB_UNPLACED) {
+                load_entry(map, j, spare);
+                store_entry(map, j, entry);
+                memcpy(entry, spare, map->entrysz);
+                entry->dib = 1;
+                j = entry->hash & map->mask;
+                continue;
+            }
+            if (bucket->dib < entry->dib) {
+                load_entry(map, j, spare);
+                store_entry(map, j, entry);
+                memcpy(entry, spare, map->entrysz);
+            }
+            j = (j + 1) & map->mask;
+            entry->dib += 1;
+        }
+    }
+}
+
+// Points the map to a table that was rehashed in place, and rebuilds its
+// control bytes and occupancy bits.
+static void table_restore(struct hashmap *map, void *buckets, size_t nbuckets) {
+    table_init(map, buckets, nbuckets);
+    for (size_t i = 0; i < nbuckets; i++) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib) {
+            if (map->ctrl) {
+                ctrl_set(map, i, ctrl_tag(bucket->hash));
+            }
+            occupy(map, i);
+        }
+    }
+}
+
+// Resizes the table with realloc, moving the items within the allocation.
+// A grow needs no second table next to the old one, and a shrink first packs
+// the items into the lower buckets and then gives back the rest.
+static bool resize_in_place(struct hashmap *map, size_t new_cap) {
+    size_t nbuckets = map->nbuckets;
+    size_t size = table_size(map, nbuckets);
+    size_t new_size = table_size(map, new_cap);
+    void *buckets;
+    bool ok = true;
+    if (new_cap > nbuckets) {
+        buckets = table_realloc(map, map->buckets, size, new_size);
+        if (!buckets) {
+            return false;
+        }
+        map->buckets = buckets;
+        rehash_in_place(map, new_cap);
+    } else {
+        rehash_in_place(map, new_cap);
+        buckets = table_realloc(map, map->buckets, size, new_size);
+        if (!buckets) {
+            // keep the table in its current allocation
+            rehash_in_place(map, nbuckets);
+            buckets = map->buckets;
+            new_cap = nbuckets;
+            ok = false;
+        }
+    }
+    table_restore(map, buckets, new_cap);
+    return ok;
+}
+
+// Picks new seeds and rehashes the items in place. An insert that probes more
+// than max_probe buckets points to keys that were crafted to collide, which a
+// weak hash or a known seed makes possible.
+static void reseed(struct hashmap *map) {
+    uint64_t state[4] = {
+        map->seed0, map->seed1, (uintptr_t)map, clock_ns(),
+    };
+    map->seed0 = hashmap_sip(state, sizeof(state), map->reseeds, 0);
+    map->seed1 = hashmap_sip(state, sizeof(state), map->reseeds, 1);
+    map->reseeds++;
+    if (map->reseed_hash) {
+        map->hash = map->reseed_hash;
+        map->reseed_hash = NULL;
+    }
+    size_t nbuckets = map->nbuckets;
+    for (size_t i = 0; i < nbuckets; i++) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib) {
+            bucket->hash = get_hash(map, item_at(map, i));
+        }
+    }
+    rehash_in_place(map, nbuckets);
+    table_restore(map, map->buckets, nbuckets);
+    // When the keys still collide, as with a hash that ignores its seeds,
+    // the limit backs off so that the map doesn't rehash on every insert.
+    size_t longest = 0;
+    for (size_t i = 0; i < nbuckets; i++) {
+        size_t dib = bucket_at(map, i)->dib;
+        longest = dib > longest ? dib : longest;
+    }
+    if (longest >= map->max_probe) {
+        map->max_probe = longest*2;
+    }
+}
+
+static bool resize_table(struct hashmap *map, size_t new_cap) {
+    if (map->incremental) {
+        return begin_migration(map, new_cap);
+    }
+    if (table_reallocable(map, new_cap)) {
+        return resize_in_place(map, new_cap);
+    }
+    void *buckets = table_alloc(map, new_cap);
+    if (!buckets) {
+        return false;
+    }
+    // The new table is filled through a copy of the map. It gets its own
+    // spare, because the spare of the map may hold a deleted item.
+    struct hashmap tmp = *map;
+    struct hashmap *map2 = &tmp;
+    map2->spare = (char*)map->edata+map->entrysz;
+    table_init(map2, buckets, new_cap);
+    struct bucket *entry = map->edata;
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        if (!bucket_at(map, i)->dib) {
+            continue;
+        }
+        load_entry(map, i, entry);
+        entry->dib = 1;
+        size_t j = entry->hash & map2->mask;
+        for (;;) {
+            struct bucket *bucket = bucket_at(map2, j);
+            if (bucket->dib == 0) {
+                store_entry(map2, j, entry);
+                break;
+            }
+            if (bucket->dib < entry->dib) {
+                load_entry(map2, j, map2->spare);
+                store_entry(map2, j, entry);
+                memcpy(entry, map2->spare, map->entrysz);
+            }
+            j = (j + 1) & map2->mask;
+            entry->dib += 1;
+        }
+	}
+    void *old_buckets = map->buckets;
+    size_t old_nbuckets = map->nbuckets;
+    map->buckets = map2->buckets;
+    map->items = map2->items;
+    map->ctrl = map2->ctrl;
+    map->occupied = map2->occupied;
+    map->referenced = map2->referenced;
+    map->nbuckets = map2->nbuckets;
+    map->mask = map2->mask;
+    map->growat = map2->growat;
+    map->shrinkat = map2->shrinkat;
+    retire_table(map, old_buckets, old_nbuckets);
+    return true;
+}
+
+// Resizes the table, keeping count of the resizes and their time.
+static bool resize(struct hashmap *map, size_t new_cap) {
+    size_t nbuckets = map->nbuckets;
+    uint64_t start = clock_ns();
+    bool ok = resize_table(map, new_cap);
+    map->resize_ns += clock_ns()-start;
+    if (ok && new_cap > nbuckets) {
+        map->grows++;
+    } else if (ok && new_cap < nbuckets) {
+        map->shrinks++;
+    }
+    return ok;
+}
+
+// Returns the least number of buckets, from nbuckets up, that holds n items
+// without growing, or zero when the table would be too large.
+static size_t buckets_for(struct hashmap *map, size_t nbuckets, size_t n) {
+    while ((size_t)(nbuckets*map->max_load) < n) {
+        if (nbuckets > SIZE_MAX/2/map->entrysz) {
+            return 0;
+        }
+        nbuckets *= 2;
+    }
+    return nbuckets;
+}
+
+// Resizes the table to nbuckets after draining an incremental resize.
+static bool resize_to(struct hashmap *map, size_t nbuckets) {
+    write_begin(map);
+    if (map->old) {
+        migrate(map, SIZE_MAX);
+    }
+    bool ok = nbuckets == map->nbuckets || resize(map, nbuckets);
+    write_end(map);
+    map->oom = !ok;
+    return ok;
+}
+
+bool hashmap_reserve(struct hashmap *map, size_t n) {
+    size_t nbuckets = buckets_for(map, map->nbuckets, n);
+    if (!nbuckets) {
+        map->oom = true;
+        return false;
+    }
+    if (nbuckets == map->nbuckets && !map->old) {
+        map->oom = false;
+        return true;
+    }
+    return resize_to(map, nbuckets);
+}
+
+bool hashmap_shrink_to_fit(struct hashmap *map) {
+    return resize_to(map, buckets_for(map, map->cap, hashmap_count(map)));
+}
+
+static void evict(struct hashmap *map);
+
+// Finds the bucket that holds key in the table of the map, ignoring map->old,
+// or makes room for it at its robin-hood position by shifting the rest of the
+// cluster forward by one bucket. Only the header of a new bucket is set,
+// which saves staging the item and swapping it through every displaced
+// bucket. Returns the index of the bucket, or SIZE_MAX when out of memory.
+static size_t table_slot(struct hashmap *map, const void *key, uint64_t hash,
+                         bool *existed)
+{
+    map->oom = false;
+    if (map->count >= map->growat) {
+        if (!resize(map, map->nbuckets*map->growth)) {
+            map->oom = true;
+            return SIZE_MAX;
+        }
+    }
+    size_t i = hash & map->mask;
+    size_t dib = 1;
+    for (;;) {
+        STAT_PROBE(map);
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib == 0) {
+            break;
+        }
+        if (bucket->hash == hash && compare_at(map, key, i) == 0) {
+            reference(map, i);
+            *existed = true;
+            return i;
+        }
+        if (bucket->dib < dib) {
+            break;
+        }
+        i = (i + 1) & map->mask;
+        dib++;
+    }
+    if (dib > map->max_probe && !map->migrating) {
+        if (map->old) {
+            // the items left in the old table are hashed with the old seeds
+            migrate(map, SIZE_MAX);
+        }
+        reseed(map);
+        return table_slot(map, key, get_hash(map, key), existed);
+    }
+    if (map->max_count && map->count >= map->max_count) {
+        // The eviction shifts buckets, which moves the slot of the item.
+        evict(map);
+        return table_slot(map, key, hash, existed);
+    }
+    if (dib >= DIB_UNPLACED) {
+        panic("probe distance overflow");
+    }
+    size_t index = 0;
+    if (map->layout == HASHMAP_LAYOUT_INDIRECT) {
+        index = slab_alloc(map);
+        if (index == SIZE_MAX) {
+            map->oom = true;
+            return SIZE_MAX;
+        }
+    }
+    if (bucket_at(map, i)->dib) {
+        size_t j = i;
+        while (bucket_at(map, j)->dib) {
+            j = (j + 1) & map->mask;
+        }
+        while (j != i) {
+            size_t k = (j - 1) & map->mask;
+            if (bucket_at(map, k)->dib >= DIB_UNPLACED-1) {
+                panic("probe distance overflow");
+            }
+            move_bucket(map, j, k);
+            bucket_at(map, j)->dib++;
+            j = k;
+        }
+    }
+    struct bucket *bucket = bucket_at(map, i);
+    bucket->hash = hash;
+    bucket->dib = dib;
+    occupy(map, i);
+    if (map->expiry) {
+        *bucket_deadline(map, bucket) = 0;
+    }
+    if (map->layout == HASHMAP_LAYOUT_INDIRECT) {
+        *bucket_slab_index(bucket) = index;
+    }
+    if (map->ctrl) {
+        ctrl_set(map, i, ctrl_tag(hash));
+    }
+    map->count++;
+    *existed = false;
+    return i;
+}
+
+// Copies item into the slot. A replaced item is first copied into out,
+// which is returned.
+static void *fill_slot(struct hashmap *map, void *slot, const void *item,
+                       bool existed, void *out)
+{
+    if (existed) {
+        memcpy(out, slot, map->elsize);
+        memcpy(slot, item, map->elsize);
+        return out;
+    }
+    memcpy(slot, item, map->elsize);
+    return NULL;
+}
+
+// Inserts or replaces an item in the table of the map, ignoring map->old.
+static void *table_set(struct hashmap *map, const void *item, uint64_t hash,
+                       void *out)
+{
+    bool existed;
+    size_t i = table_slot(map, item, hash, &existed);
+    if (i == SIZE_MAX) {
+        return NULL;
+    }
+    return fill_slot(map, item_at(map, i), item, existed, out);
+}
+
+static size_t find_group(struct hashmap *map, const void *key, uint64_t hash) {
+    uint8_t tag = ctrl_tag(hash);
+    size_t i = hash & map->mask;
+    for (;;) {
+        STAT_PROBE(map);
+        uint32_t empty;
+        uint32_t match = map->group_match(map->ctrl+i, tag, &empty);
+        if (empty) {
+            // only the buckets before the first empty one are candidates
+            match &= (empty & -empty) - 1;
+        }
+        while (match) {
+            size_t j = (i + ctz32(match)) & map->mask;
+            if (bucket_at(map, j)->hash == hash &&
+                compare_at(map, key, j) == 0)
+            {
+                reference(map, j);
+                return j;
+            }
+            match &= match - 1;
+        }
+        if (empty) {
+            return SIZE_MAX;
+        }
+        i = (i + map->group_width) & map->mask;
+    }
+}
+
+// Finds the bucket of an item in the table of the map, ignoring map->old.
+// Returns SIZE_MAX when the item is not there.
+static size_t table_find(struct hashmap *map, const void *key, uint64_t hash) {
+    if (map->ctrl) {
+        return find_group(map, key, hash);
+    }
+	size_t i = hash & map->mask;
+	for (;;) {
+        STAT_PROBE(map);
+        struct bucket *bucket = bucket_at(map, i);
+		if (!bucket->dib) {
+			return SIZE_MAX;
+		}
+		if (bucket->hash == hash && compare_at(map, key, i) == 0) {
+            reference(map, i);
+            return i;
+		}
+		i = (i + 1) & map->mask;
+	}
+}
+
+// Removes the item at index by shifting the items that follow it back.
+static void remove_at(struct hashmap *map, size_t i) {
+    if (map->layout == HASHMAP_LAYOUT_INDIRECT) {
+        slab_release(&map->slab, *bucket_slab_index(bucket_at(map, i)));
+    }
+    clear_bucket(map, i);
+    for (;;) {
+        size_t prev = i;
+        i = (i + 1) & map->mask;
+        if (bucket_at(map, i)->dib <= 1) {
+            clear_bucket(map, prev);
+            break;
+        }
+        move_bucket(map, prev, i);
+        bucket_at(map, prev)->dib--;
+    }
+    map->count--;
+}
+
+// An odd multiplier turns the hand into a permutation of the buckets.
+#define CLOCK_STRIDE ((size_t)0x9E3779B97F4A7C15)
+
+// Evicts an item from a full bounded map with the CLOCK algorithm. The hand
+// clears the reference bits of the items it passes and stops at the first item
+// that was not referenced since the hand last passed it. It visits the buckets
+// in a scrambled order, because sweeping them front to back would only evict
+// behind a point that every insert may land ahead of, and the buckets ahead of
+// the hand would fill up into long clusters.
+static void evict(struct hashmap *map) {
+    for (;;) {
+        size_t i = (map->hand++ * CLOCK_STRIDE) & map->mask;
+        uint64_t bit = (uint64_t)1 << (i%64);
+        if (!(map->occupied[i/64] & bit)) {
+            continue;
+        }
+        if (map->referenced[i/64] & bit) {
+            map->referenced[i/64] &= ~bit;
+            continue;
+        }
+        if (map->elfree) {
+            map->elfree(item_at(map, i));
+        }
+        remove_at(map, i);
+        return;
+    }
+}
+
+// Deletes an item from the table of the map, ignoring map->old. The item is
+// copied into out, which is returned.
+static void *table_delete(struct hashmap *map, const void *key,
+                          uint64_t hash, void *out)
+{
+    map->oom = false;
+	size_t i = hash & map->mask;
+	for (;;) {
+        STAT_PROBE(map);
+        struct bucket *bucket = bucket_at(map, i);
+		if (!bucket->dib) {
+			return NULL;
+		}
+		if (bucket->hash == hash && compare_at(map, key, i) == 0) {
+            memcpy(out, item_at(map, i), map->elsize);
+            remove_at(map, i);
+            size_t nbuckets = map->old ? map->nbuckets : shrink_target(map);
+            if (nbuckets < map->nbuckets) {
+                // Ignore the return value. It's ok for the resize operation to
+                // fail to allocate enough memory because a shrink operation
+                // does not change the integrity of the data.
+                resize(map, nbuckets);
+            }
+			return out;
+		}
+		i = (i + 1) & map->mask;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Incremental resizing
+//
+// Rather than moving all items at once, a resize moves the current table into
+// a shadow map, map->old, which is then drained into the new table a bounded
+// number of buckets at a time by hashmap_set and hashmap_delete. Lookups
+// consult both tables until the old one is empty.
+//-----------------------------------------------------------------------------
+#define MIGRATE_STEP 16
+
+static void free_old(struct hashmap *map) {
+    if (map->old) {
+        table_free(map, map->old->buckets, map->old->nbuckets);
+        map_free(map, map->old, sizeof(struct hashmap));
+        map->old = NULL;
+    }
+}
+
+static bool begin_migration(struct hashmap *map, size_t new_cap) {
+    if (map->old) {
+        migrate(map, SIZE_MAX);
+    }
+    void *buckets = table_alloc(map, new_cap);
+    if (!buckets) {
+        return false;
+    }
+    struct hashmap *old = map_malloc(map, sizeof(struct hashmap));
+    if (!old) {
+        table_free(map, buckets, new_cap);
+        return false;
+    }
+    *old = *map;
+    // the old table never resizes on its own
+    old->cap = old->nbuckets;
+    old->incremental = false;
+    map->old = old;
+    map->migrated = 0;
+    map->count = 0;
+    table_init(map, buckets, new_cap);
+    return true;
+}
+
+// Moves the items in up to nbuckets buckets of the old table into the new
+// one, and releases the old table once it's empty.
+static void migrate(struct hashmap *map, size_t nbuckets) {
+    struct hashmap *old = map->old;
+    map->migrating = true;
+    for (; nbuckets > 0 && old->count > 0; nbuckets--) {
+        struct bucket *bucket = bucket_at(old, map->migrated);
+        if (!bucket->dib) {
+            map->migrated++;
+            continue;
+        }
+        // The item is never in the new table already, and the new table is
+        // large enough to hold all items of both tables.
+        bool existed;
+        size_t i = table_slot(map, item_at(old, map->migrated), bucket->hash,
+                              &existed);
+        memcpy(item_at(map, i), item_at(old, map->migrated), map->elsize);
+        if (map->expiry) {
+            *bucket_deadline(map, bucket_at(map, i)) =
+                *bucket_deadline(old, bucket);
+        }
+        remove_at(old, map->migrated);
+    }
+    map->migrating = false;
+    if (old->count == 0) {
+        free_old(map);
+    }
+}
+
+// Tells whether the deadline of the item in the bucket at index of table,
+// the map or its old table, has passed. The clock is only read for items that
+// have a deadline.
+static bool expired(struct hashmap *map, struct hashmap *table, size_t index) {
+    uint64_t deadline = *bucket_deadline(table, bucket_at(table, index));
+    return deadline && deadline <= map->clock(map->udata);
+}
+
+// Removes an expired item from table, passing it to elfree.
+static void remove_expired(struct hashmap *map, struct hashmap *table,
+                           size_t index)
+{
+    if (map->elfree) {
+        map->elfree(item_at(table, index));
+    }
+    remove_at(table, index);
+    if (table != map) {
+        migrate(map, 0);
+    }
+}
+
+// Finds or makes the slot for key in either table. The contents of a new
+// slot are undefined. An expired item is released and its slot taken as a
+// new one. The deadline of the slot is returned for a map with expiry, or
+// NULL. Returns NULL when out of memory.
+static void *emplace_with_hash(struct hashmap *map, const void *key,
+                               uint64_t hash, bool *existed,
+                               uint64_t **deadline)
+{
+    if (map->incremental && !map->old && map->count >= map->growat) {
+        // Grow before looking for the item, which then may be in either table.
+        map->oom = false;
+        if (!resize(map, map->nbuckets*map->growth)) {
+            map->oom = true;
+            return NULL;
+        }
+    }
+    if (map->old) {
+        migrate(map, MIGRATE_STEP);
+    }
+    struct hashmap *table = map;
+    size_t i = SIZE_MAX;
+    if (map->old) {
+        i = table_find(map->old, key, hash);
+        if (i != SIZE_MAX) {
+            map->oom = false;
+            *existed = true;
+            table = map->old;
+        } else if (map->count+map->old->count >= map->growat) {
+            // Only when the map grows faster than it migrates.
+            migrate(map, SIZE_MAX);
+            return emplace_with_hash(map, key, hash, existed, deadline);
+        }
+    }
+    if (i == SIZE_MAX) {
+        i = table_slot(map, key, hash, existed);
+        if (i == SIZE_MAX) {
+            return NULL;
+        }
+    }
+    void *slot = item_at(table, i);
+    *deadline = NULL;
+    if (map->expiry) {
+        if (*existed && expired(map, table, i)) {
+            if (map->elfree) {
+                map->elfree(slot);
+            }
+            *existed = false;
+        }
+        *deadline = bucket_deadline(table, bucket_at(table, i));
+    }
+    return slot;
+}
+
+// Inserts or replaces an item that expires at deadline, or never when zero.
+// A replaced item is copied into out, which is returned.
+static void *set_with_deadline(struct hashmap *map, const void *item,
+                               uint64_t hash, uint64_t deadline, void *out)
+{
+    STAT_OP(map, set);
+    if (map->conc) {
+        write_begin(map);
+        void *prev = table_set(map, item, hash, out);
+        write_end(map);
+        return prev;
+    }
+    bool existed;
+    uint64_t *slot_deadline;
+    void *slot = emplace_with_hash(map, item, hash, &existed, &slot_deadline);
+    if (!slot) {
+        return NULL;
+    }
+    if (slot_deadline) {
+        *slot_deadline = deadline;
+    }
+    return fill_slot(map, slot, item, existed, out);
+}
+
+// Inserts or replaces an item. A replaced item is copied into out, which is
+// returned.
+static void *set_with_hash(struct hashmap *map, const void *item,
+                           uint64_t hash, void *out)
+{
+    return set_with_deadline(map, item, hash, 0, out);
+}
+
+void *hashmap_set(struct hashmap *map, const void *item) {
+    if (!item) {
+        panic("item is null");
+    }
+    return set_with_hash(map, item, get_hash(map, item), map->spare);
+}
+
+void *hashmap_set_with_hash(struct hashmap *map, const void *item,
+                            uint64_t hash)
+{
+    if (!item) {
+        panic("item is null");
+    }
+    return set_with_hash(map, item, clip_hash(hash), map->spare);
+}
+
+void *hashmap_set_ttl(struct hashmap *map, const void *item, uint64_t ttl) {
+    if (!item) {
+        panic("item is null");
+    }
+    if (!map->expiry) {
+        panic("map has no expiry");
+    }
+    uint64_t deadline = 0;
+    if (ttl) {
+        uint64_t now = map->clock(map->udata);
+        deadline = now+ttl < now ? UINT64_MAX : now+ttl;
+    }
+    return set_with_deadline(map, item, get_hash(map, item), deadline,
+                             map->spare);
+}
+
+void *hashmap_emplace(struct hashmap *map, const void *key, bool *existed) {
+    if (!key) {
+        panic("key is null");
+    }
+    if (map->conc) {
+        panic("emplace is not supported by concurrent maps");
+    }
+    bool found = false;
+    uint64_t *deadline;
+    STAT_OP(map, set);
+    void *item = emplace_with_hash(map, key, get_hash(map, key), &found,
+                                   &deadline);
+    if (item && !found) {
+        memcpy(item, key, map->elsize);
+        if (deadline) {
+            *deadline = 0;
+        }
+    }
+    if (existed) {
+        *existed = found;
+    }
+    return item;
+}
+
+static void *get_with_hash(struct hashmap *map, const void *key,
+                           uint64_t hash)
+{
+    STAT_OP(map, get);
+    struct hashmap *table = map;
+    size_t i = table_find(map, key, hash);
+    if (i == SIZE_MAX && map->old) {
+        table = map->old;
+        i = table_find(table, key, hash);
+    }
+    if (i == SIZE_MAX) {
+        return NULL;
+    }
+    if (map->expiry && expired(map, table, i)) {
+        remove_expired(map, table, i);
+        return NULL;
+    }
+    return item_at(table, i);
+}
+
+void *hashmap_get(struct hashmap *map, const void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    return get_with_hash(map, key, get_hash(map, key));
+}
+
+uint64_t hashmap_hash(struct hashmap *map, const void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    return get_hash(map, key);
+}
+
+void *hashmap_get_with_hash(struct hashmap *map, const void *key,
+                            uint64_t hash)
+{
+    if (!key) {
+        panic("key is null");
+    }
+    return get_with_hash(map, key, clip_hash(hash));
+}
+
+void *hashmap_probe(struct hashmap *map, uint64_t position) {
+    size_t i = position & map->mask;
+    struct bucket *bucket = bucket_at(map, i);
+    if (!bucket->dib) {
+		return NULL;
+	}
+    return item_at(map, i);
+}
+
+// Deletes an item. The item is copied into out, which is returned.
+static void *delete_with_hash(struct hashmap *map, const void *key,
+                              uint64_t hash, void *out)
+{
+    STAT_OP(map, delete);
+    if (map->conc) {
+        write_begin(map);
+        void *prev = table_delete(map, key, hash, out);
+        write_end(map);
+        return prev;
+    }
+    if (map->old) {
+        migrate(map, MIGRATE_STEP);
+    }
+    void *prev = table_delete(map, key, hash, out);
+    if (!prev && map->old) {
+        prev = table_delete(map->old, key, hash, out);
+        migrate(map, 0);
+    }
+    return prev;
+}
+
+void *hashmap_delete(struct hashmap *map, void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    return delete_with_hash(map, key, get_hash(map, key), map->spare);
+}
+
+void *hashmap_delete_with_hash(struct hashmap *map, const void *key,
+                               uint64_t hash)
+{
+    if (!key) {
+        panic("key is null");
+    }
+    return delete_with_hash(map, key, clip_hash(hash), map->spare);
+}
+
+bool hashmap_set_into(struct hashmap *map, const void *item, void *old) {
+    if (!item) {
+        panic("item is null");
+    }
+    if (!old) {
+        panic("old is null");
+    }
+    return set_with_hash(map, item, get_hash(map, item), old) != NULL;
+}
+
+bool hashmap_delete_into(struct hashmap *map, const void *key, void *old) {
+    if (!key) {
+        panic("key is null");
+    }
+    if (!old) {
+        panic("old is null");
+    }
+    return delete_with_hash(map, key, get_hash(map, key), old) != NULL;
+}
+
+static void kv_check(struct hashmap *map, const void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    if (!map->keysize) {
+        panic("map is not a key/value map");
+    }
+}
+
+void *hashmap_kv_get(struct hashmap *map, const void *key) {
+    kv_check(map, key);
+    char *item = get_with_hash(map, key, get_hash(map, key));
+    return item ? item+map->valoff : NULL;
+}
+
+void *hashmap_kv_set(struct hashmap *map, const void *key, const void *value,
+                     bool *existed)
+{
+    kv_check(map, key);
+    size_t valsize = map->elsize-map->valoff;
+    if (!value && valsize) {
+        panic("value is null");
+    }
+    if (map->conc) {
+        panic("kv set is not supported by concurrent maps");
+    }
+    bool found = false;
+    uint64_t *deadline;
+    STAT_OP(map, set);
+    char *item = emplace_with_hash(map, key, get_hash(map, key), &found,
+                                   &deadline);
+    if (!item) {
+        return NULL;
+    }
+    if (!found) {
+        memcpy(item, key, map->keysize);
+    }
+    if (deadline) {
+        *deadline = 0;
+    }
+    if (value) {
+        memcpy(item+map->valoff, value, valsize);
+    }
+    if (existed) {
+        *existed = found;
+    }
+    return item+map->valoff;
+}
+
+bool hashmap_kv_delete(struct hashmap *map, const void *key, void *value) {
+    kv_check(map, key);
+    char *item = delete_with_hash(map, key, get_hash(map, key), map->spare);
+    if (item && value) {
+        memcpy(value, item+map->valoff, map->elsize-map->valoff);
+    }
+    return item != NULL;
+}
+
+void *hashmap_kv_value(struct hashmap *map, const void *item) {
+    if (!item) {
+        panic("item is null");
+    }
+    return (char*)item+map->valoff;
+}
+
+size_t hashmap_expire_step(struct hashmap *map, size_t budget) {
+    if (!map->expiry) {
+        return 0;
+    }
+    if (map->old) {
+        migrate(map, budget);
+    }
+    uint64_t now = map->clock(map->udata);
+    size_t removed = 0;
+    size_t i = map->swept & map->mask;
+    size_t n = 0;
+    while (n < budget && map->count > 0) {
+        size_t j = next_occupied(map, i);
+        if (j == map->nbuckets) {
+            n += j-i;
+            i = 0;
+            continue;
+        }
+        n += j-i+1;
+        uint64_t deadline = *bucket_deadline(map, bucket_at(map, j));
+        if (deadline && deadline <= now) {
+            // the item that is shifted into the bucket is looked at next
+            remove_expired(map, map, j);
+            removed++;
+            i = j;
+        } else {
+            i = j+1 < map->nbuckets ? j+1 : 0;
+        }
+    }
+    map->swept = i;
+    if (removed && !map->old) {
+        size_t nbuckets = shrink_target(map);
+        if (nbuckets < map->nbuckets) {
+            // a failed shrink leaves the table as it is
+            resize(map, nbuckets);
+        }
+    }
+    return removed;
+}
+
+// The number of keys that are hashed and prefetched ahead of the probes in
+// the hashmap_*_many operations.
+#define BATCH 32
+
+static void prefetch_home(struct hashmap *map, uint64_t hash) {
+#if defined(__GNUC__)
+    size_t i = hash & map->mask;
+    __builtin_prefetch(bucket_at(map, i));
+    if (map->layout == HASHMAP_LAYOUT_SPLIT) {
+        __builtin_prefetch(item_at(map, i));
+    }
+    if (map->ctrl) {
+        __builtin_prefetch(map->ctrl+i);
+    }
+#else
+    (void)map; (void)hash;
+#endif
+}
+
+static size_t hash_batch(struct hashmap *map, const void *items, size_t n,
+                         size_t i, uint64_t hashes[BATCH])
+{
+    size_t m = n-i < BATCH ? n-i : BATCH;
+    for (size_t j = 0; j < m; j++) {
+        hashes[j] = get_hash(map, (char*)items+(i+j)*map->elsize);
+        prefetch_home(map, hashes[j]);
+    }
+    return m;
+}
+
+void hashmap_get_many(struct hashmap *map, const void *keys, size_t n,
+                      void **items)
+{
+    if (n && (!keys || !items)) {
+        panic("keys is null");
+    }
+    uint64_t hashes[BATCH];
+    for (size_t i = 0; i < n; i += BATCH) {
+        size_t m = hash_batch(map, keys, n, i, hashes);
+        for (size_t j = 0; j < m; j++) {
+            const void *key = (char*)keys+(i+j)*map->elsize;
+            items[i+j] = get_with_hash(map, key, hashes[j]);
+        }
+    }
+}
+
+size_t hashmap_set_many(struct hashmap *map, const void *items, size_t n) {
+    if (n && !items) {
+        panic("items is null");
+    }
+    uint64_t hashes[BATCH];
+    for (size_t i = 0; i < n; i += BATCH) {
+        size_t reseeds = map->reseeds;
+        size_t m = hash_batch(map, items, n, i, hashes);
+        for (size_t j = 0; j < m; j++) {
+            const void *item = (char*)items+(i+j)*map->elsize;
+            // a reseed outdates the rest of the batch
+            uint64_t hash = map->reseeds == reseeds ? hashes[j] :
+                            get_hash(map, item);
+            void *prev = set_with_hash(map, item, hash, map->spare);
+            if (prev) {
+                if (map->elfree) {
+                    map->elfree(prev);
+                }
+            } else if (map->oom) {
+                return i+j;
+            }
+        }
+    }
+    map->oom = false;
+    return n;
+}
+
+size_t hashmap_delete_many(struct hashmap *map, const void *keys, size_t n) {
+    if (n && !keys) {
+        panic("keys is null");
+    }
+    size_t deleted = 0;
+    uint64_t hashes[BATCH];
+    for (size_t i = 0; i < n; i += BATCH) {
+        size_t m = hash_batch(map, keys, n, i, hashes);
+        for (size_t j = 0; j < m; j++) {
+            const void *key = (char*)keys+(i+j)*map->elsize;
+            void *prev = delete_with_hash(map, key, hashes[j], map->spare);
+            if (prev) {
+                if (map->elfree) {
+                    map->elfree(prev);
+                }
+                deleted++;
+            }
+        }
+    }
+    return deleted;
+}
+
+// Returns the size of an exported record, which keeps the items of records
+// that follow each other aligned.
+static size_t record_size(struct hashmap *map) {
+    return sizeof(uint64_t)+(map->elsize+7)/8*8;
+}
+
+size_t hashmap_export(struct hashmap *map, size_t *cursor, void *buf,
+                      size_t size)
+{
+    if (!cursor || !buf) {
+        panic("buf is null");
+    }
+    size_t recsz = record_size(map);
+    if (size < recsz) {
+        panic("buf is smaller than a record");
+    }
+    char *p = buf;
+    char *end = p+size/recsz*recsz;
+    while (p < end) {
+        // the positions of an old table follow those of the map
+        struct hashmap *table = map;
+        size_t base = 0;
+        if (*cursor >= map->nbuckets) {
+            if (!map->old) {
+                break;
+            }
+            table = map->old;
+            base = map->nbuckets;
+        }
+        size_t i = next_occupied(table, *cursor-base);
+        if (i >= table->nbuckets) {
+            *cursor = base+table->nbuckets;
+            if (table == map->old) {
+                break;
+            }
+            continue;
+        }
+        uint64_t hash = bucket_at(table, i)->hash;
+        memcpy(p, &hash, sizeof(uint64_t));
+        memcpy(p+sizeof(uint64_t), item_at(table, i), map->elsize);
+        memset(p+sizeof(uint64_t)+map->elsize, 0,
+               recsz-sizeof(uint64_t)-map->elsize);
+        p += recsz;
+        *cursor = base+i+1;
+    }
+    return (size_t)(p-(char*)buf);
+}
+
+size_t hashmap_import(struct hashmap *map, const void *data, size_t size) {
+    if (size && !data) {
+        panic("data is null");
+    }
+    map->oom = false;
+    if ((uintptr_t)data & 7) {
+        errno = EINVAL;
+        return 0;
+    }
+    size_t recsz = record_size(map);
+    size_t n = size/recsz;
+    const char *recs = data;
+    if (n && !map->reseeds) {
+        // one item per call is checked, which turns down streams from maps
+        // with another hash function or other seeds
+        uint64_t hash;
+        memcpy(&hash, recs, sizeof(uint64_t));
+        if (get_hash(map, recs+sizeof(uint64_t)) != clip_hash(hash)) {
+            errno = EILSEQ;
+            return 0;
+        }
+    }
+    uint64_t hashes[BATCH];
+    for (size_t i = 0; i < n; i += BATCH) {
+        size_t m = n-i < BATCH ? n-i : BATCH;
+        for (size_t j = 0; j < m; j++) {
+            memcpy(&hashes[j], recs+(i+j)*recsz, sizeof(uint64_t));
+            hashes[j] = clip_hash(hashes[j]);
+            prefetch_home(map, hashes[j]);
+        }
+        for (size_t j = 0; j < m; j++) {
+            const void *item = recs+(i+j)*recsz+sizeof(uint64_t);
+            // the records hold hashes of the seeds that the map started with
+            uint64_t hash = map->reseeds ? get_hash(map, item) : hashes[j];
+            void *prev = set_with_hash(map, item, hash, map->spare);
+            if (prev) {
+                if (map->elfree) {
+                    map->elfree(prev);
+                }
+            } else if (map->oom) {
+                return (i+j)*recsz;
+            }
+        }
+    }
+    map->oom = false;
+    return n*recsz;
+}
+
+size_t hashmap_count(struct hashmap *map) {
+    return map->count + (map->old ? map->old->count : 0);
+}
+
+// Returns the size of the allocation of the map, which holds the small table.
+static size_t map_size(struct hashmap *map) {
+    size_t size = sizeof(struct hashmap)+map->entrysz*3;
+    return map->small ? size+table_size(map, map->smallcap) : size;
+}
+
+void hashmap_free(struct hashmap *map) {
+    if (!map) return;
+    free_elements(map);
+    free_old(map);
+    slab_destroy(map);
+    if (map->buckets) {
+        table_release(map, map->buckets, map->nbuckets);
+    }
+    if (map->recycled) {
+        for (int i = 0; i < RECYCLE_CLASSES; i++) {
+            if (map->recycled[i]) {
+                table_release(map, map->recycled[i], (size_t)1 << i);
+            }
+        }
+        map_free(map, map->recycled, RECYCLE_CLASSES*sizeof(void*));
+    }
+#ifndef HASHMAP_NO_THREADS
+    if (map->conc) {
+        map_free(map, map->conc, sizeof(struct concurrent));
+    }
+#endif
+    map_free(map, map, map_size(map));
+}
+
+bool hashmap_oom(struct hashmap *map) {
+    return map->oom;
+}
+
+bool hashmap_scan(struct hashmap *map,
+                  bool (*iter)(const void *item, void *udata), void *udata)
+{
+    for (size_t i = next_occupied(map, 0); i < map->nbuckets;
+         i = next_occupied(map, i+1))
+    {
+        if (!iter(item_at(map, i), udata)) {
+            return false;
+        }
+    }
+    return map->old ? hashmap_scan(map->old, iter, udata) : true;
+}
+
+size_t hashmap_bucket_count(struct hashmap *map) {
+    return map->nbuckets + (map->old ? map->old->nbuckets : 0);
+}
+
+// Returns the bytes of a table allocation with nbuckets, including the
+// padding for its alignment.
+static size_t table_bytes(struct hashmap *map, size_t nbuckets) {
+    size_t size = table_size(map, nbuckets);
+    size_t align = table_align(map, size);
+    return align ? size+align+sizeof(void*) : size;
+}
+
+// Adds the distances of the items in a table to the statistics.
+static void stats_dibs(struct hashmap *table, struct hashmap_stats *stats,
+                       uint64_t *sum)
+{
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        size_t dib = bucket_at(table, i)->dib;
+        if (!dib) {
+            continue;
+        }
+        dib--;
+        *sum += dib;
+        stats->max_dib = dib > stats->max_dib ? dib : stats->max_dib;
+        stats->dibs[dib < HASHMAP_STATS_DIBS ? dib : HASHMAP_STATS_DIBS-1]++;
+    }
+}
+
+void hashmap_stats(struct hashmap *map, struct hashmap_stats *stats) {
+    if (!stats) {
+        panic("stats is null");
+    }
+    memset(stats, 0, sizeof(struct hashmap_stats));
+    stats->count = hashmap_count(map);
+    stats->nbuckets = hashmap_bucket_count(map);
+    stats->load = (double)stats->count/stats->nbuckets;
+    stats->memory = map_size(map);
+    if (map->buckets != map->small) {
+        stats->memory += table_bytes(map, map->nbuckets);
+    }
+    if (map->old) {
+        stats->memory += sizeof(struct hashmap)+
+                         table_bytes(map, map->old->nbuckets);
+    }
+    if (map->recycled) {
+        stats->memory += RECYCLE_CLASSES*sizeof(void*);
+        for (int i = 0; i < RECYCLE_CLASSES; i++) {
+            if (map->recycled[i]) {
+                stats->memory += table_bytes(map, (size_t)1 << i);
+            }
+        }
+    }
+    stats->memory += map->slab.chunkcap*sizeof(char*)+
+                     map->slab.nchunks*(map->slab.stride << map->slab.shift);
+#ifndef HASHMAP_NO_THREADS
+    if (map->conc) {
+        stats->memory += sizeof(struct concurrent);
+    }
+#endif
+    stats->grows = map->grows;
+    stats->shrinks = map->shrinks;
+    stats->resize_ns = map->resize_ns;
+    stats->reseeds = map->reseeds;
+    uint64_t sum = 0;
+    stats_dibs(map, stats, &sum);
+    if (map->old) {
+        stats_dibs(map->old, stats, &sum);
+    }
+    stats->avg_dib = stats->count ? (double)sum/stats->count : 0;
+#ifdef HASHMAP_STATS
+    stats->gets = map->ctr->gets;
+    stats->sets = map->ctr->sets;
+    stats->deletes = map->ctr->deletes;
+    stats->get_probes = map->ctr->get_probes;
+    stats->set_probes = map->ctr->set_probes;
+    stats->delete_probes = map->ctr->delete_probes;
+    stats->compares = map->ctr->compares;
+#endif
+}
+
+static bool scan_table(struct hashmap *table, size_t begin, size_t end,
+                       bool (*iter)(const void *item, void *udata),
+                       void *udata)
+{
+    for (size_t i = next_occupied(table, begin); i < end;
+         i = next_occupied(table, i+1))
+    {
+        if (!iter(item_at(table, i), udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool hashmap_scan_range(struct hashmap *map, size_t begin, size_t end,
+                        bool (*iter)(const void *item, void *udata),
+                        void *udata)
+{
+    size_t nbuckets = map->nbuckets;
+    if (begin < nbuckets &&
+        !scan_table(map, begin, end < nbuckets ? end : nbuckets, iter, udata))
+    {
+        return false;
+    }
+    if (map->old && end > nbuckets) {
+        size_t limit = nbuckets+map->old->nbuckets;
+        begin = begin > nbuckets ? begin : nbuckets;
+        end = end < limit ? end : limit;
+        if (begin < end) {
+            return scan_table(map->old, begin-nbuckets, end-nbuckets, iter,
+                              udata);
+        }
+    }
+    return true;
+}
+
+// Tells whether the item in the bucket at index reached it by wrapping around
+// the end of the table, which is the case for the items in the first buckets
+// that belong to a cluster starting in the last ones.
+static bool wrapped(struct hashmap *map, size_t index) {
+    return bucket_at(map, index)->dib > index+1;
+}
+
+// Finds the next item of a table, where the cursor ranges over twice its
+// number of buckets. An item that wrapped around the end of the table is found
+// at its bucket plus nbuckets, which keeps every cluster in probe order. The
+// backward shift of hashmap_iter_delete then only ever moves items that are
+// yet to be visited, and only onto the position of the deleted one or after.
+static bool iter_table(struct hashmap *table, size_t *i, void **item) {
+    size_t nbuckets = table->nbuckets;
+    size_t index = *i < nbuckets ? next_occupied(table, *i) : nbuckets;
+    while (index < nbuckets) {
+        if (!wrapped(table, index)) {
+            *i = index+1;
+            *item = item_at(table, index);
+            return true;
+        }
+        index = next_occupied(table, index+1);
+    }
+    index = *i > nbuckets ? *i-nbuckets : 0;
+    if (index < nbuckets && wrapped(table, index)) {
+        *i = nbuckets+index+1;
+        *item = item_at(table, index);
+        return true;
+    }
+    *i = nbuckets*2;
+    return false;
+}
+
+bool hashmap_iter(struct hashmap *map, size_t *i, void **item)
+{
+    // The buckets of an old table that is being drained follow the buckets
+    // of the map.
+    struct hashmap *table = map;
+    size_t index = *i;
+    if (index < map->nbuckets) {
+        index = next_occupied(map, index);
+        if (index < map->nbuckets) {
+            *i = index+1;
+            *item = item_at(map, index);
+            return true;
+        }
+    }
+    if (!map->old) {
+        *i = map->nbuckets;
+        return false;
+    }
+    table = map->old;
+    index = next_occupied(table, (*i > map->nbuckets ? *i : map->nbuckets) -
+                                 map->nbuckets);
+    if (index >= table->nbuckets) {
+        *i = map->nbuckets+table->nbuckets;
+        return false;
+    }
+    *i = map->nbuckets+index+1;
+    *item = item_at(table, index);
+    return true;
+}
+
+bool hashmap_sweep(struct hashmap *map, size_t *i, void **item)
+{
+    // The positions of an old table that is being drained follow those of
+    // the map.
+    size_t n = map->nbuckets*2;
+    if (*i < n && iter_table(map, i, item)) {
+        return true;
+    }
+    if (!map->old) {
+        *i = n;
+        return false;
+    }
+    size_t j = *i-n;
+    bool ok = iter_table(map->old, &j, item);
+    *i = n+j;
+    return ok;
+}
+
+void *hashmap_iter_delete(struct hashmap *map, size_t *i) {
+    if (!i) {
+        panic("i is null");
+    }
+    struct hashmap *table = map;
+    size_t n = map->nbuckets*2;
+    if (*i == 0) {
+        return NULL;
+    }
+    size_t pos = *i-1;
+    if (pos >= n) {
+        table = map->old;
+        pos -= n;
+        if (!table || pos >= table->nbuckets*2) {
+            return NULL;
+        }
+    }
+    // The item at a position past nbuckets is one that wrapped around, and
+    // the position at the end of the iteration holds no item.
+    size_t index = pos & table->mask;
+    if (!bucket_at(table, index)->dib ||
+        wrapped(table, index) != (pos > table->mask))
+    {
+        return NULL;
+    }
+    memcpy(map->spare, item_at(table, index), map->elsize);
+    if (map->conc) {
+        write_begin(map);
+    }
+    // The table is not shrunk, which would rearrange all of the items.
+    remove_at(table, index);
+    if (map->conc) {
+        write_end(map);
+    }
+    if (table != map) {
+        // An old table that has been drained is freed, which leaves the
+        // cursor at the end of the iteration.
+        migrate(map, 0);
+    }
+    // Whatever was shifted into the bucket comes next.
+    *i = *i-1;
+    return map->spare;
+}
+
+
+//-----------------------------------------------------------------------------
+// Sharded hashmap
+//
+// Every key is routed by the high bits of its hash to one of many independent
+// maps, each guarded by its own lock. The shards use the low bits of the same
+// hash, so each key is only hashed once.
+//-----------------------------------------------------------------------------
+#ifndef HASHMAP_NO_THREADS
+
+#include <pthread.h>
+
+static void spin_lock(volatile char *lock) {
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+static void spin_unlock(volatile char *lock) {
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+struct shard {
+    union {
+        pthread_rwlock_t rw;
+        volatile char spin;
+    } lock;
+    struct hashmap *map;
+} __attribute__((aligned(64))); // avoid false sharing between shards
+
+struct hashmap_sharded {
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    struct hashmap_allocator allocator;
+    enum hashmap_lock lock;
+    size_t nshards;
+    size_t memsz;
+    int shift;
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1);
+    uint64_t seed0;
+    uint64_t seed1;
+    void (*elfree)(void *item);
+    size_t elsize;
+    void *mem;
+    struct shard *shards;
+};
+
+static void *sharded_malloc(struct hashmap_sharded *map, size_t size) {
+    if (map->allocator.malloc) {
+        return map->allocator.malloc(size, map->allocator.udata);
+    }
+    return map->malloc(size);
+}
+
+static void sharded_free(struct hashmap_sharded *map, void *ptr, size_t size) {
+    if (map->allocator.free) {
+        map->allocator.free(ptr, size, map->allocator.udata);
+    } else {
+        map->free(ptr);
+    }
+}
+
+static void shard_rlock(struct hashmap_sharded *map, struct shard *shard) {
+    if (map->lock == HASHMAP_LOCK_SPINLOCK) {
+        spin_lock(&shard->lock.spin);
+    } else {
+        pthread_rwlock_rdlock(&shard->lock.rw);
+    }
+}
+
+static void shard_wlock(struct hashmap_sharded *map, struct shard *shard) {
+    if (map->lock == HASHMAP_LOCK_SPINLOCK) {
+        spin_lock(&shard->lock.spin);
+    } else {
+        pthread_rwlock_wrlock(&shard->lock.rw);
+    }
+}
+
+static void shard_unlock(struct hashmap_sharded *map, struct shard *shard) {
+    if (map->lock == HASHMAP_LOCK_SPINLOCK) {
+        spin_unlock(&shard->lock.spin);
+    } else {
+        pthread_rwlock_unlock(&shard->lock.rw);
+    }
+}
+
+struct hashmap_sharded *hashmap_sharded_new(
+                            size_t nshards, enum hashmap_lock lock,
+                            const struct hashmap_options *opts,
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    if (opts && opts->expiry) {
+        // gets would remove expired items while holding a read lock
+        return NULL;
+    }
+    void *(*_malloc)(size_t) = opts && opts->malloc ? opts->malloc : malloc;
+    void (*_free)(void*) = opts && opts->free ? opts->free : free;
+    size_t n = 1;
+    int bits = 0;
+    while (n < nshards) {
+        n *= 2;
+        bits++;
+    }
+    struct hashmap_sharded *map;
+    if (opts && opts->allocator) {
+        map = opts->allocator->malloc(sizeof(struct hashmap_sharded),
+                                      opts->allocator->udata);
+    } else {
+        map = _malloc(sizeof(struct hashmap_sharded));
+    }
+    if (!map) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(struct hashmap_sharded));
+    if (opts && opts->allocator) {
+        map->allocator = *opts->allocator;
+    }
+    map->malloc = _malloc;
+    map->free = _free;
+    map->lock = lock;
+    map->shift = 64-bits;
+    map->hash = hash;
+    map->seed0 = seed0;
+    map->seed1 = seed1;
+    map->elfree = elfree;
+    map->elsize = elsize;
+    map->memsz = sizeof(struct shard)*(n+1);
+    map->mem = sharded_malloc(map, map->memsz);
+    if (!map->mem) {
+        sharded_free(map, map, sizeof(struct hashmap_sharded));
+        return NULL;
+    }
+    map->shards = (struct shard*)(((uintptr_t)map->mem+63) & ~(uintptr_t)63);
+    // the bound of the whole map is divided among the shards, like cap
+    struct hashmap_options shard_opts = { 0 };
+    if (opts) {
+        shard_opts = *opts;
+        shard_opts.max_count = (opts->max_count+n-1)/n;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct shard *shard = &map->shards[i];
+        memset(shard, 0, sizeof(struct shard));
+        shard->map = hashmap_new_with_options(&shard_opts, elsize, cap/n,
+                                              seed0, seed1, hash, compare,
+                                              elfree, udata);
+        if (!shard->map) {
+            hashmap_sharded_free(map);
+            return NULL;
+        }
+        if (lock == HASHMAP_LOCK_RWLOCK) {
+            pthread_rwlock_init(&shard->lock.rw, NULL);
+        }
+        map->nshards = i+1;
+    }
+    return map;
+}
+
+void hashmap_sharded_free(struct hashmap_sharded *map) {
+    if (!map) return;
+    for (size_t i = 0; i < map->nshards; i++) {
+        if (map->lock == HASHMAP_LOCK_RWLOCK) {
+            pthread_rwlock_destroy(&map->shards[i].lock.rw);
+        }
+        hashmap_free(map->shards[i].map);
+    }
+    sharded_free(map, map->mem, map->memsz);
+    sharded_free(map, map, sizeof(struct hashmap_sharded));
+}
+
+static struct shard *shard_for(struct hashmap_sharded *map, const void *key,
+                               uint64_t *hash)
+{
+    uint64_t h = map->hash(key, map->seed0, map->seed1);
+    *hash = clip_hash(h);
+    return &map->shards[map->nshards > 1 ? h >> map->shift : 0];
+}
+
+// Returns the hash of key in a locked shard, which differs from the hash that
+// picked the shard once the shard reseeded.
+static uint64_t shard_hash(struct shard *shard, const void *key,
+                           uint64_t hash)
+{
+    return shard->map->reseeds ? get_hash(shard->map, key) : hash;
+}
+
+bool hashmap_sharded_get(struct hashmap_sharded *map, const void *key,
+                         void *item)
+{
+    if (!key) {
+        panic("key is null");
+    }
+    uint64_t hash;
+    struct shard *shard = shard_for(map, key, &hash);
+    shard_rlock(map, shard);
+    hash = shard_hash(shard, key, hash);
+    void *found = get_with_hash(shard->map, key, hash);
+    if (found && item) {
+        memcpy(item, found, map->elsize);
+    }
+    shard_unlock(map, shard);
+    return found != NULL;
+}
+
+bool hashmap_sharded_set(struct hashmap_sharded *map, const void *item,
+                         void *old, bool *replaced)
+{
+    if (!item) {
+        panic("item is null");
+    }
+    uint64_t hash;
+    struct shard *shard = shard_for(map, item, &hash);
+    shard_wlock(map, shard);
+    hash = shard_hash(shard, item, hash);
+    void *prev = set_with_hash(shard->map, item, hash,
+                               old ? old : shard->map->spare);
+    bool oom = !prev && shard->map->oom;
+    if (prev && !old && map->elfree) {
+        map->elfree(prev);
+    }
+    shard_unlock(map, shard);
+    if (replaced) {
+        *replaced = prev != NULL;
+    }
+    return !oom;
+}
+
+bool hashmap_sharded_delete(struct hashmap_sharded *map, const void *key,
+                            void *old)
+{
+    if (!key) {
+        panic("key is null");
+    }
+    uint64_t hash;
+    struct shard *shard = shard_for(map, key, &hash);
+    shard_wlock(map, shard);
+    hash = shard_hash(shard, key, hash);
+    void *prev = delete_with_hash(shard->map, key, hash,
+                                  old ? old : shard->map->spare);
+    if (prev && !old && map->elfree) {
+        map->elfree(prev);
+    }
+    shard_unlock(map, shard);
+    return prev != NULL;
+}
+
+bool hashmap_sharded_scan(struct hashmap_sharded *map,
+                          bool (*iter)(const void *item, void *udata),
+                          void *udata)
+{
+    for (size_t i = 0; i < map->nshards; i++) {
+        struct shard *shard = &map->shards[i];
+        shard_rlock(map, shard);
+        bool ok = hashmap_scan(shard->map, iter, udata);
+        shard_unlock(map, shard);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t hashmap_sharded_count(struct hashmap_sharded *map) {
+    size_t count = 0;
+    for (size_t i = 0; i < map->nshards; i++) {
+        struct shard *shard = &map->shards[i];
+        shard_rlock(map, shard);
+        count += hashmap_count(shard->map);
+        shard_unlock(map, shard);
+    }
+    return count;
+}
+
+#endif // HASHMAP_NO_THREADS
+
+//-----------------------------------------------------------------------------
+// Bulk build
+//
+// hashmap_build sorts the items by their home bucket with a radix sort and
+// then writes the table front to back. A robin-hood cluster is ordered by home
+// bucket, so the i-th item in that order lands in bucket max(home(i),
+// bucket(i-1)+1), which is i plus the largest home(j)-j for j up to i. Given
+// that prefix maximum at the start of each range of items, the ranges are
+// placed by separate threads. Small items are sorted along with their hashes,
+// larger ones are referred to by index.
+//-----------------------------------------------------------------------------
+
+#define BUILD_RADIX_BITS 12
+#define BUILD_RADIX (1<<BUILD_RADIX_BITS)
+#define BUILD_MAX_THREADS 64
+#define BUILD_MIN_ITEMS 4096 // per thread
+#define BUILD_INLINE_MAX 16  // largest item that is sorted by value
+
+// An entry is a hash followed by the item or by the index of the item.
+struct build_entry {
+    uint64_t hash;
+};
+
+enum build_phase { BUILD_HASH, BUILD_COUNT, BUILD_SCATTER, BUILD_MAX,
+                   BUILD_PROBE, BUILD_PLACE, BUILD_OCCUPY };
+
+struct build {
+    struct hashmap *map;
+    const char *items;
+    size_t n;
+    size_t esize;             // of an entry
+    bool inline_items;
+    char *entries;
+    char *scratch;
+    size_t *slab;             // slab element of each entry, or NULL
+    enum build_phase phase;
+    int nthreads;
+    int shift;                // of the digit in the current radix pass
+    int bits;                 // of a digit
+    size_t (*counts)[BUILD_RADIX];
+    ptrdiff_t maxes[BUILD_MAX_THREADS];
+    size_t dibs[BUILD_MAX_THREADS]; // longest probe of each range
+    ptrdiff_t base;           // last bucket of the items that wrap around
+};
+
+struct build_thread {
+    struct build *b;
+    int t;
+#ifndef HASHMAP_NO_THREADS
+    pthread_t th;
+#endif
+};
+
+static struct build_entry *build_entry(struct build *b, char *entries,
+                                       size_t i)
+{
+    return (struct build_entry*)(entries+i*b->esize);
+}
+
+static const void *build_item(struct build *b, struct build_entry *e) {
+    if (b->inline_items) {
+        return e+1;
+    }
+    size_t index;
+    memcpy(&index, e+1, sizeof(size_t));
+    return b->items+index*b->map->elsize;
+}
+
+// Returns the position of an item, which is past the last bucket for the
+// items that wrap around, given the prefix maximum up to the item.
+static size_t build_pos(struct build *b, size_t i, size_t home,
+                        ptrdiff_t *max)
+{
+    ptrdiff_t d = (ptrdiff_t)home-(ptrdiff_t)i;
+    *max = d > *max ? d : *max;
+    size_t pos = (size_t)((ptrdiff_t)i+*max);
+    if (pos < (size_t)(b->base+1)+i) {
+        pos = (size_t)(b->base+1)+i;
+    }
+    return pos;
+}
+
+static void build_step(struct build *b, int t) {
+    struct hashmap *map = b->map;
+    size_t lo = b->n*t/b->nthreads;
+    size_t hi = b->n*(t+1)/b->nthreads;
+    size_t digit_mask = ((size_t)1 << b->bits)-1;
+    switch (b->phase) {
+    case BUILD_HASH:
+        for (size_t i = lo; i < hi; i++) {
+            struct build_entry *e = build_entry(b, b->entries, i);
+            const void *item = b->items+i*map->elsize;
+            e->hash = get_hash(map, item);
+            if (b->inline_items) {
+                memcpy(e+1, item, map->elsize);
+            } else {
+                memcpy(e+1, &i, sizeof(size_t));
+            }
+        }
+        break;
+    case BUILD_COUNT:
+        memset(b->counts[t], 0, sizeof(b->counts[t]));
+        for (size_t i = lo; i < hi; i++) {
+            size_t home = build_entry(b, b->entries, i)->hash & map->mask;
+            b->counts[t][(home >> b->shift) & digit_mask]++;
+        }
+        break;
+    case BUILD_SCATTER:
+        for (size_t i = lo; i < hi; i++) {
+            struct build_entry *e = build_entry(b, b->entries, i);
+            size_t home = e->hash & map->mask;
+            size_t *offset = &b->counts[t][(home >> b->shift) & digit_mask];
+            memcpy(build_entry(b, b->scratch, (*offset)++), e, b->esize);
+        }
+        break;
+    case BUILD_MAX: {
+        ptrdiff_t max = PTRDIFF_MIN;
+        for (size_t i = lo; i < hi; i++) {
+            size_t home = build_entry(b, b->entries, i)->hash & map->mask;
+            ptrdiff_t d = (ptrdiff_t)home-(ptrdiff_t)i;
+            max = d > max ? d : max;
+        }
+        b->maxes[t] = max;
+        break;
+    }
+    case BUILD_PROBE: {
+        ptrdiff_t max = b->maxes[t];
+        size_t longest = 0;
+        for (size_t i = lo; i < hi; i++) {
+            size_t home = build_entry(b, b->entries, i)->hash & map->mask;
+            size_t dib = build_pos(b, i, home, &max)-home+1;
+            longest = dib > longest ? dib : longest;
+        }
+        b->dibs[t] = longest;
+        break;
+    }
+    case BUILD_PLACE: {
+        ptrdiff_t max = b->maxes[t];
+        for (size_t i = lo; i < hi; i++) {
+            struct build_entry *e = build_entry(b, b->entries, i);
+            size_t home = e->hash & map->mask;
+            size_t pos = build_pos(b, i, home, &max);
+            size_t j = pos & map->mask;
+            struct bucket *bucket = bucket_at(map, j);
+            bucket->hash = e->hash;
+            bucket->dib = pos-home+1;
+            const void *item = build_item(b, e);
+            if (map->layout == HASHMAP_LAYOUT_INDIRECT) {
+                *bucket_slab_index(bucket) = b->slab[i];
+                memcpy(slab_item(&map->slab, b->slab[i]), item, map->elsize);
+            } else {
+                memcpy(item_at(map, j), item, map->elsize);
+            }
+            if (map->ctrl) {
+                ctrl_set(map, j, ctrl_tag(e->hash));
+            }
+        }
+        break;
+    }
+    case BUILD_OCCUPY: {
+        // by words of the bitmap, which threads would share otherwise
+        size_t nwords = (map->nbuckets+63)/64;
+        for (size_t w = nwords*t/b->nthreads;
+             w < nwords*(t+1)/b->nthreads; w++)
+        {
+            uint64_t bits = 0;
+            for (size_t k = 0; k < 64 && w*64+k < map->nbuckets; k++) {
+                bits |= (uint64_t)(bucket_at(map, w*64+k)->dib != 0) << k;
+            }
+            map->occupied[w] = bits;
+        }
+        break;
+    }
+    }
+}
+
+#ifndef HASHMAP_NO_THREADS
+static void *build_thread(void *arg) {
+    struct build_thread *th = arg;
+    build_step(th->b, th->t);
+    return NULL;
+}
+#endif
+
+// Runs a phase on all threads. A thread that can't be started has its range
+// done by the calling thread.
+static void build_run(struct build *b, enum build_phase phase) {
+    b->phase = phase;
+    struct build_thread threads[BUILD_MAX_THREADS];
+#ifndef HASHMAP_NO_THREADS
+    bool started[BUILD_MAX_THREADS] = { 0 };
+    for (int t = 1; t < b->nthreads; t++) {
+        threads[t] = (struct build_thread){ .b = b, .t = t };
+        started[t] = pthread_create(&threads[t].th, NULL, build_thread,
+                                    &threads[t]) == 0;
+    }
+    build_step(b, 0);
+    for (int t = 1; t < b->nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t].th, NULL);
+        } else {
+            build_step(b, t);
+        }
+    }
+#else
+    (void)threads;
+    for (int t = 0; t < b->nthreads; t++) {
+        build_step(b, t);
+    }
+#endif
+}
+
+// Sorts the entries by home bucket, keeping the order of the items within a
+// bucket. The bits of the bucket index are split evenly over the passes.
+static void build_sort(struct build *b) {
+    int nbits = table_class(b->map->nbuckets);
+    int npasses = (nbits+BUILD_RADIX_BITS-1)/BUILD_RADIX_BITS;
+    b->bits = (nbits+npasses-1)/npasses;
+    for (b->shift = 0; b->shift < nbits; b->shift += b->bits) {
+        build_run(b, BUILD_COUNT);
+        size_t offset = 0;
+        for (int d = 0; d < (1 << b->bits); d++) {
+            for (int t = 0; t < b->nthreads; t++) {
+                size_t count = b->counts[t][d];
+                b->counts[t][d] = offset;
+                offset += count;
+            }
+        }
+        build_run(b, BUILD_SCATTER);
+        char *entries = b->entries;
+        b->entries = b->scratch;
+        b->scratch = entries;
+    }
+}
+
+// Drops all but the last of the items with equal keys, as inserting them one
+// by one would. Equal keys are in the same bucket after sorting. The dropped
+// entries are swapped to the end, so that they are only freed once the
+// build can't fail anymore.
+static void build_dedupe(struct build *b) {
+    struct hashmap *map = b->map;
+    size_t n = 0;
+    for (size_t i = 0, run = 0; i < b->n; i++) {
+        struct build_entry *e = build_entry(b, b->entries, i);
+        size_t home = e->hash & map->mask;
+        if (n > 0 && (build_entry(b, b->entries, run)->hash & map->mask) !=
+            home)
+        {
+            run = n;
+        }
+        const void *item = build_item(b, e);
+        size_t j = run;
+        for (; j < n; j++) {
+            struct build_entry *prev = build_entry(b, b->entries, j);
+            if (prev->hash == e->hash &&
+                compare_item(map, build_item(b, prev), item) == 0)
+            {
+                break;
+            }
+        }
+        if (j != i) {
+            char tmp[sizeof(struct build_entry)+BUILD_INLINE_MAX];
+            struct build_entry *prev = build_entry(b, b->entries, j);
+            memcpy(tmp, prev, b->esize);
+            memcpy(prev, e, b->esize);
+            memcpy(e, tmp, b->esize);
+        }
+        if (j == n) {
+            n++;
+        }
+    }
+    b->n = n;
+}
+
+// Finds the shift of the items that wrap around from the last bucket to the
+// first, and the prefix maximum at the start of each range of items.
+static void build_layout(struct build *b) {
+    build_run(b, BUILD_MAX);
+    ptrdiff_t max = PTRDIFF_MIN;
+    for (int t = 0; t < b->nthreads; t++) {
+        ptrdiff_t next = b->maxes[t] > max ? b->maxes[t] : max;
+        b->maxes[t] = max;
+        max = next;
+    }
+    ptrdiff_t last = (ptrdiff_t)b->n-1+(max > 0 ? max : 0);
+    b->base = last-(ptrdiff_t)b->map->nbuckets;
+    if (b->base < -1) {
+        b->base = -1;
+    }
+}
+
+static bool build(struct hashmap *map, const void *items, size_t n,
+                  int nthreads)
+{
+    map->oom = false;
+    if (n == 0) {
+        return true;
+    }
+    if (hashmap_count(map) > 0 || map->max_count || map->expiry) {
+        // a bounded map may need to evict some of the items, and the buckets
+        // of a map with expiry have deadlines
+        return hashmap_set_many(map, items, n) == n;
+    }
+    if (map->old) {
+        migrate(map, SIZE_MAX);
+    }
+    struct build b = { .map = map, .items = items, .n = n };
+    b.inline_items = map->elsize <= BUILD_INLINE_MAX;
+    b.esize = sizeof(struct build_entry) +
+              (b.inline_items ? map->elsize : sizeof(size_t));
+    while (b.esize & (sizeof(uint64_t)-1)) {
+        b.esize++;
+    }
+    size_t nbuckets = buckets_for(map, map->nbuckets, n);
+    if (!nbuckets || n > (SIZE_MAX/2)/b.esize) {
+        map->oom = true;
+        return false;
+    }
+    if (nbuckets > map->nbuckets) {
+        void *buckets = table_alloc(map, nbuckets);
+        if (!buckets) {
+            map->oom = true;
+            return false;
+        }
+        write_begin(map);
+        void *old_buckets = map->buckets;
+        size_t old_nbuckets = map->nbuckets;
+        table_init(map, buckets, nbuckets);
+        retire_table(map, old_buckets, old_nbuckets);
+        write_end(map);
+    }
+    if (nthreads > BUILD_MAX_THREADS) {
+        nthreads = BUILD_MAX_THREADS;
+    }
+    if ((size_t)nthreads > n/BUILD_MIN_ITEMS) {
+        nthreads = n/BUILD_MIN_ITEMS;
+    }
+    b.nthreads = nthreads < 1 ? 1 : nthreads;
+    size_t esize = n*b.esize;
+    size_t csize = b.nthreads*sizeof(*b.counts);
+    b.entries = map_malloc(map, esize);
+    b.scratch = map_malloc(map, esize);
+    b.counts = map_malloc(map, csize);
+    if (!b.entries || !b.scratch || !b.counts) {
+        goto oom;
+    }
+    build_run(&b, BUILD_HASH);
+    build_sort(&b);
+    if (map->layout == HASHMAP_LAYOUT_INDIRECT) {
+        // The scratch array holds the slab elements, which are allocated
+        // before any duplicates are freed.
+        b.slab = (size_t*)b.scratch;
+        for (size_t i = 0; i < n; i++) {
+            b.slab[i] = slab_alloc(map);
+            if (b.slab[i] == SIZE_MAX) {
+                while (i > 0) {
+                    slab_release(&map->slab, b.slab[--i]);
+                }
+                goto oom;
+            }
+        }
+    }
+    build_dedupe(&b);
+    build_layout(&b);
+    build_run(&b, BUILD_PROBE);
+    size_t longest = 0;
+    for (int t = 0; t < b.nthreads; t++) {
+        longest = b.dibs[t] > longest ? b.dibs[t] : longest;
+    }
+    if (longest > map->max_probe || longest >= DIB_MAX) {
+        if (b.slab) {
+            for (size_t i = 0; i < n; i++) {
+                slab_release(&map->slab, b.slab[i]);
+            }
+        }
+        map_free(map, b.entries, esize);
+        map_free(map, b.scratch, esize);
+        map_free(map, b.counts, csize);
+        if (longest > map->max_probe) {
+            // keys that collide for the seeds, which hashmap_set_many spreads
+            // out again by reseeding
+            return hashmap_set_many(map, items, n) == n;
+        }
+        // a cluster that buckets can't record, which hashmap_set panics on
+        errno = EOVERFLOW;
+        return false;
+    }
+    for (size_t i = b.n; i < n; i++) {
+        if (b.slab) {
+            slab_release(&map->slab, b.slab[i]);
+        }
+        if (map->elfree) {
+            const void *item = build_item(&b, build_entry(&b, b.entries, i));
+            memcpy(map->spare, item, map->elsize);
+            map->elfree(map->spare);
+        }
+    }
+    write_begin(map);
+    build_run(&b, BUILD_PLACE);
+    build_run(&b, BUILD_OCCUPY);
+    map->count = b.n;
+    write_end(map);
+    map_free(map, b.entries, esize);
+    map_free(map, b.scratch, esize);
+    map_free(map, b.counts, csize);
+    return true;
+oom:
+    if (b.entries) map_free(map, b.entries, esize);
+    if (b.scratch) map_free(map, b.scratch, esize);
+    if (b.counts) map_free(map, b.counts, csize);
+    map->oom = true;
+    return false;
+}
+
+bool hashmap_build(struct hashmap *map, const void *items, size_t n) {
+    if (n && !items) {
+        panic("items is null");
+    }
+    return build(map, items, n, 1);
+}
+
+#ifndef HASHMAP_NO_THREADS
+bool hashmap_build_parallel(struct hashmap *map, const void *items, size_t n,
+                            int nthreads)
+{
+    if (n && !items) {
+        panic("items is null");
+    }
+    return build(map, items, n, nthreads);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Parallel scan
+//
+// The threads take chunks of bucket positions from a shared counter until all
+// are taken, which balances chunks that hold more items than others.
+//-----------------------------------------------------------------------------
+#ifndef HASHMAP_NO_THREADS
+
+#define SCAN_MIN_CHUNK 4096
+#define SCAN_CHUNKS_PER_THREAD 8
+#define SCAN_MAX_THREADS 256
+
+struct scan {
+    struct hashmap *map;
+    bool (*iter)(const void *item, void *udata);
+    size_t size;
+    size_t chunk;
+    size_t next;    // chunks taken
+    bool stopped;
+};
+
+struct scan_thread {
+    struct scan *scan;
+    void *udata;
+    pthread_t th;
+};
+
+static void *scan_thread(void *arg) {
+    struct scan_thread *th = arg;
+    struct scan *scan = th->scan;
+    while (!__atomic_load_n(&scan->stopped, __ATOMIC_RELAXED)) {
+        size_t begin = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED) *
+                       scan->chunk;
+        if (begin >= scan->size) {
+            break;
+        }
+        if (!hashmap_scan_range(scan->map, begin, begin+scan->chunk,
+                                scan->iter, th->udata))
+        {
+            __atomic_store_n(&scan->stopped, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+bool hashmap_scan_parallel(struct hashmap *map, int nthreads,
+                           bool (*iter)(const void *item, void *udata),
+                           void **udata)
+{
+    if (nthreads < 1) {
+        nthreads = 1;
+    } else if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+    struct scan scan = { .map = map, .iter = iter };
+    scan.size = hashmap_bucket_count(map);
+    scan.chunk = scan.size/((size_t)nthreads*SCAN_CHUNKS_PER_THREAD);
+    if (scan.chunk < SCAN_MIN_CHUNK) {
+        scan.chunk = SCAN_MIN_CHUNK;
+    }
+    struct scan_thread threads[SCAN_MAX_THREADS];
+    bool started[SCAN_MAX_THREADS] = { 0 };
+    for (int t = 1; t < nthreads && (size_t)t*scan.chunk < scan.size; t++) {
+        threads[t] = (struct scan_thread){ .scan = &scan, .udata = udata[t] };
+        started[t] = pthread_create(&threads[t].th, NULL, scan_thread,
+                                    &threads[t]) == 0;
+    }
+    // The calling thread takes chunks too, so the scan finishes even when
+    // no thread could be started.
+    threads[0] = (struct scan_thread){ .scan = &scan, .udata = udata[0] };
+    scan_thread(&threads[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t].th, NULL);
+        }
+    }
+    return !scan.stopped;
+}
+
+#endif // HASHMAP_NO_THREADS
+
+//-----------------------------------------------------------------------------
+// Snapshots
+//
+// A snapshot file is a header followed by a byte for byte copy of the table
+// allocation: the buckets, items, control bytes and bitmaps. Opening it maps
+// the table straight from the file, so lookups start right away and pages are
+// faulted in as they're touched. The header is in the byte order of the
+// machine, which the magic number tells.
+//-----------------------------------------------------------------------------
+#define SNAPSHOT_MAGIC UINT64_C(0x544F4853504D4148) // "HAMPSHOT"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_CHECKS 16 // items whose hashes are checked on open
+
+struct snapshot {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t layout;
+    uint64_t elsize;
+    uint64_t bucketsz;
+    uint64_t entrysz;
+    uint64_t nbuckets;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t seed0;
+    uint64_t seed1;
+    uint64_t max_count;
+    uint64_t hand;
+    uint64_t growth;
+    double max_load;
+    double min_load;
+    double hysteresis;
+    uint8_t group;
+    uint8_t shrink;
+    uint8_t incremental;
+    uint8_t keycmp;   // of a key/value map without a compare function
+    uint64_t keysize; // zero unless a key/value map
+    uint64_t valoff;
+};
+
+#ifdef HASHMAP_MMAP
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+bool hashmap_save(struct hashmap *map, int fd) {
+    if (map->elfree || map->expiry || map->layout == HASHMAP_LAYOUT_INDIRECT) {
+        errno = ENOTSUP;
+        return false;
+    }
+    if (map->old) {
+        migrate(map, SIZE_MAX);
+    }
+    struct snapshot hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .layout = map->layout,
+        .elsize = map->elsize,
+        .bucketsz = map->bucketsz,
+        .entrysz = map->entrysz,
+        .nbuckets = map->nbuckets,
+        .count = map->count,
+        .cap = map->cap,
+        .seed0 = map->seed0,
+        .seed1 = map->seed1,
+        .max_count = map->max_count,
+        .hand = map->hand,
+        .growth = map->growth,
+        .max_load = map->max_load,
+        .min_load = map->min_load,
+        .hysteresis = map->hysteresis,
+        .group = map->group_match != NULL,
+        .shrink = map->shrink,
+        .incremental = map->incremental,
+        .keycmp = map->keycmp != 0,
+        .keysize = map->keysize,
+        .valoff = map->valoff,
+    };
+    char header[SNAPSHOT_HEADER] = { 0 };
+    memcpy(header, &hdr, sizeof(struct snapshot));
+    return write_all(fd, header, SNAPSHOT_HEADER) &&
+           write_all(fd, map->buckets, table_size(map, map->nbuckets));
+}
+
+// Makes a map for the snapshot at mem, which holds size bytes. Returns NULL
+// when the snapshot is invalid or out of memory.
+static struct hashmap *snapshot_map(void *mem, size_t size,
+                           uint64_t (*hash)(const void *item,
+                                            uint64_t seed0, uint64_t seed1),
+                           int (*compare)(const void *a, const void *b,
+                                          void *udata),
+                           void *udata)
+{
+    struct snapshot hdr;
+    memcpy(&hdr, mem, sizeof(struct snapshot));
+    if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+        (hdr.layout != HASHMAP_LAYOUT_INLINE &&
+         hdr.layout != HASHMAP_LAYOUT_SPLIT))
+    {
+        return NULL;
+    }
+    // Only a key/value map has a default hash, and memcmp only stands in for
+    // the compare function it was saved without.
+    if (hdr.keysize > hdr.elsize || hdr.valoff < hdr.keysize ||
+        hdr.valoff > hdr.elsize || (!hash && !hdr.keysize) ||
+        (!compare && !hdr.keycmp))
+    {
+        return NULL;
+    }
+    struct hashmap_options opts = {
+        .layout = (enum hashmap_layout)hdr.layout,
+        .probe = hdr.group ? HASHMAP_PROBE_GROUP : HASHMAP_PROBE_LINEAR,
+        .incremental = hdr.incremental,
+        .max_load = hdr.max_load,
+        .min_load = hdr.min_load,
+        .no_shrink = !hdr.shrink,
+        .growth = hdr.growth,
+        .hysteresis = hdr.hysteresis,
+    };
+    struct hashmap *map = hashmap_new_with_options(&opts, hdr.elsize, 0,
+                                                   hdr.seed0, hdr.seed1, hash,
+                                                   compare, NULL, udata);
+    if (!map) {
+        return NULL;
+    }
+    if (hdr.keysize) {
+        kv_init(map, hdr.keysize, hdr.valoff);
+    }
+    table_release(map, map->buckets, map->nbuckets);
+    map->buckets = NULL;
+    map->max_count = hdr.max_count;
+    size_t nbuckets = hdr.nbuckets;
+    if (map->bucketsz != hdr.bucketsz || map->entrysz != hdr.entrysz ||
+        nbuckets < (hdr.group ? 16 : 2) || (nbuckets & (nbuckets-1)) ||
+        nbuckets > size/map->bucketsz || hdr.count > nbuckets ||
+        size != SNAPSHOT_HEADER+table_size(map, nbuckets))
+    {
+        hashmap_free(map);
+        return NULL;
+    }
+    table_attach(map, (char*)mem+SNAPSHOT_HEADER, nbuckets);
+    map->count = hdr.count;
+    map->cap = hdr.cap;
+    map->hand = hdr.hand;
+    // The hash function can't be stored, so the one given is checked against
+    // the hashes of the first items.
+    size_t checked = 0;
+    for (size_t i = next_occupied(map, 0);
+         i < nbuckets && checked < SNAPSHOT_CHECKS;
+         i = next_occupied(map, i+1), checked++)
+    {
+        if (get_hash(map, item_at(map, i)) != bucket_at(map, i)->hash) {
+            map->buckets = NULL;
+            hashmap_free(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+struct hashmap *hashmap_open_mmap(const char *path, bool writable,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata)
+{
+    if (!path) {
+        panic("path is null");
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    void *mem = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= SNAPSHOT_HEADER) {
+        size = (size_t)st.st_size;
+        int prot = writable ? PROT_READ|PROT_WRITE : PROT_READ;
+        mem = mmap(NULL, size, prot, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    struct hashmap *map = snapshot_map(mem, size, hash, compare, udata);
+    if (!map) {
+        munmap(mem, size);
+        return NULL;
+    }
+    map->mapping = mem;
+    map->mapsize = size;
+    if (!writable) {
+        // lookups leave the read-only reference bits of a bounded map alone
+        map->referenced = NULL;
+    }
+    return map;
+}
+
+#else
+
+bool hashmap_save(struct hashmap *map, int fd) {
+    (void)map; (void)fd;
+    errno = ENOTSUP;
+    return false;
+}
+
+struct hashmap *hashmap_open_mmap(const char *path, bool writable,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata)
+{
+    (void)path; (void)writable; (void)hash; (void)compare; (void)udata;
+    return NULL;
+}
+
+#endif // HASHMAP_MMAP
+
+//-----------------------------------------------------------------------------
+// SipHash reference C implementation
+//
+// Copyright (c) 2012-2016 Jean-Philippe Aumasson
+// <jeanphilippe.aumasson@gmail.com>
+// Copyright (c) 2012-2014 Daniel J. Bernstein <djb@cr.yp.to>
+//
+// To the extent possible under law, the author(s) have dedicated all copyright
+// and related and neighboring rights to this software to the public domain
+// worldwide. This software is distributed without any warranty.
+//
+// You should have received a copy of the CC0 Public Domain Dedication along
+// with this software. If not, see
+// <http://creativecommons.org/publicdomain/zero/1.0/>.
+//
+// default: SipHash-2-4
+//-----------------------------------------------------------------------------
+static uint64_t SIP64(const uint8_t *in, const size_t inlen,
+                      uint64_t seed0, uint64_t seed1)
+{
+#define U8TO64_LE(p) \
+    {  (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | \
+        ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | \
+        ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | \
+        ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56)) }
+#define U64TO8_LE(p, v) \
+    { U32TO8_LE((p), (uint32_t)((v))); \
+      U32TO8_LE((p) + 4, (uint32_t)((v) >> 32)); }
+#define U32TO8_LE(p, v) \
+    { (p)[0] = (uint8_t)((v)); \
+      (p)[1] = (uint8_t)((v) >> 8); \
+      (p)[2] = (uint8_t)((v) >> 16); \
+      (p)[3] = (uint8_t)((v) >> 24); }
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+    { v0 += v1; v1 = ROTL(v1, 13); \
+      v1 ^= v0; v0 = ROTL(v0, 32); \
+      v2 += v3; v3 = ROTL(v3, 16); \
+      v3 ^= v2; \
+      v0 += v3; v3 = ROTL(v3, 21); \
+      v3 ^= v0; \
+      v2 += v1; v1 = ROTL(v1, 17); \
+      v1 ^= v2; v2 = ROTL(v2, 32); }
+    uint64_t k0 = U8TO64_LE((uint8_t*)&seed0);
+    uint64_t k1 = U8TO64_LE((uint8_t*)&seed1);
+    uint64_t v3 = UINT64_C(0x7465646279746573) ^ k1;
+    uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ k0;
+    uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ k1;
+    uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ k0;
+    const uint8_t *end = in + inlen - (inlen % sizeof(uint64_t));
+    for (; in != end; in += 8) {
+        uint64_t m = U8TO64_LE(in);
+        v3 ^= m;
+        SIPROUND; SIPROUND;
+        v0 ^= m;
+    }
+    const int left = inlen & 7;
+    uint64_t b = ((uint64_t)inlen) << 56;
+    switch (left) {
+    case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t)in[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t)in[0]); break;
+    case 0: break;
+    }
+    v3 ^= b;
+    SIPROUND; SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    b = v0 ^ v1 ^ v2 ^ v3;
+    uint64_t out = 0;
+    U64TO8_LE((uint8_t*)&out, b);
+    return out;
+}
+
+//-----------------------------------------------------------------------------
+// MurmurHash3 was written by Austin Appleby, and is placed in the public
+// domain. The author hereby disclaims copyright to this source code.
+//
+// Murmur3_86_128
+//-----------------------------------------------------------------------------
+static uint64_t MM86128(const void *key, const int len, uint32_t seed) {
+#define	ROTL32(x, r) ((x << r) | (x >> (32 - r)))
+#define FMIX32(h) h^=h>>16; h*=0x85ebca6b; h^=h>>13; h*=0xc2b2ae35; h^=h>>16;
+    const uint8_t * data = (const uint8_t*)key;
+    const int nblocks = len / 16;
+    uint32_t h1 = seed;
+    uint32_t h2 = seed;
+    uint32_t h3 = seed;
+    uint32_t h4 = seed;
+    uint32_t c1 = 0x239b961b;
+    uint32_t c2 = 0xab0e9789;
+    uint32_t c3 = 0x38b34ae5;
+    uint32_t c4 = 0xa1e38b93;
+    const uint32_t * blocks = (const uint32_t *)(data + nblocks*16);
+    for (int i = -nblocks; i; i++) {
+        uint32_t k1 = blocks[i*4+0];
+        uint32_t k2 = blocks[i*4+1];
+        uint32_t k3 = blocks[i*4+2];
+        uint32_t k4 = blocks[i*4+3];
+        k1 *= c1; k1  = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
+        h1 = ROTL32(h1,19); h1 += h2; h1 = h1*5+0x561ccd1b;
+        k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
+        h2 = ROTL32(h2,17); h2 += h3; h2 = h2*5+0x0bcaa747;
+        k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3;
+        h3 = ROTL32(h3,15); h3 += h4; h3 = h3*5+0x96cd1c35;
+        k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4;
+        h4 = ROTL32(h4,13); h4 += h1; h4 = h4*5+0x32ac3b17;
+    }
+    const uint8_t * tail = (const uint8_t*)(data + nblocks*16);
+    uint32_t k1 = 0;
+    uint32_t k2 = 0;
+    uint32_t k3 = 0;
+    uint32_t k4 = 0;
+    switch(len & 15) {
+    case 15: k4 ^= tail[14] << 16; /* fall through */
+    case 14: k4 ^= tail[13] << 8; /* fall through */
+    case 13: k4 ^= tail[12] << 0;
+             k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4;
+             /* fall through */
+    case 12: k3 ^= tail[11] << 24; /* fall through */
+    case 11: k3 ^= tail[10] << 16; /* fall through */
+    case 10: k3 ^= tail[ 9] << 8; /* fall through */
+    case  9: k3 ^= tail[ 8] << 0;
+             k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3;
+             /* fall through */
+    case  8: k2 ^= tail[ 7] << 24; /* fall through */
+    case  7: k2 ^= tail[ 6] << 16; /* fall through */
+    case  6: k2 ^= tail[ 5] << 8; /* fall through */
+    case  5: k2 ^= tail[ 4] << 0;
+             k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
+             /* fall through */
+    case  4: k1 ^= tail[ 3] << 24; /* fall through */
+    case  3: k1 ^= tail[ 2] << 16; /* fall through */
+    case  2: k1 ^= tail[ 1] << 8; /* fall through */
+    case  1: k1 ^= tail[ 0] << 0;
+             k1 *= c1; k1  = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
+             /* fall through */
+    };
+    h1 ^= len; h2 ^= len; h3 ^= len; h4 ^= len;
+    h1 += h2; h1 += h3; h1 += h4;
+    h2 += h1; h3 += h1; h4 += h1;
+    FMIX32(h1); FMIX32(h2); FMIX32(h3); FMIX32(h4);
+    h1 += h2; h1 += h3; h1 += h4;
+    h2 += h1; h3 += h1; h4 += h1;
+    return (((uint64_t)h2)<<32)|h1;
+}
+
+//-----------------------------------------------------------------------------
+// XXH3_64bits_withSeed from xxHash, written by Yann Collet (BSD 2-Clause)
+//
+// Short inputs take one of the paths for 0-16, 17-128 and 129-240 bytes,
+// which mix the input with the default secret. Longer inputs are hashed in
+// 64-byte stripes over eight accumulators, with a secret derived from the
+// seed. The results match the reference implementation, on any byte order.
+//-----------------------------------------------------------------------------
+#define XXH_PRIME32_1 UINT64_C(0x9E3779B1)
+#define XXH_PRIME32_2 UINT64_C(0x85EBCA77)
+#define XXH_PRIME32_3 UINT64_C(0xC2B2AE3D)
+#define XXH_PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+#define XXH_PRIME_MX1 UINT64_C(0x165667919E3779F9)
+#define XXH_PRIME_MX2 UINT64_C(0x9FB21C651E98DF25)
+#define XXH_SECRET_SIZE 192
+#define XXH_STRIPE_LEN 64
+#define XXH_ACC_NB 8
+
+static const uint8_t xxh_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define XXH_BIG_ENDIAN
+#endif
+
+static uint32_t xxh_swap32(uint32_t x) {
+    return ((x << 24) & 0xff000000) | ((x << 8) & 0x00ff0000) |
+           ((x >> 8) & 0x0000ff00) | ((x >> 24) & 0x000000ff);
+}
+
+static uint64_t xxh_swap64(uint64_t x) {
+    return ((uint64_t)xxh_swap32((uint32_t)x) << 32) |
+           xxh_swap32((uint32_t)(x >> 32));
+}
+
+static uint64_t xxh_read64(const void *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#ifdef XXH_BIG_ENDIAN
+    v = xxh_swap64(v);
+#endif
+    return v;
+}
+
+static uint32_t xxh_read32(const void *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#ifdef XXH_BIG_ENDIAN
+    v = xxh_swap32(v);
+#endif
+    return v;
+}
+
+static void xxh_write64(void *p, uint64_t v) {
+#ifdef XXH_BIG_ENDIAN
+    v = xxh_swap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint64_t xxh_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Multiplies a and b into the 128-bit product hi:lo.
+static void mul128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    *lo = (uint64_t)product;
+    *hi = (uint64_t)(product >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    *hi = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    *lo = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+#endif
+}
+
+// Returns the xor of the high and low halves of the 128-bit product.
+static uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+    uint64_t lo, hi;
+    mul128(a, b, &lo, &hi);
+    return lo ^ hi;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len) {
+    h ^= xxh_rotl64(h, 49) ^ xxh_rotl64(h, 24);
+    h *= XXH_PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= XXH_PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static uint64_t xxh3_len_0to16(const uint8_t *p, size_t len, uint64_t seed) {
+    const uint8_t *secret = xxh_secret;
+    if (len > 8) {
+        uint64_t bitflip1 = (xxh_read64(secret+24) ^ xxh_read64(secret+32)) +
+                            seed;
+        uint64_t bitflip2 = (xxh_read64(secret+40) ^ xxh_read64(secret+48)) -
+                            seed;
+        uint64_t lo = xxh_read64(p) ^ bitflip1;
+        uint64_t hi = xxh_read64(p+len-8) ^ bitflip2;
+        uint64_t acc = len + xxh_swap64(lo) + hi + mul128_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+    if (len >= 4) {
+        seed ^= (uint64_t)xxh_swap32((uint32_t)seed) << 32;
+        uint32_t in1 = xxh_read32(p);
+        uint32_t in2 = xxh_read32(p+len-4);
+        uint64_t bitflip = (xxh_read64(secret+8) ^ xxh_read64(secret+16)) -
+                           seed;
+        uint64_t keyed = (in2 + ((uint64_t)in1 << 32)) ^ bitflip;
+        return xxh3_rrmxmx(keyed, len);
+    }
+    if (len > 0) {
+        uint32_t combined = ((uint32_t)p[0] << 16) |
+                            ((uint32_t)p[len >> 1] << 24) |
+                            ((uint32_t)p[len-1] << 0) | ((uint32_t)len << 8);
+        uint64_t bitflip = (xxh_read32(secret) ^ xxh_read32(secret+4)) + seed;
+        return xxh64_avalanche(combined ^ bitflip);
+    }
+    return xxh64_avalanche(seed ^ xxh_read64(secret+56) ^
+                           xxh_read64(secret+64));
+}
+
+static uint64_t xxh3_mix16(const uint8_t *p, const uint8_t *secret,
+                           uint64_t seed)
+{
+    return mul128_fold64(xxh_read64(p) ^ (xxh_read64(secret) + seed),
+                         xxh_read64(p+8) ^ (xxh_read64(secret+8) - seed));
+}
+
+static uint64_t xxh3_len_17to128(const uint8_t *p, size_t len, uint64_t seed) {
+    const uint8_t *secret = xxh_secret;
+    uint64_t acc = len * XXH_PRIME64_1;
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                acc += xxh3_mix16(p+48, secret+96, seed);
+                acc += xxh3_mix16(p+len-64, secret+112, seed);
+            }
+            acc += xxh3_mix16(p+32, secret+64, seed);
+            acc += xxh3_mix16(p+len-48, secret+80, seed);
+        }
+        acc += xxh3_mix16(p+16, secret+32, seed);
+        acc += xxh3_mix16(p+len-32, secret+48, seed);
+    }
+    acc += xxh3_mix16(p, secret, seed);
+    acc += xxh3_mix16(p+len-16, secret+16, seed);
+    return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_len_129to240(const uint8_t *p, size_t len,
+                                  uint64_t seed)
+{
+    const uint8_t *secret = xxh_secret;
+    uint64_t acc = len * XXH_PRIME64_1;
+    for (size_t i = 0; i < 8; i++) {
+        acc += xxh3_mix16(p+16*i, secret+16*i, seed);
+    }
+    acc = xxh3_avalanche(acc);
+    uint64_t acc_end = xxh3_mix16(p+len-16, secret+136-17, seed);
+    for (size_t i = 8; i < len/16; i++) {
+        acc_end += xxh3_mix16(p+16*i, secret+16*(i-8)+3, seed);
+    }
+    return xxh3_avalanche(acc+acc_end);
+}
+
+static void xxh3_accumulate_512(uint64_t acc[XXH_ACC_NB], const uint8_t *p,
+                                const uint8_t *secret)
+{
+    for (size_t i = 0; i < XXH_ACC_NB; i++) {
+        uint64_t val = xxh_read64(p+8*i);
+        uint64_t key = val ^ xxh_read64(secret+8*i);
+        acc[i ^ 1] += val;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void xxh3_scramble(uint64_t acc[XXH_ACC_NB], const uint8_t *secret) {
+    for (size_t i = 0; i < XXH_ACC_NB; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= xxh_read64(secret+8*i);
+        a *= XXH_PRIME32_1;
+        acc[i] = a;
+    }
+}
+
+static uint64_t xxh3_long(const uint8_t *p, size_t len, uint64_t seed) {
+    uint8_t custom[XXH_SECRET_SIZE];
+    const uint8_t *secret = xxh_secret;
+    if (seed) {
+        for (size_t i = 0; i < XXH_SECRET_SIZE; i += 16) {
+            xxh_write64(custom+i, xxh_read64(xxh_secret+i) + seed);
+            xxh_write64(custom+i+8, xxh_read64(xxh_secret+i+8) - seed);
+        }
+        secret = custom;
+    }
+    uint64_t acc[XXH_ACC_NB] = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1,
+    };
+    size_t nstripes = (XXH_SECRET_SIZE-XXH_STRIPE_LEN)/8;
+    size_t block_len = XXH_STRIPE_LEN*nstripes;
+    size_t nblocks = (len-1)/block_len;
+    for (size_t n = 0; n < nblocks; n++) {
+        for (size_t s = 0; s < nstripes; s++) {
+            xxh3_accumulate_512(acc, p+n*block_len+s*XXH_STRIPE_LEN,
+                                secret+s*8);
+        }
+        xxh3_scramble(acc, secret+XXH_SECRET_SIZE-XXH_STRIPE_LEN);
+    }
+    size_t last = ((len-1)-block_len*nblocks)/XXH_STRIPE_LEN;
+    for (size_t s = 0; s < last; s++) {
+        xxh3_accumulate_512(acc, p+nblocks*block_len+s*XXH_STRIPE_LEN,
+                            secret+s*8);
+    }
+    xxh3_accumulate_512(acc, p+len-XXH_STRIPE_LEN,
+                        secret+XXH_SECRET_SIZE-XXH_STRIPE_LEN-7);
+    uint64_t result = len*XXH_PRIME64_1;
+    for (size_t i = 0; i < 4; i++) {
+        result += mul128_fold64(acc[2*i] ^ xxh_read64(secret+11+16*i),
+                                acc[2*i+1] ^ xxh_read64(secret+11+16*i+8));
+    }
+    return xxh3_avalanche(result);
+}
+
+static uint64_t xxh3(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    if (len <= 16) {
+        return xxh3_len_0to16(p, len, seed);
+    }
+    if (len <= 128) {
+        return xxh3_len_17to128(p, len, seed);
+    }
+    if (len <= 240) {
+        return xxh3_len_129to240(p, len, seed);
+    }
+    return xxh3_long(p, len, seed);
+}
+
+uint64_t hashmap_sip(const void *data, size_t len,
+                     uint64_t seed0, uint64_t seed1)
+{
+    return SIP64((uint8_t*)data, len, seed0, seed1);
+}
+
+uint64_t hashmap_murmur(const void *data, size_t len,
+                        uint64_t seed0, uint64_t seed1)
+{
+    (void)seed1;
+    return MM86128(data, len, seed0);
+}
+
+uint64_t hashmap_xxhash3(const void *data, size_t len,
+                         uint64_t seed0, uint64_t seed1){
+    (void)seed1;
+    return xxh3(data, len ,seed0);
+}
+
+// The wyhash64 mixer of wyhash, written by Wang Yi (public domain).
+uint64_t hashmap_mix64(uint64_t key, uint64_t seed0, uint64_t seed1) {
+    uint64_t a = key ^ seed1 ^ UINT64_C(0x2d358dccaa6c78a5);
+    uint64_t b = seed0 ^ UINT64_C(0x8bb84b93962eacc9);
+    mul128(a, b, &a, &b);
+    return mul128_fold64(a ^ UINT64_C(0x2d358dccaa6c78a5),
+                         b ^ UINT64_C(0x8bb84b93962eacc9));
+}
+
+//==============================================================================
+// TESTS AND BENCHMARKS
+// $ cc -DHASHMAP_TEST hashmap.c && ./a.out              # run tests
+// $ cc -DHASHMAP_TEST -O3 hashmap.c && BENCH=1 ./a.out  # run benchmarks
+//==============================================================================
+#ifdef HASHMAP_TEST
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wcompound-token-split-by-macro"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <stdio.h>
+#include "hashmap.h"
+
+// Counts the items bucket by bucket, checking the occupancy bits on the way.
+static size_t deepcount(struct hashmap *map) {
+    size_t count = map->old ? deepcount(map->old) : 0;
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        bool occupied = (map->occupied[i/64] >> (i%64)) & 1;
+        assert(occupied == (bucket_at(map, i)->dib != 0));
+        if (bucket_at(map, i)->dib) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static bool rand_alloc_fail = false;
+static int rand_alloc_fail_odds = 3; // 1 in 3 chance malloc will fail.
+static uintptr_t total_allocs = 0;
+static uintptr_t total_mem = 0;
+static uintptr_t peak_mem = 0;
+
+static void *xmalloc(size_t size) {
+    if (rand_alloc_fail && rand()%rand_alloc_fail_odds == 0) {
+        return NULL;
+    }
+    void *mem = malloc(sizeof(uintptr_t)+size);
+    assert(mem);
+    *(uintptr_t*)mem = size;
+    total_allocs++;
+    total_mem += size;
+    if (total_mem > peak_mem) {
+        peak_mem = total_mem;
+    }
+    return (char*)mem+sizeof(uintptr_t);
+}
+
+static void xfree(void *ptr) {
+    if (ptr) {
+        total_mem -= *(uintptr_t*)((char*)ptr-sizeof(uintptr_t));
+        free((char*)ptr-sizeof(uintptr_t));
+        total_allocs--;
+    }
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    if (rand_alloc_fail && rand()%rand_alloc_fail_odds == 0) {
+        return NULL;
+    }
+    char *mem = (char*)ptr-sizeof(uintptr_t);
+    total_mem -= *(uintptr_t*)mem;
+    mem = realloc(mem, sizeof(uintptr_t)+size);
+    assert(mem);
+    *(uintptr_t*)mem = size;
+    total_mem += size;
+    if (total_mem > peak_mem) {
+        peak_mem = total_mem;
+    }
+    return mem+sizeof(uintptr_t);
+}
+
+static void shuffle(void *array, size_t numels, size_t elsize) {
+    char tmp[elsize];
+    char *arr = array;
+    for (size_t i = 0; i < numels - 1; i++) {
+        int j = i + rand() / (RAND_MAX / (numels - i) + 1);
+        memcpy(tmp, arr + j * elsize, elsize);
+        memcpy(arr + j * elsize, arr + i * elsize, elsize);
+        memcpy(arr + i * elsize, tmp, elsize);
+    }
+}
+
+static bool iter_ints(const void *item, void *udata) {
+    int *vals = *(int**)udata;
+    vals[*(int*)item] = 1;
+    return true;
+}
+
+static int compare_ints_udata(const void *a, const void *b, void *udata) {
+    return *(int*)a - *(int*)b;
+}
+
+// Compares 64-bit integers that may sit unaligned in a packed item.
+static int compare_uint64s(const void *a, const void *b) {
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(uint64_t));
+    memcpy(&y, b, sizeof(uint64_t));
+    return x < y ? -1 : x > y;
+}
+
+static int compare_u64(const void *a, const void *b, void *udata) {
+    return compare_uint64s(a, b);
+}
+
+static int compare_strs(const void *a, const void *b, void *udata) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+static uint64_t hash_int(const void *item, uint64_t seed0, uint64_t seed1) {
+    return hashmap_xxhash3(item, sizeof(int), seed0, seed1);
+}
+
+static uint64_t hash_str(const void *item, uint64_t seed0, uint64_t seed1) {
+    return hashmap_xxhash3(*(char**)item, strlen(*(char**)item), seed0, seed1);
+}
+
+static void free_str(void *item) {
+    xfree(*(char**)item);
+}
+
+struct rec {
+    int key;
+    int val;
+    char pad[192];
+};
+
+static uint64_t hash_rec(const void *item, uint64_t seed0, uint64_t seed1) {
+    return hashmap_xxhash3(item, sizeof(int), seed0, seed1);
+}
+
+static int compare_recs(const void *a, const void *b, void *udata) {
+    return ((struct rec*)a)->key - ((struct rec*)b)->key;
+}
+
+static bool iter_recs(const void *item, void *udata) {
+    int *seen = udata;
+    seen[((struct rec*)item)->key]++;
+    return true;
+}
+
+// Tells whether hashmap_new_with_options takes the options, regardless of
+// the allocation failures of the tests.
+static bool options_accepted(const struct hashmap_options *opts) {
+    bool fail = rand_alloc_fail;
+    rand_alloc_fail = false;
+    struct hashmap *map = hashmap_new_with_options(opts, sizeof(int), 0, 0, 0,
+                                                   hash_int,
+                                                   compare_ints_udata, NULL,
+                                                   NULL);
+    rand_alloc_fail = fail;
+    bool accepted = map;
+    hashmap_free(map);
+    return accepted;
+}
+
+// Runs random operations on a map created with opts, checking every result
+// against a plain array.
+static void test_options(const struct hashmap_options *opts, int N) {
+    int *model;
+    while (!(model = xmalloc(N * sizeof(int)))) {}
+    for (int i = 0; i < N; i++) {
+        model[i] = -1;
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(struct rec), 0, 0, 0,
+                                            hash_rec, compare_recs, NULL,
+                                            NULL))) {}
+    size_t count = 0;
+    for (int i = 0; i < N*10; i++) {
+        struct rec r = { .key = rand()%N, .val = rand() };
+        struct rec *v, old;
+        // plain, into or with_hash
+        int variant = rand()%3;
+        uint64_t hash = hash_rec(&r, 0, 0);
+        switch (rand()%(opts->concurrent ? 3 : 4)) {
+        case 0:
+            while (true) {
+                if (variant == 1) {
+                    v = hashmap_set_into(map, &r, &old) ? &old : NULL;
+                } else if (variant == 2) {
+                    v = hashmap_set_with_hash(map, &r, hash);
+                } else {
+                    v = hashmap_set(map, &r);
+                }
+                if (!v && hashmap_oom(map)) {
+                    continue;
+                }
+                break;
+            }
+            if (model[r.key] == -1) {
+                assert(!v);
+                count++;
+            } else {
+                assert(v && v->key == r.key && v->val == model[r.key]);
+            }
+            model[r.key] = r.val;
+            break;
+        case 1:
+            if (variant == 2) {
+                v = hashmap_get_with_hash(map, &r, hash);
+            } else {
+                v = hashmap_get(map, &r);
+            }
+            if (model[r.key] == -1) {
+                assert(!v);
+            } else {
+                assert(v && v->key == r.key && v->val == model[r.key]);
+            }
+#ifndef HASHMAP_NO_THREADS
+            if (opts->concurrent) {
+                struct rec out;
+                assert(hashmap_get_concurrent(map, &r, &out) == (v != NULL));
+                assert(!v || out.val == v->val);
+            }
+#endif
+            break;
+        case 2:
+            if (variant == 1) {
+                v = hashmap_delete_into(map, &r, &old) ? &old : NULL;
+            } else if (variant == 2) {
+                v = hashmap_delete_with_hash(map, &r, hash);
+            } else {
+                v = hashmap_delete(map, &r);
+            }
+            if (model[r.key] == -1) {
+                assert(!v);
+            } else {
+                assert(v && v->key == r.key && v->val == model[r.key]);
+                model[r.key] = -1;
+                count--;
+            }
+            break;
+        case 3: {
+            bool existed;
+            while (!(v = hashmap_emplace(map, &(struct rec){ .key = r.key },
+                                         &existed))) {
+                assert(hashmap_oom(map));
+            }
+            assert(v->key == r.key && existed == (model[r.key] != -1));
+            if (existed) {
+                assert(v->val == model[r.key]);
+            } else {
+                assert(v->val == 0);
+                count++;
+            }
+            v->val = r.val;
+            model[r.key] = r.val;
+            break;
+        }
+        }
+        assert(hashmap_count(map) == count);
+        if (i % 256 == 0) {
+            assert(deepcount(map) == count);
+        }
+    }
+    assert(deepcount(map) == count);
+    int *seen;
+    while (!(seen = xmalloc(N * sizeof(int)))) {}
+    memset(seen, 0, N * sizeof(int));
+    assert(hashmap_scan(map, iter_recs, seen));
+    size_t iter = 0;
+    void *item;
+    while (hashmap_iter(map, &iter, &item)) {
+        iter_recs(item, seen);
+    }
+    for (int i = 0; i < N; i++) {
+        assert(seen[i] == (model[i] == -1 ? 0 : 2));
+    }
+    xfree(seen);
+    hashmap_clear(map, false);
+    assert(hashmap_count(map) == 0 && deepcount(map) == 0);
+    hashmap_free(map);
+    xfree(model);
+}
+
+struct arena {
+    size_t bytes;
+    size_t allocs;
+};
+
+static void *arena_malloc(size_t size, void *udata) {
+    struct arena *arena = udata;
+    void *mem = xmalloc(size);
+    if (mem) {
+        arena->bytes += size;
+        arena->allocs++;
+    }
+    return mem;
+}
+
+static void arena_free(void *ptr, size_t size, void *udata) {
+    struct arena *arena = udata;
+    // the size must match the allocation
+    assert(*(uintptr_t*)((char*)ptr-sizeof(uintptr_t)) == size);
+    arena->bytes -= size;
+    xfree(ptr);
+}
+
+static void *arena_realloc(void *ptr, size_t size, size_t new_size,
+                           void *udata)
+{
+    struct arena *arena = udata;
+    assert(*(uintptr_t*)((char*)ptr-sizeof(uintptr_t)) == size);
+    void *mem = xrealloc(ptr, new_size);
+    if (mem) {
+        arena->bytes += new_size-size;
+    }
+    return mem;
+}
+
+// Grows a map to N items and shrinks it back down, checking all items after
+// every resize.
+static void test_resize_in_place(const struct hashmap_options *opts, int N) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(int), 0, 0, 0,
+                                            hash_int, compare_ints_udata,
+                                            NULL, NULL))) {}
+    for (int i = 0; i < N; i++) {
+        size_t nbuckets = map->nbuckets;
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+        if (map->nbuckets != nbuckets) {
+            for (int j = 0; j <= i; j++) {
+                assert(hashmap_get(map, &j));
+            }
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        size_t nbuckets = map->nbuckets;
+        assert(*(int*)hashmap_delete(map, &i) == i);
+        if (map->nbuckets != nbuckets) {
+            for (int j = 0; j < N; j++) {
+                assert(!hashmap_get(map, &j) == (j <= i));
+            }
+        }
+    }
+    assert(hashmap_count(map) == 0);
+    hashmap_free(map);
+}
+
+static void test_load_factors(int N) {
+    struct hashmap_options opts[] = {
+        { .max_load = 0.9, .probe = HASHMAP_PROBE_GROUP },
+        { .max_load = 0.5, .growth = 4 },
+        { .min_load = 0.3, .hysteresis = 0.05, .realloc = realloc },
+        { .min_load = 0.3, .hysteresis = 0.05, .incremental = true },
+        { .max_load = 0.01, .no_shrink = true },
+    };
+    for (size_t i = 0; i < sizeof(opts)/sizeof(opts[0]); i++) {
+        opts[i].malloc = xmalloc;
+        opts[i].free = xfree;
+        if (opts[i].realloc) {
+            opts[i].realloc = xrealloc;
+        }
+        test_options(&opts[i], N);
+        test_resize_in_place(&opts[i], N);
+    }
+
+    // the table stays within its load factors
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .max_load = 0.5, .min_load = 0.2, .hysteresis = 0.1,
+        }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL,
+        NULL))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+        assert(map->count <= map->nbuckets/2);
+    }
+    for (int i = 0; i < N; i++) {
+        assert(hashmap_delete(map, &i));
+        assert(map->nbuckets == map->cap ||
+               map->count >= map->nbuckets/5);
+    }
+    hashmap_free(map);
+
+    // without shrinking the table keeps its size
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .no_shrink = true,
+        }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL,
+        NULL))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    size_t nbuckets = map->nbuckets;
+    for (int i = 0; i < N; i++) {
+        assert(hashmap_delete(map, &i));
+    }
+    assert(map->nbuckets == nbuckets);
+    hashmap_free(map);
+
+    struct hashmap_options bad[] = {
+        { .max_load = 1 },
+        { .max_load = -0.5 },
+        { .min_load = 0.8 },
+        { .min_load = 0.5 },
+        { .hysteresis = 0.75 },
+        { .growth = 3 },
+    };
+    for (size_t i = 0; i < sizeof(bad)/sizeof(bad[0]); i++) {
+        assert(!hashmap_new_with_options(&bad[i], sizeof(int), 0, 0, 0,
+                                         hash_int, compare_ints_udata, NULL,
+                                         NULL));
+    }
+}
+
+static void test_reserve(const struct hashmap_options *opts, int N) {
+    struct hashmap_options ropts = *opts;
+    ropts.no_shrink = true;
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&ropts, sizeof(int), 0, 0, 0,
+                                            hash_int, compare_ints_udata,
+                                            NULL, NULL))) {}
+    assert(!hashmap_reserve(map, SIZE_MAX) && hashmap_oom(map));
+    while (!hashmap_reserve(map, N)) {
+        assert(hashmap_oom(map));
+    }
+    assert(!hashmap_oom(map));
+    size_t nbuckets = map->nbuckets;
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+        assert(map->nbuckets == nbuckets && !map->old);
+    }
+    assert(hashmap_reserve(map, N/2) && map->nbuckets == nbuckets);
+
+    // no_shrink keeps the table until it's shrunk explicitly
+    for (int i = N/10; i < N; i++) {
+        assert(hashmap_delete(map, &i));
+    }
+    while (!hashmap_shrink_to_fit(map)) {
+        assert(hashmap_oom(map));
+    }
+    while (map->old) {
+        int i = 0;
+        hashmap_get(map, &i);
+        hashmap_set(map, &i);
+    }
+    assert(map->nbuckets <= nbuckets);
+    assert(map->count == (size_t)N/10 && map->count < map->growat);
+    if (map->nbuckets > map->cap) {
+        assert(map->count > map->nbuckets/2*map->max_load);
+    }
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_get(map, &i) == (i >= N/10));
+    }
+    hashmap_free(map);
+}
+
+struct scan_counts {
+    int *seen;
+    size_t count;
+    size_t limit; // stop after this many items
+};
+
+static bool count_recs(const void *item, void *udata) {
+    struct scan_counts *counts = udata;
+    __atomic_fetch_add(&counts->seen[((struct rec*)item)->key], 1,
+                       __ATOMIC_RELAXED);
+    return ++counts->count < counts->limit;
+}
+
+static void test_scan_range(const struct hashmap_options *opts, int N) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(struct rec), 0, 0, 0,
+                                            hash_rec, compare_recs, NULL,
+                                            NULL))) {}
+    int *seen;
+    while (!(seen = xmalloc(N*sizeof(int)))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &(struct rec){ .key = i }) &&
+               hashmap_oom(map)) {}
+    }
+    if (opts->incremental) {
+        // leave part of the items in the old table
+        while (!hashmap_reserve(map, N*4)) {}
+        int key = 0;
+        hashmap_get(map, &key);
+        while (!hashmap_set(map, &(struct rec){ .key = key }) &&
+               hashmap_oom(map)) {}
+        assert(map->old && map->old->count && map->count);
+    }
+    size_t size = hashmap_bucket_count(map);
+    for (int round = 0; round < 10; round++) {
+        memset(seen, 0, N*sizeof(int));
+        struct scan_counts counts = { .seen = seen, .limit = SIZE_MAX };
+        size_t begin = 0;
+        while (begin < size) {
+            size_t end = begin+rand()%(size/4+1);
+            assert(hashmap_scan_range(map, begin, end, count_recs, &counts));
+            begin = end;
+        }
+        assert(hashmap_scan_range(map, size, size+100, count_recs, &counts));
+        assert(counts.count == (size_t)N);
+        for (int i = 0; i < N; i++) {
+            assert(seen[i] == 1);
+        }
+    }
+    struct scan_counts counts = { .seen = seen, .limit = 1 };
+    assert(!hashmap_scan_range(map, 0, size, count_recs, &counts));
+    assert(counts.count == 1);
+#ifndef HASHMAP_NO_THREADS
+    for (int nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        memset(seen, 0, N*sizeof(int));
+        struct scan_counts per_thread[8];
+        void *udata[8];
+        for (int t = 0; t < nthreads; t++) {
+            per_thread[t] = (struct scan_counts){ 
+                .seen = seen, .limit = SIZE_MAX,
+            };
+            udata[t] = &per_thread[t];
+        }
+        assert(hashmap_scan_parallel(map, nthreads, count_recs, udata));
+        size_t count = 0;
+        for (int t = 0; t < nthreads; t++) {
+            count += per_thread[t].count;
+        }
+        assert(count == (size_t)N);
+        for (int i = 0; i < N; i++) {
+            assert(seen[i] == 1);
+        }
+        for (int t = 0; t < nthreads; t++) {
+            per_thread[t].limit = 1;
+        }
+        assert(!hashmap_scan_parallel(map, nthreads, count_recs, udata));
+    }
+#endif
+    xfree(seen);
+    hashmap_free(map);
+}
+
+static int recs_freed = 0;
+
+static void free_rec(void *item) {
+    (void)item;
+    recs_freed++;
+}
+
+// Checks that every bucket sits at its distance from home and that no bucket
+// is further from home than the bucket before it allows.
+static void check_robin_hood(struct hashmap *map) {
+    size_t count = 0;
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (!bucket->dib) {
+            continue;
+        }
+        count++;
+        assert(bucket->dib == ((i-(bucket->hash&map->mask))&map->mask)+1);
+        struct bucket *prev = bucket_at(map, (i-1)&map->mask);
+        assert(bucket->dib == 1 || prev->dib >= bucket->dib-1);
+        if (map->ctrl) {
+            assert(map->ctrl[i] == ctrl_tag(bucket->hash));
+        }
+    }
+    assert(count == map->count);
+}
+
+static uint64_t hash_ends(const void *item, uint64_t seed0, uint64_t seed1) {
+    int key = *(int*)item;
+    return key < 100 ? UINT64_MAX-key%7 : (uint64_t)key%5;
+}
+
+// Items whose homes are the last buckets wrap around to the first ones and
+// push back the items whose homes are there.
+static void test_build_wrap(void) {
+    int keys[300];
+    for (int i = 0; i < 300; i++) {
+        keys[i] = i%150;
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .probe = HASHMAP_PROBE_GROUP,
+        }, sizeof(int), 0, 0, 0, hash_ends, compare_ints_udata, NULL,
+        NULL))) {}
+    while (!hashmap_build(map, keys, 300) && hashmap_oom(map)) {}
+    assert(hashmap_count(map) == 150);
+    assert(bucket_at(map, 0)->dib > 1);
+    check_robin_hood(map);
+    for (int i = 0; i < 150; i++) {
+        assert(*(int*)hashmap_delete(map, &i) == i);
+    }
+    hashmap_free(map);
+}
+
+#ifndef HASHMAP_WIDE_BUCKETS
+// Gives runs of 64 keys the same home, which packs all keys into one cluster
+// that is far longer than the homes it covers.
+static uint64_t hash_rec_runs(const void *item, uint64_t seed0,
+                              uint64_t seed1)
+{
+    return ((struct rec*)item)->key/64;
+}
+
+// A cluster that is longer than a bucket can record fails the build, rather
+// than wrapping the distances of the items.
+static void test_build_overflow(void) {
+    int n = DIB_MAX+2000;
+    struct rec *recs;
+    while (!(recs = xmalloc(n*sizeof(struct rec)))) {}
+    for (int i = 0; i < n; i++) {
+        recs[i] = (struct rec){ .key = i%(DIB_MAX+1900), .val = i };
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree,
+        }, sizeof(struct rec), 0, 0, 0, hash_rec_runs, compare_recs,
+        free_rec, NULL))) {}
+    recs_freed = 0;
+    do {
+        errno = 0;
+    } while (!hashmap_build(map, recs, n) && hashmap_oom(map));
+    assert(errno == EOVERFLOW && hashmap_count(map) == 0 && !recs_freed);
+#ifndef HASHMAP_NO_THREADS
+    do {
+        errno = 0;
+    } while (!hashmap_build_parallel(map, recs, n, 4) && hashmap_oom(map));
+    assert(errno == EOVERFLOW && hashmap_count(map) == 0 && !recs_freed);
+#endif
+    // the map is left as it was
+    while (!hashmap_build(map, recs, 1000) && hashmap_oom(map)) {}
+    assert(hashmap_count(map) == 1000 && !recs_freed);
+    check_robin_hood(map);
+    for (int i = 0; i < 1000; i++) {
+        struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+        assert(r && r->val == i);
+    }
+    hashmap_free(map);
+    xfree(recs);
+}
+#endif
+
+// Sweeps the map a few times, deleting part of the items on every pass, and
+// checks that every item that is left is visited exactly once per pass.
+static void test_iter_delete(const struct hashmap_options *opts, int N) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(struct rec), 0, 0, 0,
+                                            hash_rec, compare_recs, NULL,
+                                            NULL))) {}
+    int *seen;
+    bool *present;
+    while (!(seen = xmalloc(N*sizeof(int)))) {}
+    while (!(present = xmalloc(N*sizeof(bool)))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &(struct rec){ .key = i }) &&
+               hashmap_oom(map)) {}
+        present[i] = true;
+    }
+    if (opts->incremental) {
+        while (!hashmap_reserve(map, N*4)) {}
+        int key = 0;
+        while (!hashmap_set(map, &(struct rec){ .key = key }) &&
+               hashmap_oom(map)) {}
+        assert(map->old && map->old->count && map->count);
+    }
+    size_t count = N;
+    for (int round = 0; round < 4; round++) {
+        memset(seen, 0, N*sizeof(int));
+        size_t visited = 0, start = count;
+        size_t iter = 0;
+        void *item;
+        while (hashmap_sweep(map, &iter, &item)) {
+            int key = ((struct rec*)item)->key;
+            assert(present[key]);
+            seen[key]++;
+            visited++;
+            if (rand()%2 == 0) {
+                struct rec *r = hashmap_iter_delete(map, &iter);
+                assert(r && r->key == key);
+                present[key] = false;
+                count--;
+            }
+        }
+        assert(!hashmap_iter_delete(map, &iter));
+        assert(visited == start);
+        assert(hashmap_count(map) == count && deepcount(map) == count);
+        check_robin_hood(map);
+        if (map->old) {
+            check_robin_hood(map->old);
+        }
+        for (int i = 0; i < N; i++) {
+            assert(present[i] ? seen[i] == 1 : seen[i] <= 1);
+            struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+            assert(present[i] ? r && r->key == i : !r);
+        }
+    }
+    size_t iter = 0;
+    assert(!hashmap_iter_delete(map, &iter));
+    xfree(present);
+    xfree(seen);
+    hashmap_free(map);
+}
+
+// Deleting the last items of a table pulls the items that wrapped around to
+// the first buckets back to the end, where they are visited only once.
+static void test_iter_delete_wrap(void) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .no_shrink = true,
+        }, sizeof(int), 0, 0, 0, hash_ends, compare_ints_udata, NULL,
+        NULL))) {}
+    for (int i = 0; i < 150; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    assert(bucket_at(map, 0)->dib > 1);
+    int seen[150] = { 0 };
+    size_t iter = 0;
+    void *item;
+    // hashmap_iter keeps its cursor within the buckets
+    size_t visited = 0;
+    while (hashmap_iter(map, &iter, &item)) {
+        assert(iter <= map->nbuckets);
+        visited++;
+    }
+    assert(visited == 150 && iter == map->nbuckets);
+    iter = 0;
+    while (hashmap_sweep(map, &iter, &item)) {
+        int key = *(int*)item;
+        seen[key]++;
+        if (key < 100) {
+            assert(*(int*)hashmap_iter_delete(map, &iter) == key);
+        }
+    }
+    for (int i = 0; i < 150; i++) {
+        assert(seen[i] == 1);
+    }
+    assert(hashmap_count(map) == 50 && deepcount(map) == 50);
+    check_robin_hood(map);
+    hashmap_free(map);
+}
+
+static bool *recs_evicted;
+
+static void evict_rec(void *item) {
+    recs_evicted[((struct rec*)item)->key] = true;
+    recs_freed++;
+}
+
+// Fills a bounded map with many more keys than it holds, checking that it
+// never resizes and that the keys that keep being used are never evicted.
+static void test_bounded(const struct hashmap_options *opts, int N) {
+    struct hashmap_options bopts = *opts;
+    bopts.max_count = N;
+    // max_count is not available with the incremental or concurrent options
+    bool accepted = !opts->incremental && !opts->concurrent;
+    assert(options_accepted(&bopts) == accepted);
+    if (!accepted) {
+        return;
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&bopts, sizeof(struct rec), 0, 0,
+                                            0, hash_rec, compare_recs,
+                                            evict_rec, NULL))) {}
+    size_t nbuckets = map->nbuckets;
+    assert(nbuckets*map->max_load >= N);
+    int nkeys = N*8;
+    while (!(recs_evicted = xmalloc(nkeys*sizeof(bool)))) {}
+    memset(recs_evicted, 0, nkeys*sizeof(bool));
+    recs_freed = 0;
+    int hot = N/8;
+    for (int i = 0; i < nkeys; i++) {
+        while (!hashmap_set(map, &(struct rec){ .key = i, .val = i }) && 
+               hashmap_oom(map)) {}
+        assert(!recs_evicted[i]);
+        assert(hashmap_count(map) == (size_t)(i < N ? i+1 : N));
+        assert(recs_freed == (i < N ? 0 : i+1-N));
+        for (int j = 0; j < hot && j <= i; j++) {
+            assert(hashmap_get(map, &(struct rec){ .key = j }));
+        }
+        if (i % 256 == 0) {
+            assert(deepcount(map) == hashmap_count(map));
+            check_robin_hood(map);
+            for (size_t w = 0; w < (nbuckets+63)/64; w++) {
+                assert(!(map->referenced[w] & ~map->occupied[w]));
+            }
+        }
+    }
+    assert(map->nbuckets == nbuckets);
+    for (int i = 0; i < nkeys; i++) {
+        struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+        assert(recs_evicted[i] ? !r : r && r->val == i);
+        assert(i >= hot || r);
+    }
+    // a replaced item is not evicted
+    int key = nkeys-1;
+    int freed = recs_freed;
+    assert(hashmap_set(map, &(struct rec){ .key = key, .val = -1 }));
+    assert(recs_freed == freed && hashmap_count(map) == (size_t)N);
+    hashmap_free(map);
+    xfree(recs_evicted);
+}
+
+static uint64_t test_now;
+static uint64_t *rec_deadlines;
+
+static uint64_t test_clock(void *udata) {
+    return test_now;
+}
+
+static void expire_rec(void *item) {
+    uint64_t deadline = rec_deadlines[((struct rec*)item)->key];
+    assert(deadline && deadline <= test_now);
+    evict_rec(item);
+}
+
+// Sets items with and without ttls while the clock moves on, checking that
+// gets and sweeps drop the items that expired and nothing else.
+static void test_expiry(const struct hashmap_options *opts, int N) {
+    struct hashmap_options eopts = *opts;
+    eopts.expiry = true;
+    eopts.clock = test_clock;
+    // expiry is not available with the concurrent option
+    assert(options_accepted(&eopts) == !opts->concurrent);
+    if (opts->concurrent) {
+        return;
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&eopts, sizeof(struct rec), 0, 0,
+                                            0, hash_rec, compare_recs,
+                                            expire_rec, NULL))) {}
+    while (!(recs_evicted = xmalloc(N*sizeof(bool)))) {}
+    while (!(rec_deadlines = xmalloc(N*sizeof(uint64_t)))) {}
+    memset(recs_evicted, 0, N*sizeof(bool));
+    recs_freed = 0;
+    test_now = 1000;
+    for (int i = 0; i < N; i++) {
+        uint64_t ttl = rand()%4 ? 1+rand()%1000 : 0;
+        rec_deadlines[i] = ttl ? test_now+ttl : 0;
+        struct rec r = { .key = i, .val = i };
+        while (!hashmap_set_ttl(map, &r, ttl) && hashmap_oom(map)) {}
+    }
+    if (opts->incremental) {
+        while (!hashmap_reserve(map, N*4)) {}
+        int key = 0;
+        while (!hashmap_set_ttl(map, &(struct rec){ .key = key, .val = key },
+                                0) && hashmap_oom(map)) {}
+        rec_deadlines[0] = 0;
+        assert(map->old && map->old->count && map->count);
+    }
+    // replacing an item with hashmap_set makes it last
+    for (int i = 1; i < N; i += 7) {
+        while (!hashmap_set(map, &(struct rec){ .key = i, .val = i }) &&
+               hashmap_oom(map)) {}
+        rec_deadlines[i] = 0;
+    }
+    for (int step = 0; step < 24; step++) {
+        test_now += 50;
+        for (int k = 0; k < N/8; k++) {
+            int i = rand()%N;
+            struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+            bool live = !rec_deadlines[i] || rec_deadlines[i] > test_now;
+            assert(live ? r && r->val == i : !r && recs_evicted[i]);
+        }
+        hashmap_expire_step(map, map->nbuckets/8);
+        assert(deepcount(map) == hashmap_count(map));
+        check_robin_hood(map);
+    }
+    // a full sweep leaves only the live items
+    while (map->old) {
+        hashmap_expire_step(map, 64);
+    }
+    hashmap_expire_step(map, map->nbuckets*2);
+    size_t live = 0;
+    for (int i = 0; i < N; i++) {
+        struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+        if (!rec_deadlines[i] || rec_deadlines[i] > test_now) {
+            assert(r && r->val == i && !recs_evicted[i]);
+            live++;
+        } else {
+            assert(!r && recs_evicted[i]);
+        }
+    }
+    assert(hashmap_count(map) == live && recs_freed == (int)(N-live));
+    check_robin_hood(map);
+    // an expired item is replaced as if it were gone
+    test_now += 1000;
+    for (int i = 0; i < N; i++) {
+        if (!rec_deadlines[i]) {
+            rec_deadlines[i] = test_now;
+            while (!hashmap_set_ttl(map, &(struct rec){ .key = i, .val = i },
+                                    1) && hashmap_oom(map)) {}
+        }
+    }
+    test_now += 1;
+    for (int i = 0; i < N; i++) {
+        rec_deadlines[i] = test_now;
+        assert(!hashmap_set_ttl(map, &(struct rec){ .key = i, .val = i }, 5) &&
+               !hashmap_oom(map));
+    }
+    assert(hashmap_count(map) == (size_t)N && recs_freed == N);
+    test_now += 5;
+    assert(hashmap_expire_step(map, map->nbuckets*2) == (size_t)N);
+    assert(hashmap_count(map) == 0);
+    hashmap_free(map);
+    xfree(rec_deadlines);
+    xfree(recs_evicted);
+}
+
+static int hash_calls;
+
+static uint64_t hash_int_counted(const void *item, uint64_t seed0,
+                                 uint64_t seed1)
+{
+    hash_calls++;
+    return hash_int(item, seed0, seed1);
+}
+
+// Streams a map in chunks of random sizes into another one that reads the
+// stream in pieces of random sizes, as if from a socket.
+static void test_export(const struct hashmap_options *opts, int N) {
+    struct hashmap *src, *dst;
+    while (!(src = hashmap_new_with_options(opts, sizeof(int), 0, 3, 4,
+                                            hash_int, compare_ints_udata,
+                                            NULL, NULL))) {}
+    while (!(dst = hashmap_new_with_options(opts, sizeof(int), 0, 3, 4,
+                                            hash_int_counted,
+                                            compare_ints_udata, NULL,
+                                            NULL))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(src, &i) && hashmap_oom(src)) {}
+    }
+    if (opts->incremental) {
+        while (!hashmap_reserve(src, N*4)) {}
+        int key = N;
+        while (!hashmap_set(src, &key) && hashmap_oom(src)) {}
+        assert(src->old);
+    }
+    // the receiver already has some of the keys
+    for (int i = 0; i < N; i += 5) {
+        int key = -i;
+        while (!hashmap_set(dst, &key) && hashmap_oom(dst)) {}
+    }
+    size_t recsz = 8+8;
+    size_t count = hashmap_count(src);
+    char *stream;
+    while (!(stream = xmalloc(count*recsz))) {}
+    size_t len = 0, cursor = 0, n;
+    n = hashmap_export(src, &cursor, stream, recsz);
+    assert(n == recsz);
+    len += n;
+    while ((n = hashmap_export(src, &cursor, stream+len, 
+                               recsz+rand()%(recsz*50))))
+    {
+        assert(n % recsz == 0);
+        len += n;
+        assert(len <= count*recsz);
+    }
+    assert(len == count*recsz);
+    assert(!hashmap_export(src, &cursor, stream, recsz));
+    uint64_t *piece;
+    while (!(piece = xmalloc(recsz*64))) {}
+    size_t off = 0, have = 0;
+    int calls = 0;
+    hash_calls = 0;
+    while (off < len || have) {
+        size_t m = rand()%(recsz*64-have+1);
+        if (m > len-off) {
+            m = len-off;
+        }
+        memcpy((char*)piece+have, stream+off, m);
+        off += m;
+        have += m;
+        size_t used = hashmap_import(dst, piece, have);
+        calls++;
+        assert(used % recsz == 0 && used <= have);
+        if (!hashmap_oom(dst)) {
+            assert(have-used < recsz);
+        }
+        memmove(piece, (char*)piece+used, have-used);
+        have -= used;
+        if (off == len && have && have < recsz) {
+            break;
+        }
+    }
+    assert(have == 0);
+    assert(hash_calls <= calls);
+    for (int i = 0; i <= N; i++) {
+        int *v = hashmap_get(dst, &i);
+        assert(i < N || opts->incremental ? v && *v == i : !v);
+    }
+    assert(hashmap_count(dst) == count+(N+4)/5-1);
+    check_robin_hood(dst);
+    hashmap_free(dst);
+
+    // a stream from a map with other seeds, or one that is not aligned, is
+    // turned down without touching the map
+    while (!(dst = hashmap_new_with_options(opts, sizeof(int), 0, 5, 6,
+                                            hash_int, compare_ints_udata,
+                                            NULL, NULL))) {}
+    errno = 0;
+    assert(hashmap_import(dst, stream, len) == 0 && errno == EILSEQ);
+    errno = 0;
+    assert(hashmap_import(dst, stream+1, recsz) == 0 && errno == EINVAL);
+    assert(hashmap_count(dst) == 0 && !hashmap_oom(dst));
+    xfree(piece);
+    xfree(stream);
+    hashmap_free(src);
+    hashmap_free(dst);
+}
+
+#ifdef HASHMAP_MMAP
+// Saves a map, with a pending resize for an incremental one, and checks the
+// read-only and writable maps that are opened from the file.
+static void test_snapshot(const struct hashmap_options *opts, int N) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(int), 0, 11, 22,
+                                            hash_int, compare_ints_udata,
+                                            NULL, NULL))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    for (int i = 0; i < N; i += 3) {
+        hashmap_delete(map, &i);
+    }
+    if (opts->incremental) {
+        while (!hashmap_reserve(map, N*4)) {}
+        int key = N;
+        while (!hashmap_set(map, &key) && hashmap_oom(map)) {}
+        assert(map->old);
+    }
+    size_t count = hashmap_count(map);
+    char path[] = "/tmp/hashmap-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    if (opts->expiry || opts->layout == HASHMAP_LAYOUT_INDIRECT) {
+        errno = 0;
+        assert(!hashmap_save(map, fd) && errno == ENOTSUP);
+        close(fd);
+        unlink(path);
+        hashmap_free(map);
+        return;
+    }
+    assert(hashmap_save(map, fd));
+    assert(!map->old && hashmap_count(map) == count);
+    close(fd);
+    size_t nbuckets = map->nbuckets;
+    hashmap_free(map);
+
+    // the keys are read straight from the file
+    map = hashmap_open_mmap(path, false, hash_int, compare_ints_udata, NULL);
+    assert(map && map->mapping && hashmap_count(map) == count);
+    assert(map->nbuckets == nbuckets);
+    assert(map->items == (opts->layout == HASHMAP_LAYOUT_SPLIT ? 
+           (char*)map->buckets+map->bucketsz*nbuckets : NULL));
+    assert(!map->ctrl == (opts->probe != HASHMAP_PROBE_GROUP));
+    assert(deepcount(map) == count);
+    check_robin_hood(map);
+    for (int i = 0; i <= N; i++) {
+        int *v = hashmap_get(map, &i);
+        bool present = i < N ? i%3 != 0 : opts->incremental;
+        assert(present ? v && *v == i : !v);
+    }
+    size_t iter = 0;
+    void *item;
+    size_t seen = 0;
+    while (hashmap_iter(map, &iter, &item)) {
+        seen++;
+    }
+    assert(seen == count);
+    hashmap_free(map);
+
+    // another hash function is turned down
+    assert(!hashmap_open_mmap(path, false, hash_ends, compare_ints_udata,
+                              NULL));
+
+    // changes to a writable map stay in memory, also when it grows
+    map = hashmap_open_mmap(path, true, hash_int, compare_ints_udata, NULL);
+    assert(map && map->mapping);
+    int key = 1;
+    assert(hashmap_delete(map, &key));
+    key = 0;
+    assert(!hashmap_set(map, &key));
+    assert(map->mapping);
+    for (int i = 0; i < N*16; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    while (map->old) {
+        hashmap_set(map, &key);
+    }
+    assert(!map->mapping && hashmap_count(map) == (size_t)N*16);
+    for (int i = 0; i < N*16; i++) {
+        assert(hashmap_get(map, &i));
+    }
+    hashmap_free(map);
+    map = hashmap_open_mmap(path, false, hash_int, compare_ints_udata, NULL);
+    assert(map && hashmap_count(map) == count);
+    key = 1;
+    assert(hashmap_get(map, &key));
+    key = 0;
+    assert(!hashmap_get(map, &key));
+    hashmap_free(map);
+
+    // a damaged file is turned down
+    fd = open(path, O_WRONLY);
+    assert(fd != -1 && ftruncate(fd, SNAPSHOT_HEADER+64) == 0);
+    close(fd);
+    assert(!hashmap_open_mmap(path, false, hash_int, compare_ints_udata,
+                              NULL));
+    unlink(path);
+    assert(!hashmap_open_mmap(path, false, hash_int, compare_ints_udata,
+                              NULL));
+}
+#endif
+
+static void test_build(const struct hashmap_options *opts, int N,
+                       int nthreads)
+{
+    int n = N*10;
+    struct rec *recs;
+    int *model;
+    while (!(recs = xmalloc(n*sizeof(struct rec)))) {}
+    while (!(model = xmalloc(n*sizeof(int)))) {}
+    int distinct = 0;
+    for (int i = 0; i < n; i++) {
+        model[i] = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        recs[i].key = rand()%(N*5);
+        recs[i].val = rand();
+        distinct += model[recs[i].key] == -1;
+        model[recs[i].key] = recs[i].val;
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(struct rec), 0, 0, 0,
+                                            hash_rec, compare_recs, free_rec,
+                                            NULL))) {}
+    recs_freed = 0;
+#ifndef HASHMAP_NO_THREADS
+    while (!hashmap_build_parallel(map, recs, n, nthreads)) {
+#else
+    (void)nthreads;
+    while (!hashmap_build(map, recs, n)) {
+#endif
+        assert(hashmap_oom(map));
+        if (opts->expiry) {
+            // hashmap_set_many keeps the items it placed
+            hashmap_clear(map, false);
+            recs_freed = 0;
+        }
+        assert(hashmap_count(map) == 0);
+    }
+    assert(hashmap_count(map) == (size_t)distinct);
+    assert(recs_freed == n-distinct);
+    check_robin_hood(map);
+    for (int i = 0; i < N*5; i++) {
+        struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+        assert(model[i] == -1 ? !r : r && r->val == model[i]);
+    }
+    // the map keeps working after the build, and builds on top of items
+    for (int i = 0; i < N*5; i += 2) {
+        if (model[i] != -1) {
+            assert(hashmap_delete(map, &(struct rec){ .key = i }));
+            model[i] = -1;
+        }
+    }
+    check_robin_hood(map);
+    while (!hashmap_build(map, recs, N) && hashmap_oom(map)) {}
+    for (int i = 0; i < N; i++) {
+        model[recs[i].key] = recs[i].val;
+    }
+    for (int i = 0; i < N*5; i++) {
+        struct rec *r = hashmap_get(map, &(struct rec){ .key = i });
+        assert(model[i] == -1 ? !r : r && r->val == model[i]);
+    }
+    hashmap_free(map);
+    xfree(model);
+    xfree(recs);
+}
+
+static void test_allocator(int N) {
+    struct arena arena = { 0 };
+    struct hashmap_allocator allocator = {
+        .malloc = arena_malloc, .free = arena_free, .udata = &arena,
+    };
+    struct hashmap_allocator resizer = allocator;
+    resizer.realloc = arena_realloc;
+    struct hashmap_options opts[] = {
+        { .allocator = &allocator },
+        { .allocator = &allocator, .align = 64, .recycle = true },
+        { .allocator = &allocator, .align = 4096, .recycle = true,
+          .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP },
+        { .allocator = &allocator, .recycle = true,
+          .layout = HASHMAP_LAYOUT_INDIRECT },
+        { .allocator = &resizer, .probe = HASHMAP_PROBE_GROUP },
+        { .allocator = &resizer, .layout = HASHMAP_LAYOUT_INDIRECT },
+        { .allocator = &allocator, .align = 64, .recycle = true,
+          .incremental = true, .probe = HASHMAP_PROBE_GROUP },
+#ifndef HASHMAP_NO_THREADS
+        { .allocator = &allocator, .recycle = true, .concurrent = true },
+#endif
+    };
+    for (size_t i = 0; i < sizeof(opts)/sizeof(opts[0]); i++) {
+        test_options(&opts[i], N);
+        assert(arena.bytes == 0);
+    }
+
+    // aligned tables and recycling of tables by per-request maps
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .allocator = &allocator, .align = 4096, .recycle = true,
+        }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL,
+        NULL))) {}
+    size_t allocs = 0;
+    for (int round = 0; round < 3; round++) {
+        allocs = arena.allocs;
+        for (int i = 0; i < N; i++) {
+            while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+            assert((uintptr_t)map->buckets % 4096 == 0);
+        }
+        hashmap_clear(map, false);
+    }
+    // the tables of the last round were all recycled
+    assert(arena.allocs == allocs);
+    hashmap_free(map);
+    assert(arena.bytes == 0);
+
+    map = hashmap_new_with_options(&(struct hashmap_options){
+            .hugepages = true,
+        }, sizeof(int), HUGEPAGE_SIZE/8, 0, 0, hash_int, compare_ints_udata,
+        NULL, NULL);
+    if (map) {
+        assert((uintptr_t)map->buckets % HUGEPAGE_SIZE == 0);
+        hashmap_free(map);
+    }
+    assert(!hashmap_new_with_options(&(struct hashmap_options){ .align = 3 },
+        sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL));
+}
+
+// Items of an indirect map keep their address while other items come and go.
+static void test_indirect_stable(int N) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree,
+            .layout = HASHMAP_LAYOUT_INDIRECT,
+        }, sizeof(struct rec), 0, 0, 0, hash_rec, compare_recs, NULL,
+        NULL))) {}
+    struct rec **ptrs;
+    while (!(ptrs = xmalloc(N * sizeof(struct rec*)))) {}
+    for (int i = 0; i < N; i++) {
+        struct rec r = { .key = i, .val = i };
+        while (!(ptrs[i] = hashmap_emplace(map, &r, NULL))) {}
+        ptrs[i]->val = i;
+    }
+    for (int round = 0; round < 2; round++) {
+        for (int i = N; i < N*4; i++) {
+            struct rec r = { .key = i, .val = i };
+            while (!hashmap_set(map, &r) && hashmap_oom(map)) {}
+        }
+        for (int i = N; i < N*4; i++) {
+            assert(hashmap_delete(map, &(struct rec){ .key = i }));
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        struct rec *v = hashmap_get(map, &(struct rec){ .key = i });
+        assert(v == ptrs[i] && v->val == i);
+    }
+    // the slab is reused after a clear
+    hashmap_clear(map, false);
+    for (int i = 0; i < N; i++) {
+        struct rec r = { .key = i, .val = i };
+        while (!hashmap_set(map, &r) && hashmap_oom(map)) {}
+    }
+    for (int i = 0; i < N; i++) {
+        struct rec *v = hashmap_get(map, &(struct rec){ .key = i });
+        assert(v && v->val == i);
+    }
+    xfree(ptrs);
+    hashmap_free(map);
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *mem = xmalloc(n*size);
+    if (mem) {
+        memset(mem, 0, n*size);
+    }
+    return mem;
+}
+
+#define hash_u64(key) hashmap_mix64((key), 0, 0)
+#define eq_u64(a, b) ((a) == (b))
+
+#undef HASHMAP_DEFINE_CALLOC
+#undef HASHMAP_DEFINE_FREE
+#define HASHMAP_DEFINE_CALLOC xcalloc
+#define HASHMAP_DEFINE_FREE xfree
+HASHMAP_DEFINE(u64map, uint64_t, uint64_t, hash_u64, eq_u64)
+HASHMAP_DEFINE_WITH_LOAD(u64dense, uint64_t, uint64_t, hash_u64, eq_u64, 0.9,
+                         0)
+
+static void test_define(int N) {
+    uint64_t *model;
+    while (!(model = xmalloc(N * sizeof(uint64_t)))) {}
+    memset(model, 0, N * sizeof(uint64_t));
+    struct u64map map;
+    while (!u64map_init(&map, 0)) {}
+    size_t count = 0;
+    for (int i = 0; i < N*10; i++) {
+        uint64_t key = rand()%N;
+        uint64_t val = (uint64_t)rand()+1;
+        uint64_t old = 0;
+        bool replaced;
+        uint64_t *v;
+        switch (rand()%3) {
+        case 0:
+            while (!u64map_set(&map, key, val, &old, &replaced)) {}
+            assert(replaced == (model[key] != 0));
+            assert(!replaced || old == model[key]);
+            count += !replaced;
+            model[key] = val;
+            break;
+        case 1:
+            v = u64map_get(&map, key);
+            assert(model[key] ? v && *v == model[key] : !v);
+            break;
+        case 2:
+            assert(u64map_delete(&map, key, &old) == (model[key] != 0));
+            assert(!model[key] || old == model[key]);
+            count -= model[key] != 0;
+            model[key] = 0;
+            break;
+        }
+        assert(u64map_count(&map) == count);
+    }
+    size_t i = 0, n = 0;
+    uint64_t *key, *val;
+    while (u64map_iter(&map, &i, &key, &val)) {
+        assert(*key < (uint64_t)N && model[*key] == *val);
+        n++;
+    }
+    assert(n == count);
+    u64map_clear(&map);
+    assert(u64map_count(&map) == 0 && !u64map_get(&map, 1));
+    u64map_destroy(&map);
+    xfree(model);
+
+    // a denser map that never shrinks
+    struct u64dense dense;
+    while (!u64dense_init(&dense, 0)) {}
+    for (uint64_t key = 0; key < 900; key++) {
+        while (!u64dense_set(&dense, key, key, NULL, NULL)) {}
+    }
+    assert(dense.nbuckets == 1024);
+    for (uint64_t key = 0; key < 900; key++) {
+        assert(*u64dense_get(&dense, key) == key);
+        assert(u64dense_delete(&dense, key, NULL));
+    }
+    assert(u64dense_count(&dense) == 0 && dense.nbuckets == 1024);
+    u64dense_destroy(&dense);
+}
+
+static int compare_calls;
+
+static int compare_ints_counted(const void *a, const void *b, void *udata) {
+    compare_calls++;
+    return *(int*)a - *(int*)b;
+}
+
+static uint64_t hash_high(const void *item, uint64_t seed0, uint64_t seed1) {
+    return (uint64_t)*(int*)item << 48;
+}
+
+// Keys whose hashes only differ in their high 16 bits share a home bucket. 
+// Wide buckets keep their hashes apart, so that a get compares one item.
+static void test_wide_hash(void) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree,
+        }, sizeof(int), 0, 0, 0, hash_high, compare_ints_counted, NULL,
+        NULL))) {}
+    int n = 200;
+    for (int i = 0; i < n; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    compare_calls = 0;
+    for (int i = 0; i < n; i++) {
+        assert(*(int*)hashmap_get(map, &i) == i);
+    }
+#ifdef HASHMAP_WIDE_BUCKETS
+    assert(compare_calls == n);
+#else
+    assert(compare_calls == n*(n+1)/2);
+#endif
+    check_robin_hood(map);
+    hashmap_free(map);
+}
+
+static uint64_t hash_seedless(const void *item, uint64_t seed0,
+                              uint64_t seed1)
+{
+    return 0;
+}
+
+// A weak hash that only mixes a key with a nonzero seed, so that keys which
+// differ in their high 16 bits collide for a zero seed.
+static uint64_t hash_weak(const void *item, uint64_t seed0, uint64_t seed1) {
+    uint64_t key = *(uint64_t*)item;
+    return seed0|seed1 ? hashmap_mix64(key, seed0, seed1) : key;
+}
+
+static uint64_t hash_u64_sip(const void *item, uint64_t seed0,
+                             uint64_t seed1)
+{
+    return hashmap_sip(item, sizeof(uint64_t), seed0, seed1);
+}
+
+static size_t longest_probe(struct hashmap *map) {
+    size_t longest = 0;
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        size_t dib = bucket_at(map, i)->dib;
+        longest = dib > longest ? dib : longest;
+    }
+    return longest;
+}
+
+static struct hashmap *new_flood_map(
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1),
+    uint64_t (*reseed_hash)(const void *item, uint64_t seed0, uint64_t seed1))
+{
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree, .max_probe = 32,
+            .reseed_hash = reseed_hash,
+        }, sizeof(uint64_t), 0, 0, 0, hash, compare_u64, NULL, NULL))) {}
+    return map;
+}
+
+static void check_flood_map(struct hashmap *map, const uint64_t *keys,
+                            int n)
+{
+    assert(hashmap_count(map) == (size_t)n);
+    for (int i = 0; i < n; i++) {
+        assert(*(uint64_t*)hashmap_get(map, &keys[i]) == keys[i]);
+    }
+    check_robin_hood(map);
+}
+
+// Keys that were crafted to collide for the seeds of a map make it reseed,
+// which spreads them out again, or switch to the reseed hash when the hash
+// ignores its seeds.
+static void test_flood(void) {
+    int n = 2000;
+    uint64_t *keys;
+    while (!(keys = xmalloc(n*sizeof(uint64_t)))) {}
+    for (int i = 0; i < n; i++) {
+        keys[i] = (uint64_t)i << 48;
+    }
+    struct hashmap *map = new_flood_map(hash_weak, NULL);
+    for (int i = 0; i < n; i++) {
+        while (!hashmap_set(map, &keys[i]) && hashmap_oom(map)) {}
+    }
+    assert(map->reseeds > 0 && map->max_probe == 32);
+    assert(longest_probe(map) <= 32);
+    check_flood_map(map, keys, n);
+    for (int i = 0; i < n; i += 2) {
+        assert(*(uint64_t*)hashmap_delete(map, &keys[i]) == keys[i]);
+    }
+    for (int i = 1; i < n; i += 2) {
+        assert(*(uint64_t*)hashmap_get(map, &keys[i]) == keys[i]);
+    }
+    // hashes of the current seeds find the keys and don't add them twice
+    for (int i = 0; i < n; i++) {
+        uint64_t hash = hashmap_hash(map, &keys[i]);
+        uint64_t *v = hashmap_get_with_hash(map, &keys[i], hash);
+        assert(i%2 ? v && *v == keys[i] : !v);
+        while (!(v = hashmap_set_with_hash(map, &keys[i], hash)) &&
+               hashmap_oom(map)) {}
+        assert(!v == !(i%2));
+    }
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+
+    // the hashes of a batch that were taken before a reseed are not used
+    map = new_flood_map(hash_weak, NULL);
+    size_t done = 0;
+    while ((done += hashmap_set_many(map, keys+done, n-done)) < (size_t)n) {}
+    assert(map->reseeds > 0);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+
+    // and so does a build, whose keys would otherwise stay in a cluster
+    map = new_flood_map(hash_weak, NULL);
+    while (!hashmap_build(map, keys, n) && hashmap_oom(map)) {}
+    assert(map->reseeds > 0 && longest_probe(map) <= 32);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+#ifndef HASHMAP_NO_THREADS
+    map = new_flood_map(hash_weak, NULL);
+    while (!hashmap_build_parallel(map, keys, n, 4) && hashmap_oom(map)) {}
+    assert(map->reseeds > 0 && longest_probe(map) <= 32);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+#endif
+    // spread out keys are built without a reseed
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    map = new_flood_map(hash_weak, NULL);
+    while (!hashmap_build(map, keys, n) && hashmap_oom(map)) {}
+    assert(!map->reseeds);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+    for (int i = 0; i < n; i++) {
+        keys[i] = (uint64_t)i << 48;
+    }
+
+    // a reseed during an incremental resize first drains the old table
+    while (!(map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree, .max_probe = 32,
+            .incremental = true,
+        }, sizeof(uint64_t), 0, 0, 0, hash_weak, compare_u64, NULL,
+        NULL))) {}
+    for (uint64_t key = 1; key <= (uint64_t)n; key++) {
+        while (!hashmap_set(map, &key) && hashmap_oom(map)) {}
+    }
+    while (!hashmap_reserve(map, n*8)) {}
+    uint64_t key = n+1;
+    while (!hashmap_set(map, &key) && hashmap_oom(map)) {}
+    assert(map->old);
+    for (int i = 1; i < n && !map->reseeds; i++) {
+        assert(map->old);
+        while (!hashmap_set(map, &keys[i]) && hashmap_oom(map)) {}
+    }
+    assert(map->reseeds > 0 && !map->old);
+    assert(longest_probe(map) <= 32);
+    for (key = 1; key <= (uint64_t)n+1; key++) {
+        assert(*(uint64_t*)hashmap_get(map, &key) == key);
+    }
+    check_robin_hood(map);
+    hashmap_free(map);
+
+    // neither are the hashes of records
+    struct hashmap *src;
+    while (!(src = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree,
+        }, sizeof(uint64_t), 0, 0, 0, hash_weak, compare_u64, NULL,
+        NULL))) {}
+    for (int i = 0; i < n; i++) {
+        while (!hashmap_set(src, &keys[i]) && hashmap_oom(src)) {}
+    }
+    uint64_t *recs;
+    while (!(recs = xmalloc(n*2*sizeof(uint64_t)))) {}
+    size_t cursor = 0;
+    size_t size = hashmap_export(src, &cursor, recs, n*2*sizeof(uint64_t));
+    assert(size == n*2*sizeof(uint64_t));
+    hashmap_free(src);
+    map = new_flood_map(hash_weak, NULL);
+    for (size_t off = 0; off < size; ) {
+        off += hashmap_import(map, (char*)recs+off, size-off);
+    }
+    assert(map->reseeds > 0);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+    xfree(recs);
+
+    map = new_flood_map(hash_seedless, hash_u64_sip);
+    for (int i = 0; i < n; i++) {
+        while (!hashmap_set(map, &keys[i]) && hashmap_oom(map)) {}
+    }
+    assert(map->reseeds == 1 && map->hash == hash_u64_sip);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+
+    // without a reseed hash, the limit backs off
+    map = new_flood_map(hash_seedless, NULL);
+    for (int i = 0; i < n; i++) {
+        while (!hashmap_set(map, &keys[i]) && hashmap_oom(map)) {}
+    }
+    assert(map->reseeds > 0 && map->reseeds <= 8);
+    check_flood_map(map, keys, n);
+    hashmap_free(map);
+
+#ifndef HASHMAP_NO_THREADS
+    struct hashmap_sharded *sharded;
+    while (!(sharded = hashmap_sharded_new(4, HASHMAP_LOCK_SPINLOCK,
+        &(struct hashmap_options){
+            .malloc = xmalloc, .free = xfree, .max_probe = 32,
+        }, sizeof(uint64_t), 0, 0, 0, hash_weak, compare_u64, NULL,
+        NULL))) {}
+    for (int i = 0; i < n; i++) {
+        while (!hashmap_sharded_set(sharded, &keys[i], NULL, NULL)) {}
+    }
+    assert(hashmap_sharded_count(sharded) == (size_t)n);
+    for (int i = 0; i < n; i++) {
+        uint64_t key;
+        assert(hashmap_sharded_get(sharded, &keys[i], &key));
+        assert(key == keys[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        assert(hashmap_sharded_delete(sharded, &keys[i], NULL));
+    }
+    assert(hashmap_sharded_count(sharded) == 0);
+    hashmap_sharded_free(sharded);
+#endif
+    assert(!hashmap_new_with_options(&(struct hashmap_options){
+        .concurrent = true, .max_probe = 32,
+    }, sizeof(uint64_t), 0, 0, 0, hash_weak, compare_u64, NULL, NULL));
+    xfree(keys);
+}
+
+// The statistics agree with the table, and with the operations when built
+// with HASHMAP_STATS.
+static void test_stats(const struct hashmap_options *opts, int N) {
+    struct hashmap *map;
+    while (!(map = hashmap_new_with_options(opts, sizeof(int), 0, 0, 0,
+        hash_int, compare_ints_udata, NULL, NULL))) {}
+    uint64_t sets = 0, gets = 0, deletes = 0;
+    for (int i = 0; i < N; i++) {
+        do {
+            sets++;
+        } while (!hashmap_set(map, &i) && hashmap_oom(map));
+    }
+    struct hashmap_stats stats;
+    hashmap_stats(map, &stats);
+    assert(stats.count == (size_t)N);
+    assert(stats.nbuckets == hashmap_bucket_count(map));
+    assert(stats.load == (double)N/stats.nbuckets);
+    assert(stats.grows > 0 && stats.shrinks == 0);
+    assert(stats.memory > table_size(map, map->nbuckets));
+    size_t total = 0;
+    for (int i = 0; i < HASHMAP_STATS_DIBS; i++) {
+        total += stats.dibs[i];
+    }
+    assert(total == (size_t)N);
+    size_t last = stats.max_dib < HASHMAP_STATS_DIBS ? stats.max_dib :
+                  HASHMAP_STATS_DIBS-1;
+    assert(stats.dibs[last] > 0 && stats.avg_dib <= stats.max_dib);
+    if (!map->old) {
+        assert(stats.max_dib+1 == longest_probe(map));
+    }
+    for (int i = 0; i < N; i++) {
+        gets++;
+        assert(*(int*)hashmap_get(map, &i) == i);
+    }
+    for (int i = 0; i < N; i++) {
+        deletes++;
+        assert(*(int*)hashmap_delete(map, &i) == i);
+    }
+    hashmap_stats(map, &stats);
+    assert(stats.count == 0 && stats.max_dib == 0 && stats.avg_dib == 0);
+    assert(stats.shrinks > 0);
+#ifdef HASHMAP_STATS
+    assert(stats.sets == sets && stats.gets == gets &&
+           stats.deletes == deletes);
+    assert(stats.set_probes >= sets && stats.get_probes >= gets &&
+           stats.delete_probes >= deletes);
+    assert(stats.compares >= gets+deletes);
+#else
+    assert(stats.sets == 0 && stats.set_probes == 0 && stats.compares == 0);
+#endif
+    hashmap_free(map);
 }
 
-uint32_t XXH_read32(const void* memptr) {
-    uint32_t val;
-    memcpy(&val, memptr, sizeof(val));
-    return val;
-}
+struct kv_key {
+    uint32_t id[3];
+};
 
-uint64_t XXH_rotl64(uint64_t x, int r) {
-    return (x << r) | (x >> (64 - r));
+static struct kv_key kv_key(int i) {
+    return (struct kv_key){ .id = { (uint32_t)i, (uint32_t)i*7, 5 } };
 }
 
-uint64_t xxh3(const void* data, size_t len, uint64_t seed) {
-    const uint8_t* p = (const uint8_t*)data;
-    const uint8_t* const end = p + len;
-    uint64_t h64;
-
-    if (len >= 32) {
-        const uint8_t* const limit = end - 32;
-        uint64_t v1 = seed + XXH_PRIME_1 + XXH_PRIME_2;
-        uint64_t v2 = seed + XXH_PRIME_2;
-        uint64_t v3 = seed + 0;
-        uint64_t v4 = seed - XXH_PRIME_1;
-
-        do {
-            v1 += XXH_read64(p) * XXH_PRIME_2;
-            v1 = XXH_rotl64(v1, 31);
-            v1 *= XXH_PRIME_1;
-
-            v2 += XXH_read64(p + 8) * XXH_PRIME_2;
-            v2 = XXH_rotl64(v2, 31);
-            v2 *= XXH_PRIME_1;
-
-            v3 += XXH_read64(p + 16) * XXH_PRIME_2;
-            v3 = XXH_rotl64(v3, 31);
-            v3 *= XXH_PRIME_1;
-
-            v4 += XXH_read64(p + 24) * XXH_PRIME_2;
-            v4 = XXH_rotl64(v4, 31);
-            v4 *= XXH_PRIME_1;
-
-            p += 32;
-        } while (p <= limit);
-
-        h64 = XXH_rotl64(v1, 1) + XXH_rotl64(v2, 7) + XXH_rotl64(v3, 12) + XXH_rotl64(v4, 18);
-
-        v1 *= XXH_PRIME_2;
-        v1 = XXH_rotl64(v1, 31);
-        v1 *= XXH_PRIME_1;
-        h64 ^= v1;
-        h64 = h64 * XXH_PRIME_1 + XXH_PRIME_4;
-
-        v2 *= XXH_PRIME_2;
-        v2 = XXH_rotl64(v2, 31);
-        v2 *= XXH_PRIME_1;
-        h64 ^= v2;
-        h64 = h64 * XXH_PRIME_1 + XXH_PRIME_4;
-
-        v3 *= XXH_PRIME_2;
-        v3 = XXH_rotl64(v3, 31);
-        v3 *= XXH_PRIME_1;
-        h64 ^= v3;
-        h64 = h64 * XXH_PRIME_1 + XXH_PRIME_4;
+static void check_kv_map(struct hashmap *map, int N) {
+    assert(hashmap_count(map) == (size_t)(N-N/2));
+    for (int i = 0; i < N; i++) {
+        struct kv_key key = kv_key(i);
+        uint64_t *v = hashmap_kv_get(map, &key);
+        assert(i < N/2 ? !v : v && *v == (uint64_t)i*3);
+        struct kv_key *item = hashmap_get(map, &key);
+        assert(i < N/2 ? !item : item->id[0] == (uint32_t)i &&
+               hashmap_kv_value(map, item) == v);
+    }
+}
 
-        v4 *= XXH_PRIME_2;
-        v4 = XXH_rotl64(v4, 31);
-        v4 *= XXH_PRIME_1;
-        h64 ^= v4;
-        h64 = h64 * XXH_PRIME_1 + XXH_PRIME_4;
+static void test_kv(const struct hashmap_options *opts, int N) {
+    if (opts->concurrent) {
+        // hashmap_kv_set is not supported by concurrent maps
+        return;
+    }
+    struct hashmap *map;
+    while (!(map = hashmap_kv_new_with_options(opts, sizeof(struct kv_key),
+        sizeof(uint64_t), 0, 1, 2, NULL, NULL, NULL))) {}
+    // the value is aligned after the 12 bytes of the key
+    assert(map->elsize == 24 && map->valoff == 16 && map->keycmp == 12);
+    for (int i = 0; i < N; i++) {
+        struct kv_key key = kv_key(i);
+        uint64_t val = i;
+        bool existed = true;
+        uint64_t *v;
+        while (!(v = hashmap_kv_set(map, &key, &val, &existed)) &&
+               hashmap_oom(map)) {}
+        assert(*v == val && !existed && (uintptr_t)v % 8 == 0);
+        val = (uint64_t)i*3;
+        while (!(v = hashmap_kv_set(map, &key, &val, &existed)) &&
+               hashmap_oom(map)) {}
+        assert(*v == val && existed);
     }
-    else {
-        h64 = seed + XXH_PRIME_5;
+    for (int i = 0; i < N/2; i++) {
+        struct kv_key key = kv_key(i);
+        uint64_t val = 0;
+        assert(hashmap_kv_delete(map, &key, &val) && val == (uint64_t)i*3);
+        assert(!hashmap_kv_delete(map, &key, NULL));
     }
-
-    h64 += (uint64_t)len;
-
-    while (p + 8 <= end) {
-        uint64_t k1 = XXH_read64(p);
-        k1 *= XXH_PRIME_2;
-        k1 = XXH_rotl64(k1, 31);
-        k1 *= XXH_PRIME_1;
-        h64 ^= k1;
-        h64 = XXH_rotl64(h64, 27) * XXH_PRIME_1 + XXH_PRIME_4;
-        p += 8;
+    check_kv_map(map, N);
+    size_t iter = 0, count = 0;
+    void *item;
+    while (hashmap_iter(map, &iter, &item)) {
+        uint64_t val = ((struct kv_key*)item)->id[0]*(uint64_t)3;
+        assert(*(uint64_t*)hashmap_kv_value(map, item) == val);
+        count++;
     }
-
-    if (p + 4 <= end) {
-        h64 ^= (uint64_t)(XXH_read32(p)) * XXH_PRIME_1;
-        h64 = XXH_rotl64(h64, 23) * XXH_PRIME_2 + XXH_PRIME_3;
-        p += 4;
+    assert(count == hashmap_count(map));
+#ifdef HASHMAP_MMAP
+    if (opts->expiry || opts->layout == HASHMAP_LAYOUT_INDIRECT) {
+        // deadlines are relative to a clock of this process, and indirect
+        // items live outside of the table
+        errno = 0;
+        assert(!hashmap_save(map, -1) && errno == ENOTSUP);
+    } else {
+        char path[] = "/tmp/hashmap-test-XXXXXX";
+        int fd = mkstemp(path);
+        assert(fd != -1);
+        assert(hashmap_save(map, fd));
+        close(fd);
+        hashmap_free(map);
+        // the map was made without functions, so it needs none
+        assert(!hashmap_open_mmap(path, false, hash_int, NULL, NULL));
+        map = hashmap_open_mmap(path, false, NULL, NULL, NULL);
+        assert(map && map->keycmp == 12 && map->valoff == 16);
+        check_kv_map(map, N);
+        unlink(path);
     }
+#endif
+    hashmap_free(map);
 
-    while (p < end) {
-        h64 ^= (*p) * XXH_PRIME_5;
-        h64 = XXH_rotl64(h64, 11) * XXH_PRIME_1;
-        p++;
+    // a set keeps just the keys, which the given functions compare
+    while (!(map = hashmap_kv_new_with_options(opts, sizeof(uint64_t), 0, 0,
+        0, 0, hash_u64_sip, compare_u64, NULL))) {}
+    assert(map->elsize == sizeof(uint64_t) && !map->keycmp);
+    if (!opts->expiry && opts->layout == HASHMAP_LAYOUT_INLINE) {
+        assert(map->entrysz == sizeof(struct bucket)+sizeof(uint64_t));
+    }
+    for (int i = 0; i < N; i++) {
+        uint64_t key = (uint64_t)i << 32;
+        bool existed = true;
+        while (!hashmap_kv_set(map, &key, NULL, &existed) &&
+               hashmap_oom(map)) {}
+        assert(!existed);
+    }
+    for (int i = 0; i < N*2; i++) {
+        uint64_t key = (uint64_t)i << 32;
+        assert(!hashmap_kv_get(map, &key) == (i >= N));
+    }
+    for (int i = 0; i < N; i += 2) {
+        uint64_t key = (uint64_t)i << 32;
+        assert(hashmap_kv_delete(map, &key, NULL));
     }
+    assert(hashmap_count(map) == (size_t)(N/2));
+    hashmap_free(map);
+    assert(!hashmap_kv_new(0, sizeof(int), 0, 0, 0, NULL, NULL, NULL));
+}
 
-    h64 ^= h64 >> 33;
-    h64 *= XXH_PRIME_2;
-    h64 ^= h64 >> 29;
-    h64 *= XXH_PRIME_3;
-    h64 ^= h64 >> 32;
+static void test_small(const struct hashmap_options *opts, int N) {
+    struct hashmap_options sopts = *opts;
+    sopts.small = 6;
+    bool accepted = !opts->concurrent && !opts->incremental &&
+                    !opts->align && !opts->hugepages &&
+                    opts->probe != HASHMAP_PROBE_GROUP;
+    assert(options_accepted(&sopts) == accepted);
+    if (!accepted) {
+        return;
+    }
+    struct hashmap *map;
+    // the map and, when recycling, its array of tables
+    uintptr_t allocs = total_allocs+(opts->recycle ? 2 : 1);
+    // indirect items are allocated apart from the map
+    bool indirect = opts->layout == HASHMAP_LAYOUT_INDIRECT;
+    while (!(map = hashmap_new_with_options(&sopts, sizeof(int), 0, 0, 0,
+        hash_int, compare_ints_udata, NULL, NULL))) {}
+    // six items at the default load fit in eight buckets
+    assert(map->buckets == map->small && map->nbuckets == 8);
+    assert(total_allocs == allocs);
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+        assert((map->buckets == map->small) == (i < 6));
+        if (i < 6 && !indirect) {
+            assert(total_allocs == allocs);
+        }
+    }
+    check_robin_hood(map);
+    for (int i = 0; i < N; i++) {
+        assert(*(int*)hashmap_get(map, &i) == i);
+    }
+    for (int i = 0; i < N; i++) {
+        assert(*(int*)hashmap_delete(map, &i) == i);
+        assert(!hashmap_get(map, &i));
+    }
+    // shrinking moves the map back into its own allocation
+    assert(map->buckets == map->small && hashmap_count(map) == 0);
+    assert(opts->recycle || indirect || total_allocs == allocs);
+    struct hashmap_stats stats;
+    hashmap_stats(map, &stats);
+    assert(opts->recycle || indirect || stats.memory == map_size(map));
+    for (int i = 0; i < 100; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    assert(map->buckets != map->small);
+    hashmap_clear(map, false);
+    assert(map->buckets == map->small && !hashmap_get(map, &(int){ 1 }));
+    hashmap_free(map);
+    assert(total_allocs == allocs-(opts->recycle ? 2 : 1));
 
-    return h64;
+    struct hashmap_options bad[] = {
+        { .small = 6, .incremental = true },
+        { .small = 6, .align = 64 },
+        { .small = 6, .probe = HASHMAP_PROBE_GROUP },
+    };
+    for (size_t i = 0; i < sizeof(bad)/sizeof(bad[0]); i++) {
+        assert(!hashmap_new_with_options(&bad[i], sizeof(int), 0, 0, 0,
+                                         hash_int, compare_ints_udata, NULL,
+                                         NULL));
+    }
 }
 
-uint64_t hashmap_sip(const void *data, size_t len,
-                     uint64_t seed0, uint64_t seed1)
-{
-    return SIP64((uint8_t*)data, len, seed0, seed1);
+static void test_group_match() {
+    uint8_t ctrl[GROUP_MAX];
+    for (int i = 0; i < 1000; i++) {
+        uint8_t tag = rand()&0x7F;
+        uint32_t want = 0, want_empty = 0;
+        for (int j = 0; j < GROUP_MAX; j++) {
+            switch (rand()%3) {
+            case 0: ctrl[j] = CTRL_EMPTY; want_empty |= (uint32_t)1<<j; break;
+            case 1: ctrl[j] = tag; want |= (uint32_t)1<<j; break;
+            default: ctrl[j] = rand()&0x7F; if (ctrl[j] == tag) want |= (uint32_t)1<<j;
+            }
+        }
+        struct hashmap map = { 0 };
+        group_select(&map);
+        uint32_t gmask = map.group_width == 32 ? 0xFFFFFFFF : 0xFFFF;
+        uint32_t empty;
+        uint32_t match = map.group_match(ctrl, tag, &empty);
+        if (map.group_match != group_match_scalar) {
+            assert(match == (want & gmask) && empty == (want_empty & gmask));
+        }
+        // the scalar fallback may report false positives
+        match = group_match_scalar(ctrl, tag, &empty);
+        assert((match & want & 0xFFFF) == (want & 0xFFFF));
+        assert(empty == (want_empty & 0xFFFF));
+    }
 }
 
-uint64_t hashmap_murmur(const void *data, size_t len,
-                        uint64_t seed0, uint64_t seed1)
-{
-    (void)seed1;
-    return MM86128(data, len, seed0);
+static size_t nfreed = 0;
+
+static void count_free(void *item) {
+    nfreed++;
 }
 
-uint64_t hashmap_xxhash3(const void *data, size_t len,
-                         uint64_t seed0, uint64_t seed1){
-    (void)seed1;
-    return xxh3(data, len ,seed0);
+static void test_many(int N) {
+    int *vals;
+    while (!(vals = xmalloc(N * 2 * sizeof(int)))) {}
+    for (int i = 0; i < N * 2; i++) {
+        vals[i] = i;
+    }
+    shuffle(vals, N, sizeof(int));
+    void **items;
+    while (!(items = xmalloc(N * 2 * sizeof(void*)))) {}
+    struct hashmap *map;
+    while (!(map = hashmap_new(sizeof(int), 0, 0, 0, hash_int,
+                               compare_ints_udata, count_free, NULL))) {}
+    for (size_t i = 0; i < (size_t)N; ) {
+        size_t n = hashmap_set_many(map, vals+i, N-i);
+        assert(n == (size_t)N-i || hashmap_oom(map));
+        i += n;
+    }
+    assert(hashmap_count(map) == (size_t)N);
+    // keys [N,N*2) are misses
+    hashmap_get_many(map, vals, N * 2, items);
+    for (int i = 0; i < N * 2; i++) {
+        if (i < N) {
+            assert(items[i] && *(int*)items[i] == vals[i]);
+        } else {
+            assert(!items[i]);
+        }
+    }
+    nfreed = 0;
+    for (size_t i = 0; i < (size_t)N/2; ) {
+        i += hashmap_set_many(map, vals+i, N/2-i);
+    }
+    assert(nfreed == (size_t)N/2);
+    assert(hashmap_count(map) == (size_t)N);
+    nfreed = 0;
+    assert(hashmap_delete_many(map, vals, N/2) == (size_t)N/2);
+    assert(hashmap_delete_many(map, vals, N/2) == 0);
+    assert(nfreed == (size_t)N/2);
+    assert(hashmap_count(map) == (size_t)(N-N/2));
+    hashmap_get_many(map, vals, N, items);
+    for (int i = 0; i < N; i++) {
+        assert(!items[i] == (i < N/2));
+    }
+    hashmap_free(map);
+    xfree(items);
+    xfree(vals);
 }
 
-//==============================================================================
-// TESTS AND BENCHMARKS
-// $ cc -DHASHMAP_TEST hashmap.c && ./a.out              # run tests
-// $ cc -DHASHMAP_TEST -O3 hashmap.c && BENCH=1 ./a.out  # run benchmarks
-//==============================================================================
-#ifdef HASHMAP_TEST
+#ifndef HASHMAP_NO_THREADS
 
-static size_t deepcount(struct hashmap *map) {
+static void test_sharded_model(size_t nshards, enum hashmap_lock lock, int N) {
+    int *model;
+    while (!(model = xmalloc(N * sizeof(int)))) {}
+    for (int i = 0; i < N; i++) {
+        model[i] = 0;
+    }
+    struct hashmap_sharded *map;
+    while (!(map = hashmap_sharded_new(nshards, lock,
+        &(struct hashmap_options){ .malloc = xmalloc, .free = xfree },
+        sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL))) {}
     size_t count = 0;
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        if (bucket_at(map, i)->dib) {
-            count++;
+    for (int i = 0; i < N * 4; i++) {
+        int key = rand() % N;
+        int out = -1;
+        bool replaced;
+        switch (rand() % 3) {
+        case 0:
+            if (hashmap_sharded_set(map, &key, &out, &replaced)) {
+                assert(replaced == model[key]);
+                assert(!replaced || out == key);
+                count += !model[key];
+                model[key] = 1;
+            }
+            break;
+        case 1:
+            assert(hashmap_sharded_get(map, &key, &out) == model[key]);
+            assert(!model[key] || out == key);
+            break;
+        case 2:
+            assert(hashmap_sharded_delete(map, &key, &out) == model[key]);
+            assert(!model[key] || out == key);
+            count -= model[key];
+            model[key] = 0;
+            break;
         }
     }
-    return count;
+    assert(hashmap_sharded_count(map) == count);
+    int *seen;
+    while (!(seen = xmalloc(N * sizeof(int)))) {}
+    memset(seen, 0, N * sizeof(int));
+    assert(hashmap_sharded_scan(map, iter_ints, &seen));
+    for (int i = 0; i < N; i++) {
+        assert(seen[i] == model[i]);
+    }
+    hashmap_sharded_free(map);
+    xfree(seen);
+    xfree(model);
 }
 
-#ifdef __GNUC__
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#endif
-#ifdef __clang__
-#pragma GCC diagnostic ignored "-Wcompound-token-split-by-macro"
-#endif
-
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-#include <assert.h>
-#include <stdio.h>
-#include "hashmap.h"
-
-static bool rand_alloc_fail = false;
-static int rand_alloc_fail_odds = 3; // 1 in 3 chance malloc will fail.
-static uintptr_t total_allocs = 0;
-static uintptr_t total_mem = 0;
+struct sharded_worker {
+    pthread_t thread;
+    struct hashmap_sharded *map;
+    int id;
+    int N;
+};
 
-static void *xmalloc(size_t size) {
-    if (rand_alloc_fail && rand()%rand_alloc_fail_odds == 0) {
-        return NULL;
+// Each worker owns the keys [id*N,(id+1)*N) and also reads the shared keys
+// [-N,0), which are never changed.
+static void *sharded_work(void *arg) {
+    struct sharded_worker *w = arg;
+    int base = w->id * w->N;
+    for (int i = 0; i < w->N; i++) {
+        int key = base + i;
+        int shared = -1 - i;
+        assert(hashmap_sharded_set(w->map, &key, NULL, NULL));
+        assert(hashmap_sharded_get(w->map, &shared, NULL));
     }
-    void *mem = malloc(sizeof(uintptr_t)+size);
-    assert(mem);
-    *(uintptr_t*)mem = size;
-    total_allocs++;
-    total_mem += size;
-    return (char*)mem+sizeof(uintptr_t);
-}
-
-static void xfree(void *ptr) {
-    if (ptr) {
-        total_mem -= *(uintptr_t*)((char*)ptr-sizeof(uintptr_t));
-        free((char*)ptr-sizeof(uintptr_t));
-        total_allocs--;
+    for (int i = 0; i < w->N; i++) {
+        int key = base + i;
+        int out;
+        assert(hashmap_sharded_get(w->map, &key, &out) && out == key);
+        if (i % 2 == 0) {
+            assert(hashmap_sharded_delete(w->map, &key, NULL));
+        }
     }
+    return NULL;
 }
 
-static void shuffle(void *array, size_t numels, size_t elsize) {
-    char tmp[elsize];
-    char *arr = array;
-    for (size_t i = 0; i < numels - 1; i++) {
-        int j = i + rand() / (RAND_MAX / (numels - i) + 1);
-        memcpy(tmp, arr + j * elsize, elsize);
-        memcpy(arr + j * elsize, arr + i * elsize, elsize);
-        memcpy(arr + i * elsize, tmp, elsize);
-    }
-}
+struct concurrent_reader {
+    pthread_t thread;
+    struct hashmap *map;
+    volatile bool *done;
+    int N;
+};
 
-static bool iter_ints(const void *item, void *udata) {
-    int *vals = *(int**)udata;
-    vals[*(int*)item] = 1;
-    return true;
+// Keys [0,N) are never deleted, while the writer churns [N,N*8) which makes
+// the map grow and shrink. Each value is derived from its key so that torn
+// reads are detected.
+static void *concurrent_read(void *arg) {
+    struct concurrent_reader *r = arg;
+    while (!*r->done) {
+        for (int i = 0; i < r->N; i++) {
+            struct rec key = { .key = (unsigned)i*2654435761u % (r->N*8) };
+            struct rec out;
+            bool found = hashmap_get_concurrent(r->map, &key, &out);
+            assert(found || key.key >= r->N);
+            assert(!found || (out.key == key.key && out.val % 1000 ==
+                              out.key % 1000));
+            key.key = i;
+            assert(hashmap_get_concurrent(r->map, &key, &out));
+            assert(out.key == i && out.val % 1000 == i % 1000);
+        }
+    }
+    return NULL;
 }
 
-static int compare_ints_udata(const void *a, const void *b, void *udata) {
-    return *(int*)a - *(int*)b;
+static void test_concurrent_threads(int N) {
+    struct hashmap *map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = malloc, .free = free, .concurrent = true,
+        }, sizeof(struct rec), 0, 0, 0, hash_rec, compare_recs, NULL, NULL);
+    assert(map);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &(struct rec){ .key = i, .val = i }));
+    }
+    volatile bool done = false;
+    struct concurrent_reader readers[4];
+    for (int i = 0; i < 4; i++) {
+        readers[i] = (struct concurrent_reader){
+            .map = map, .done = &done, .N = N
+        };
+        assert(!pthread_create(&readers[i].thread, NULL, concurrent_read,
+                               &readers[i]));
+    }
+    for (int round = 0; round < 4; round++) {
+        for (int i = N; i < N*8; i++) {
+            hashmap_set(map, &(struct rec){ .key = i, .val = i+round*1000 });
+        }
+        for (int i = 0; i < N; i++) {
+            hashmap_set(map, &(struct rec){ .key = i, .val = i+round*1000 });
+        }
+        for (int i = N; i < N*8; i++) {
+            assert(hashmap_delete(map, &(struct rec){ .key = i }));
+        }
+    }
+    done = true;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(readers[i].thread, NULL);
+    }
+    assert(hashmap_count(map) == (size_t)N);
+    hashmap_free(map);
 }
 
-static int compare_strs(const void *a, const void *b, void *udata) {
-    return strcmp(*(char**)a, *(char**)b);
+static void test_sharded_threads(enum hashmap_lock lock, int N) {
+    // The test allocator isn't thread-safe, so use the system one.
+    struct hashmap_sharded *map = hashmap_sharded_new(16, lock,
+        &(struct hashmap_options){ .malloc = malloc, .free = free },
+        sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL);
+    assert(map);
+    for (int i = 0; i < N; i++) {
+        int shared = -1 - i;
+        assert(hashmap_sharded_set(map, &shared, NULL, NULL));
+    }
+    struct sharded_worker workers[4];
+    for (int i = 0; i < 4; i++) {
+        workers[i] = (struct sharded_worker){ .map = map, .id = i, .N = N };
+        assert(!pthread_create(&workers[i].thread, NULL, sharded_work,
+                               &workers[i]));
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    assert(hashmap_sharded_count(map) == (size_t)(N + 4 * (N - (N+1)/2)));
+    hashmap_sharded_free(map);
 }
 
-static uint64_t hash_int(const void *item, uint64_t seed0, uint64_t seed1) {
-    return hashmap_xxhash3(item, sizeof(int), seed0, seed1);
-}
+#endif
 
-static uint64_t hash_str(const void *item, uint64_t seed0, uint64_t seed1) {
-    return hashmap_xxhash3(*(char**)item, strlen(*(char**)item), seed0, seed1);
+// Compares hashmap_xxhash3 against values of the reference implementation, 
+// for lengths on both sides of every path and of the stripes and blocks of 
+// long inputs.
+static void test_xxhash3(void) {
+    static const struct { size_t len; uint64_t hash; } vectors[2][31] = { {
+        { 0, UINT64_C(0x2d06800538d394c2) },
+        { 1, UINT64_C(0x4c5cca45d0f4811f) },
+        { 2, UINT64_C(0x29c60963cbfa4e6e) },
+        { 3, UINT64_C(0x6e3e2670e61106ac) },
+        { 4, UINT64_C(0x5c4c63133443d03f) },
+        { 7, UINT64_C(0x46a5c724d51fe43f) },
+        { 8, UINT64_C(0xf9fd4dd0b04d78f5) },
+        { 9, UINT64_C(0x7c20df9712c26edf) },
+        { 15, UINT64_C(0xb345a7b2698ba575) },
+        { 16, UINT64_C(0x86abf6baccea0858) },
+        { 17, UINT64_C(0xb58bf5dc5022d071) },
+        { 32, UINT64_C(0xe3712ed84c04a66e) },
+        { 33, UINT64_C(0xa4dee99b093e1f73) },
+        { 64, UINT64_C(0x1291d2d4042330dd) },
+        { 65, UINT64_C(0x97c6bf83217e5ec9) },
+        { 96, UINT64_C(0x81296929fc063365) },
+        { 97, UINT64_C(0xf145a45b658ab9dd) },
+        { 127, UINT64_C(0xed4cf62104020db5) },
+        { 128, UINT64_C(0x10d17f72c0ccba41) },
+        { 129, UINT64_C(0x1648bdc3db49d1a2) },
+        { 200, UINT64_C(0xc0fbc0f4e181c826) },
+        { 239, UINT64_C(0xf0d154819adb16cd) },
+        { 240, UINT64_C(0xb6cfaf343fab81e6) },
+        { 241, UINT64_C(0x956cae592c67279e) },
+        { 255, UINT64_C(0x64a6073025eb7929) },
+        { 256, UINT64_C(0xb15e550733c5dfac) },
+        { 1023, UINT64_C(0xa94ffcd2254368e4) },
+        { 1024, UINT64_C(0x70bd377d9574f4bb) },
+        { 1025, UINT64_C(0x66c4487c41e127a7) },
+        { 2048, UINT64_C(0x8b46caa67dab3a30) },
+        { 4096, UINT64_C(0x9ddd66c14af0daff) },
+    }, {
+        { 0, UINT64_C(0x602b0e2cd6662c8b) },
+        { 1, UINT64_C(0x2f3acd3805f81de3) },
+        { 2, UINT64_C(0x28a7b77c08c091eb) },
+        { 3, UINT64_C(0xbc74611d87f659e0) },
+        { 4, UINT64_C(0x6c3753177c607de4) },
+        { 7, UINT64_C(0x3e7941a452179655) },
+        { 8, UINT64_C(0xbc72d0531396303f) },
+        { 9, UINT64_C(0x93c5aa006102daf5) },
+        { 15, UINT64_C(0x082933f851ba6e46) },
+        { 16, UINT64_C(0x69d001b16ecf450a) },
+        { 17, UINT64_C(0xb7c99d19be27eb69) },
+        { 32, UINT64_C(0xe5fb38c81d49c6f5) },
+        { 33, UINT64_C(0x5a46a370c35146ac) },
+        { 64, UINT64_C(0x543fa55d8db03991) },
+        { 65, UINT64_C(0xf3efe40559a76a28) },
+        { 96, UINT64_C(0x260f288635623ee8) },
+        { 97, UINT64_C(0x58817b2a6ec0ed2e) },
+        { 127, UINT64_C(0x12557eb9b4c6d9c6) },
+        { 128, UINT64_C(0x49b81c6e0abb9305) },
+        { 129, UINT64_C(0x5e3831b221810b00) },
+        { 200, UINT64_C(0x83264818fb531769) },
+        { 239, UINT64_C(0x23ad00dea6ed6611) },
+        { 240, UINT64_C(0x76a73ec26433f82c) },
+        { 241, UINT64_C(0x2be236ba3bacf75c) },
+        { 255, UINT64_C(0x407522ce8ddf4b58) },
+        { 256, UINT64_C(0x92999d62f0815eef) },
+        { 1023, UINT64_C(0x4de00b8ba99fe3ea) },
+        { 1024, UINT64_C(0xd8cf6b464541f232) },
+        { 1025, UINT64_C(0x8dc3a55e9c26d886) },
+        { 2048, UINT64_C(0x9f2f0261a2592b60) },
+        { 4096, UINT64_C(0xc7bc989f5d547a4d) },
+    } };
+    static uint8_t data[4096];
+    for (int i = 0; i < 4096; i++) {
+        data[i] = (uint8_t)(i*131+7);
+    }
+    uint64_t seeds[2] = { 0, UINT64_C(0x9E3779B97F4A7C15) };
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < 31; i++) {
+            assert(hashmap_xxhash3(data, vectors[s][i].len, seeds[s], 0) ==
+                   vectors[s][i].hash);
+        }
+    }
+    // the input may start anywhere
+    uint64_t hash = hashmap_xxhash3(data+1, 255, 0, 0);
+    memmove(data, data+1, 255);
+    assert(hashmap_xxhash3(data, 255, 0, 0) == hash);
 }
 
-static void free_str(void *item) {
-    xfree(*(char**)item);
+// Checks that hashmap_mix64 tells small keys apart and depends on both seeds.
+static void test_mix64(int N) {
+    uint64_t *hashes;
+    while (!(hashes = xmalloc(N*sizeof(uint64_t)))) {}
+    for (int i = 0; i < N; i++) {
+        hashes[i] = hashmap_mix64(i, 1, 2);
+    }
+    qsort(hashes, N, sizeof(uint64_t), compare_uint64s);
+    for (int i = 1; i < N; i++) {
+        assert(hashes[i] != hashes[i-1]);
+    }
+    xfree(hashes);
+    assert(hashmap_mix64(7, 1, 2) == hashmap_mix64(7, 1, 2));
+    assert(hashmap_mix64(7, 1, 2) != hashmap_mix64(7, 3, 2));
+    assert(hashmap_mix64(7, 1, 2) != hashmap_mix64(7, 1, 3));
 }
 
 static void all() {
@@ -771,6 +6495,9 @@ static void all() {
     // test sip and murmur hashes
     assert(hashmap_sip("hello", 5, 1, 2) == 2957200328589801622);
     assert(hashmap_murmur("hello", 5, 1, 2) == 1682575153221130884);
+    assert(hashmap_xxhash3("hello", 5, 1, 2) == 8408359951548325522);
+    test_xxhash3();
+    test_mix64(N);
 
     int *vals;
     while (!(vals = xmalloc(N * sizeof(int)))) {}
@@ -780,7 +6507,7 @@ static void all() {
 
     struct hashmap *map;
 
-    while (!(map = hashmap_new(sizeof(int), 0, seed, seed, 
+    while (!(map = hashmap_new(sizeof(int), 0, seed, seed,
                                hash_int, compare_ints_udata, NULL, NULL))) {}
     shuffle(vals, N, sizeof(int));
     for (int i = 0; i < N; i++) {
@@ -797,7 +6524,7 @@ static void all() {
                 break;
             }
         }
-        
+
         for (int j = 0; j < i; j++) {
             v = hashmap_get(map, &vals[j]);
             assert(v && *v == vals[j]);
@@ -912,6 +6639,296 @@ static void all() {
 
     hashmap_free(map);
 
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_SPLIT,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_SPLIT,
+        .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_INDIRECT,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_INDIRECT,
+        .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    assert(!hashmap_new_with_options(&(struct hashmap_options){
+        .layout = HASHMAP_LAYOUT_INDIRECT, .incremental = true,
+    }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL));
+    test_indirect_stable(N);
+    test_allocator(N);
+    test_load_factors(N);
+    test_build(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N, 1);
+    test_build_wrap();
+#ifndef HASHMAP_WIDE_BUCKETS
+    test_build_overflow();
+#endif
+    test_iter_delete_wrap();
+    test_bounded(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N);
+    test_bounded(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_SPLIT,
+        .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_bounded(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_INDIRECT,
+        .max_load = 0.9,
+    }, N);
+    assert(!hashmap_new_with_options(&(struct hashmap_options){
+        .max_count = 100, .incremental = true,
+    }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL));
+    test_expiry(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N);
+    test_expiry(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_expiry(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_SPLIT,
+        .incremental = true,
+    }, N);
+    test_expiry(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .layout = HASHMAP_LAYOUT_INDIRECT, .max_load = 0.9,
+    }, N);
+    test_export(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N);
+    test_export(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_SPLIT,
+        .probe = HASHMAP_PROBE_GROUP, .incremental = true,
+    }, N);
+#ifdef HASHMAP_MMAP
+    test_snapshot(&(struct hashmap_options){ 0 }, N);
+    test_snapshot(&(struct hashmap_options){
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_snapshot(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+        .max_load = 0.9,
+    }, N);
+#endif
+    test_iter_delete(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N*5);
+    test_iter_delete(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N*5);
+    test_iter_delete(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_INDIRECT,
+    }, N*5);
+    test_scan_range(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N*10);
+    test_scan_range(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+        .layout = HASHMAP_LAYOUT_SPLIT,
+    }, N*10);
+    test_build(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .probe = HASHMAP_PROBE_GROUP,
+        .max_load = 0.9,
+    }, N, 4);
+    test_build(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_SPLIT,
+        .incremental = true,
+    }, N, 3);
+    test_build(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_INDIRECT,
+    }, N, 8);
+    test_reserve(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .no_shrink = true,
+    }, N);
+    test_reserve(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .no_shrink = true, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_reserve(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .no_shrink = true,
+        .incremental = true,
+    }, N);
+    test_reserve(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .no_shrink = true,
+        .layout = HASHMAP_LAYOUT_INDIRECT, .max_load = 0.9,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .layout = HASHMAP_LAYOUT_INDIRECT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_resize_in_place(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+    }, N);
+    test_resize_in_place(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+#ifndef HASHMAP_NO_THREADS
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .concurrent = true,
+    }, N);
+    test_options(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .concurrent = true,
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_iter_delete(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .concurrent = true,
+    }, N*5);
+    assert(!hashmap_new_with_options(&(struct hashmap_options){
+        .concurrent = true, .incremental = true,
+    }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL));
+#endif
+    test_group_match();
+    test_wide_hash();
+    test_flood();
+    test_stats(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N);
+    test_stats(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_stats(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+    }, N);
+    test_stats(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .layout = HASHMAP_LAYOUT_INDIRECT,
+    }, N);
+    test_small(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .small = 6,
+    }, N);
+    test_small(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree, .small = 6,
+    }, N);
+    test_small(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .small = 6,
+        .layout = HASHMAP_LAYOUT_SPLIT, .expiry = true,
+    }, N);
+    test_small(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .small = 6, .recycle = true,
+    }, N);
+    test_kv(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree,
+    }, N);
+    test_kv(&(struct hashmap_options){
+        .malloc = xmalloc, .realloc = xrealloc, .free = xfree,
+        .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+    }, N);
+    test_kv(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .incremental = true,
+    }, N);
+    test_kv(&(struct hashmap_options){
+        .malloc = xmalloc, .free = xfree, .expiry = true,
+    }, N);
+
+    // Every test that takes options also runs against all of the options
+    // that are accepted here, adding the options it is about.
+    struct {
+        struct hashmap_options opts;
+        bool accepted;
+    } matrix[] = {
+        { { 0 }, true },
+        { { .realloc = xrealloc }, true },
+        { { .layout = HASHMAP_LAYOUT_SPLIT }, true },
+        { { .probe = HASHMAP_PROBE_GROUP }, true },
+        { { .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP,
+            .realloc = xrealloc }, true },
+        { { .incremental = true }, true },
+        { { .incremental = true, .layout = HASHMAP_LAYOUT_SPLIT,
+            .probe = HASHMAP_PROBE_GROUP }, true },
+        { { .incremental = true, .max_load = 0.9 }, true },
+        { { .layout = HASHMAP_LAYOUT_INDIRECT }, true },
+        { { .layout = HASHMAP_LAYOUT_INDIRECT, .probe = HASHMAP_PROBE_GROUP,
+            .realloc = xrealloc, .max_load = 0.9 }, true },
+        { { .expiry = true }, true },
+        { { .small = 6 }, true },
+        { { .small = 6, .realloc = xrealloc, .recycle = true }, true },
+        { { .small = 6, .layout = HASHMAP_LAYOUT_SPLIT, .expiry = true },
+          true },
+        { { .recycle = true, .probe = HASHMAP_PROBE_GROUP }, true },
+        { { .recycle = true, .incremental = true,
+            .layout = HASHMAP_LAYOUT_SPLIT }, true },
+        { { .max_probe = 32 }, true },
+        { { .max_probe = 32, .incremental = true,
+            .layout = HASHMAP_LAYOUT_SPLIT, .probe = HASHMAP_PROBE_GROUP },
+          true },
+        { { .max_probe = 32, .small = 6, .recycle = true }, true },
+        { { .layout = HASHMAP_LAYOUT_INDIRECT, .incremental = true }, false },
+        { { .small = 6, .incremental = true }, false },
+        { { .small = 6, .probe = HASHMAP_PROBE_GROUP }, false },
+        { { .max_load = 1.0 }, false },
+#ifndef HASHMAP_NO_THREADS
+        { { .concurrent = true }, true },
+        { { .concurrent = true, .layout = HASHMAP_LAYOUT_SPLIT,
+            .probe = HASHMAP_PROBE_GROUP }, true },
+        { { .concurrent = true, .incremental = true }, false },
+        { { .concurrent = true, .max_probe = 32 }, false },
+        { { .concurrent = true, .expiry = true }, false },
+#else
+        { { .concurrent = true }, false },
+#endif
+    };
+    for (size_t i = 0; i < sizeof(matrix)/sizeof(matrix[0]); i++) {
+        struct hashmap_options *opts = &matrix[i].opts;
+        opts->malloc = xmalloc;
+        opts->free = xfree;
+        assert(options_accepted(opts) == matrix[i].accepted);
+        if (!matrix[i].accepted) {
+            continue;
+        }
+        test_options(opts, N);
+        test_resize_in_place(opts, N);
+        test_reserve(opts, N);
+        test_build(opts, N, i%8+1);
+        test_scan_range(opts, N*10);
+        test_iter_delete(opts, N*5);
+        test_bounded(opts, N);
+        test_expiry(opts, N);
+#ifdef HASHMAP_MMAP
+        test_snapshot(opts, N);
+#endif
+        test_export(opts, N);
+        test_stats(opts, N);
+        test_kv(opts, N);
+        test_small(opts, N);
+    }
+    test_many(N);
+    test_define(N);
+#ifndef HASHMAP_NO_THREADS
+    test_sharded_model(1, HASHMAP_LOCK_RWLOCK, N);
+    test_sharded_model(5, HASHMAP_LOCK_RWLOCK, N);
+    test_sharded_model(5, HASHMAP_LOCK_SPINLOCK, N);
+    rand_alloc_fail = false;
+    test_sharded_threads(HASHMAP_LOCK_RWLOCK, N);
+    test_sharded_threads(HASHMAP_LOCK_SPINLOCK, N);
+    test_concurrent_threads(N);
+    rand_alloc_fail = true;
+#endif
+
     if (total_allocs != 0) {
         fprintf(stderr, "total_allocs: expected 0, got %lu\n", total_allocs);
         exit(1);
@@ -951,6 +6968,212 @@ static void all() {
     printf("\n"); \
 }}
 
+struct kv64 {
+    uint64_t key;
+    uint64_t val;
+};
+
+static uint64_t hash_kv64(const void *item, uint64_t seed0, uint64_t seed1) {
+    return hashmap_mix64(((struct kv64*)item)->key, seed0, seed1);
+}
+
+// Prints the worst latency of a single hashmap_set, which exposes the cost of
+// resizing.
+static void bench_worst_set(const char *name, struct hashmap *map, int *vals,
+                            int N)
+{
+    double worst = 0;
+    for (int i = 0; i < N; i++) {
+        clock_t begin = clock();
+        hashmap_set(map, &vals[i]);
+        double elapsed = (double)(clock() - begin) / CLOCKS_PER_SEC;
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+    }
+    printf("%-14s %d ops, worst %.3f ms/op\n", name, N, worst*1e3);
+}
+
+#ifndef HASHMAP_NO_THREADS
+
+struct sharded_bench {
+    pthread_t thread;
+    struct hashmap_sharded *map;
+    int *vals;
+    int n;
+    bool write;
+};
+
+static void *sharded_bench_work(void *arg) {
+    struct sharded_bench *b = arg;
+    for (int i = 0; i < b->n; i++) {
+        if (b->write) {
+            hashmap_sharded_set(b->map, &b->vals[i], NULL, NULL);
+        } else {
+            bool found = hashmap_sharded_get(b->map, &b->vals[i], NULL);
+            assert(found);
+        }
+    }
+    return NULL;
+}
+
+struct concurrent_bench {
+    pthread_t thread;
+    struct hashmap *map;
+    int *vals;
+    int n;
+    volatile bool *done;
+};
+
+static void *concurrent_bench_read(void *arg) {
+    struct concurrent_bench *b = arg;
+    for (int i = 0; i < b->n; i++) {
+        int out;
+        bool found = hashmap_get_concurrent(b->map, &b->vals[i], &out);
+        assert(found);
+    }
+    return NULL;
+}
+
+static void *concurrent_bench_write(void *arg) {
+    struct concurrent_bench *b = arg;
+    for (int i = 0; !*b->done; i = (i + 1) % b->n) {
+        hashmap_set(b->map, &b->vals[i]);
+    }
+    return NULL;
+}
+
+static double wall_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Prints the wall time of N lock-free gets split over nreaders, optionally
+// while one writer keeps replacing items.
+static void bench_concurrent(int nreaders, bool writer, int *vals, int N) {
+    struct hashmap *map = hashmap_new_with_options(&(struct hashmap_options){
+            .malloc = malloc, .free = free, .concurrent = true,
+        }, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL);
+    assert(map);
+    for (int i = 0; i < N; i++) {
+        hashmap_set(map, &vals[i]);
+    }
+    volatile bool done = false;
+    struct concurrent_bench w = { .map = map, .vals = vals, .n = N,
+                                  .done = &done };
+    if (writer) {
+        assert(!pthread_create(&w.thread, NULL, concurrent_bench_write, &w));
+    }
+    struct concurrent_bench b[64];
+    double begin = wall_secs();
+    for (int i = 0; i < nreaders; i++) {
+        b[i] = (struct concurrent_bench){ .map = map,
+            .vals = vals + (size_t)N/nreaders*i, .n = N/nreaders };
+        assert(!pthread_create(&b[i].thread, NULL, concurrent_bench_read,
+                               &b[i]));
+    }
+    for (int i = 0; i < nreaders; i++) {
+        pthread_join(b[i].thread, NULL);
+    }
+    double elapsed_secs = wall_secs() - begin;
+    done = true;
+    if (writer) {
+        pthread_join(w.thread, NULL);
+    }
+    int nops = N/nreaders*nreaders;
+    printf("get (conc%s) %d readers, %d ops in %.3f secs, %.0f ns/op, "
+        "%.0f op/sec\n", writer ? ",w" : "", nreaders, nops, elapsed_secs,
+        elapsed_secs/(double)nops*1e9, (double)nops/elapsed_secs);
+    hashmap_free(map);
+}
+
+// Prints the wall time of N sets followed by N gets, split over nthreads.
+static void bench_sharded(const char *name, size_t nshards,
+                          enum hashmap_lock lock, int nthreads, int *vals,
+                          int N)
+{
+    struct hashmap_sharded *map = hashmap_sharded_new(nshards, lock,
+        &(struct hashmap_options){ .malloc = malloc, .free = free },
+        sizeof(int), N, 0, 0, hash_int, compare_ints_udata, NULL, NULL);
+    assert(map);
+    struct sharded_bench b[64];
+    for (int write = 1; write >= 0; write--) {
+        double begin = wall_secs();
+        for (int i = 0; i < nthreads; i++) {
+            b[i] = (struct sharded_bench){ .map = map, .write = write,
+                .vals = vals + (size_t)N/nthreads*i, .n = N/nthreads };
+            assert(!pthread_create(&b[i].thread, NULL, sharded_bench_work,
+                                   &b[i]));
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(b[i].thread, NULL);
+        }
+        double elapsed_secs = wall_secs() - begin;
+        int nops = N/nthreads*nthreads;
+        printf("%s %-6s %d threads, %d ops in %.3f secs, %.0f ns/op, "
+            "%.0f op/sec\n", write ? "set" : "get", name, nthreads, nops,
+            elapsed_secs, elapsed_secs/(double)nops*1e9,
+            (double)nops/elapsed_secs);
+    }
+    hashmap_sharded_free(map);
+}
+
+static bool sum_ints(const void *item, void *udata) {
+    *(uint64_t*)udata += *(int*)item;
+    return true;
+}
+
+// Prints the wall time of summing a map of N items on nthreads.
+static void bench_scan(int nthreads, struct hashmap *map, int N) {
+    // a cache line per thread
+    uint64_t sums[8*8] = { 0 };
+    void *udata[8];
+    for (int t = 0; t < nthreads; t++) {
+        udata[t] = &sums[t*8];
+    }
+    double begin = wall_secs();
+    assert(hashmap_scan_parallel(map, nthreads, sum_ints, udata));
+    double elapsed_secs = wall_secs() - begin;
+    uint64_t sum = 0;
+    for (int t = 0; t < nthreads; t++) {
+        sum += sums[t*8];
+    }
+    assert(sum == (uint64_t)N*(N-1)/2);
+    printf("scan           %d threads, %d ops in %.3f secs, %.0f ns/op, "
+        "%.0f op/sec\n", nthreads, N, elapsed_secs,
+        elapsed_secs/(double)N*1e9, (double)N/elapsed_secs);
+}
+
+// Prints the wall time of building a map from N items on nthreads.
+static void bench_build(int nthreads, int *vals, int N) {
+    struct hashmap *map = hashmap_new(sizeof(int), 0, 0, 0, hash_int,
+                                      compare_ints_udata, NULL, NULL);
+    double begin = wall_secs();
+    assert(hashmap_build_parallel(map, vals, N, nthreads));
+    double elapsed_secs = wall_secs() - begin;
+    assert(hashmap_count(map) == (size_t)N);
+    printf("build          %d threads, %d ops in %.3f secs, %.0f ns/op, "
+        "%.0f op/sec\n", nthreads, N, elapsed_secs,
+        elapsed_secs/(double)N*1e9, (double)N/elapsed_secs);
+    hashmap_free(map);
+}
+
+#endif
+
+// Keeps the low scaled_bits of the hash, which pick the home bucket, and the
+// bits from 40 up, so the buckets tell items apart by as many hash bits as
+// they would in a table of 2^40 buckets.
+static int scaled_bits;
+
+static uint64_t hash_int_scaled(const void *item, uint64_t seed0,
+                                uint64_t seed1)
+{
+    uint64_t hash = hash_int(item, seed0, seed1);
+    uint64_t cleared = (UINT64_C(1) << 40)-(UINT64_C(1) << scaled_bits);
+    return hash & ~cleared;
+}
+
 static void benchmarks() {
     int seed = getenv("SEED")?atoi(getenv("SEED")):time(NULL);
     int N = getenv("N")?atoi(getenv("N")):5000000;
@@ -968,7 +7191,7 @@ static void benchmarks() {
     struct hashmap *map;
     shuffle(vals, N, sizeof(int));
 
-    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata, 
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
                       NULL, NULL);
     bench("set", N, {
         int *v = hashmap_set(map, &vals[i]);
@@ -986,7 +7209,24 @@ static void benchmarks() {
     })
     hashmap_free(map);
 
-    map = hashmap_new(sizeof(int), N, seed, seed, hash_int, compare_ints_udata, 
+    // growing by copying into new tables or by resizing the table in place
+    for (int r = 0; r < 2; r++) {
+        map = hashmap_new_with_options(&(struct hashmap_options){
+                .malloc = xmalloc, .realloc = r ? xrealloc : NULL,
+                .free = xfree,
+            }, sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+            NULL, NULL);
+        size_t base = total_mem;
+        peak_mem = total_mem;
+        bench(r ? "set (realloc)" : "set (copy)", N, {
+            int *v = hashmap_set(map, &vals[i]);
+            assert(!v);
+        })
+        printf("%-14s %.2f MB peak\n", "", (double)(peak_mem-base)/1e6);
+        hashmap_free(map);
+    }
+
+    map = hashmap_new(sizeof(int), N, seed, seed, hash_int, compare_ints_udata,
                       NULL, NULL);
     bench("set (cap)", N, {
         int *v = hashmap_set(map, &vals[i]);
@@ -1005,7 +7245,465 @@ static void benchmarks() {
 
     hashmap_free(map);
 
-    
+    map = hashmap_new_with_options(&(struct hashmap_options){
+            .probe = HASHMAP_PROBE_GROUP,
+        }, sizeof(int), N, seed, seed, hash_int, compare_ints_udata,
+        NULL, NULL);
+    bench("set (group)", N, {
+        int *v = hashmap_set(map, &vals[i]);
+        assert(!v);
+    })
+    shuffle(vals, N, sizeof(int));
+    bench("get (group)", N, {
+        int *v = hashmap_get(map, &vals[i]);
+        assert(v && *v == vals[i]);
+    })
+    hashmap_free(map);
+
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    bench("set (reserve)", N, {
+        if (i == 0) {
+            assert(hashmap_reserve(map, N));
+        }
+        int *v = hashmap_set(map, &vals[i]);
+        assert(!v);
+    })
+    hashmap_free(map);
+
+    // iterating a map left sparse by a capacity way above its count
+    map = hashmap_new(sizeof(int), N, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    for (int i = 0; i < N; i += 64) {
+        assert(!hashmap_set(map, &vals[i]));
+    }
+    size_t iter = 0;
+    void *item;
+    bench("iter (sparse)", N, {
+        if (!hashmap_iter(map, &iter, &item)) {
+            iter = 0;
+        }
+    })
+    hashmap_free(map);
+
+    // items that expire at different times, swept away in small steps
+    map = hashmap_new_with_options(&(struct hashmap_options){
+            .expiry = true, .clock = test_clock,
+        }, sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+        NULL, NULL);
+    test_now = 0;
+    bench("set_ttl", N, {
+        int *v = hashmap_set_ttl(map, &vals[i], 1+i%100);
+        assert(!v);
+    })
+    shuffle(vals, N, sizeof(int));
+    bench("get (ttl)", N, {
+        int *v = hashmap_get(map, &vals[i]);
+        assert(v && *v == vals[i]);
+    })
+    test_now = 100;
+    // a step every 1024 items covers the table, which is larger than N
+    bench("expire_step", N, {
+        if (i % 1024 == 0) {
+            hashmap_expire_step(map, 4096);
+        }
+    })
+    assert(hashmap_count(map) == 0);
+    hashmap_free(map);
+
+    // a cache that holds an eighth of the keys and evicts the rest
+    map = hashmap_new_with_options(&(struct hashmap_options){
+            .max_count = N/8 > 0 ? N/8 : 1,
+        }, sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+        NULL, NULL);
+    bench("set (bounded)", N, {
+        int *v = hashmap_set(map, &vals[i]);
+        assert(!v);
+    })
+    hashmap_free(map);
+
+    // one sweep that deletes every item with an odd value
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &vals[i]));
+    }
+    iter = 0;
+    bench("iter_delete", N, {
+        assert(hashmap_sweep(map, &iter, &item));
+        if (*(int*)item % 2) {
+            assert(hashmap_iter_delete(map, &iter));
+        }
+    })
+    assert(hashmap_count(map) == (size_t)(N/2) + N%2);
+    hashmap_free(map);
+
+    // replicating a map through a stream of records in 64 KB chunks
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &vals[i]));
+    }
+    struct hashmap *map2 = hashmap_new(sizeof(int), 0, seed, seed, hash_int,
+                                       compare_ints_udata, NULL, NULL);
+    uint64_t *chunk = xmalloc(65536);
+    size_t cursor = 0, len = 0;
+    bench("export+import", N, {
+        if (len == 0) {
+            len = hashmap_export(map, &cursor, chunk, 65536);
+            assert(len);
+            assert(hashmap_import(map2, chunk, len) == len);
+        }
+        len -= 16;
+    })
+    assert(hashmap_count(map2) == (size_t)N);
+    xfree(chunk);
+    hashmap_free(map2);
+    hashmap_free(map);
+
+#ifdef HASHMAP_MMAP
+    // a saved map that's opened once and then served from the page cache
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &vals[i]));
+    }
+    char path[] = "/tmp/hashmap-bench-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    bench("save", 1, {
+        assert(hashmap_save(map, fd));
+    })
+    close(fd);
+    hashmap_free(map);
+    bench("open (mmap)", 1, {
+        map = hashmap_open_mmap(path, false, hash_int, compare_ints_udata,
+                                NULL);
+        assert(map);
+    })
+    shuffle(vals, N, sizeof(int));
+    bench("get (mmap)", N, {
+        int *v = hashmap_get(map, &vals[i]);
+        assert(v && *v == vals[i]);
+    })
+    hashmap_free(map);
+    unlink(path);
+#endif
+
+    // memory against probe length
+    for (int l = 0; l < 2; l++) {
+        map = hashmap_new_with_options(&(struct hashmap_options){
+                .malloc = xmalloc, .free = xfree,
+                .probe = HASHMAP_PROBE_GROUP, .max_load = l ? 0.9 : 0.5,
+            }, sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+            NULL, NULL);
+        bench(l ? "set (load .9)" : "set (load .5)", N, {
+            int *v = hashmap_set(map, &vals[i]);
+            assert(!v);
+        })
+        shuffle(vals, N, sizeof(int));
+        bench(l ? "get (load .9)" : "get (load .5)", N, {
+            int *v = hashmap_get(map, &vals[i]);
+            assert(v && *v == vals[i]);
+        })
+        hashmap_free(map);
+    }
+
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    bench_worst_set("set (worst)", map, vals, N);
+    hashmap_free(map);
+    map = hashmap_new_with_options(&(struct hashmap_options){
+            .incremental = true,
+        }, sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+        NULL, NULL);
+    bench("set (incr)", N, {
+        int *v = hashmap_set(map, &vals[i]);
+        assert(!v);
+    })
+    shuffle(vals, N, sizeof(int));
+    bench("get (incr)", N, {
+        int *v = hashmap_get(map, &vals[i]);
+        assert(v && *v == vals[i]);
+    })
+    hashmap_clear(map, false);
+    bench_worst_set("set (incr worst)", map, vals, N);
+    hashmap_free(map);
+
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    // one batch of keys every BATCH iterations, so that ns/op is per key
+    int nbatch = N/BATCH*BATCH;
+    bench("set_many", nbatch, {
+        if (i%BATCH == 0) {
+            assert(hashmap_set_many(map, &vals[i], BATCH) == BATCH);
+        }
+    })
+    shuffle(vals, nbatch, sizeof(int));
+    void *items[BATCH];
+    bench("get_many", nbatch, {
+        if (i%BATCH == 0) {
+            hashmap_get_many(map, &vals[i], BATCH, items);
+            assert(items[0] && *(int*)items[0] == vals[i]);
+        }
+    })
+    shuffle(vals, nbatch, sizeof(int));
+    bench("delete_many", nbatch, {
+        if (i%BATCH == 0) {
+            assert(hashmap_delete_many(map, &vals[i], BATCH) == BATCH);
+        }
+    })
+    hashmap_free(map);
+
+    // uint64_t to uint64_t, using the generic map and a specialized one
+    map = hashmap_new(sizeof(struct kv64), N, seed, seed, hash_kv64,
+                      compare_u64, NULL, NULL);
+    bench("set (kv64)", N, {
+        struct kv64 kv = { .key = vals[i] };
+        kv.val = i;
+        assert(!hashmap_set(map, &kv));
+    })
+    shuffle(vals, N, sizeof(int));
+    bench("get (kv64)", N, {
+        struct kv64 *v = hashmap_get(map, &(struct kv64){ .key = vals[i] });
+        assert(v && v->key == (uint64_t)vals[i]);
+    })
+    hashmap_free(map);
+    struct u64map u64map;
+    assert(u64map_init(&u64map, N));
+    bench("set (define)", N, {
+        assert(u64map_set(&u64map, vals[i], i, NULL, NULL));
+    })
+    shuffle(vals, N, sizeof(int));
+    bench("get (define)", N, {
+        uint64_t *v = u64map_get(&u64map, vals[i]);
+        assert(v);
+    })
+    u64map_destroy(&u64map);
+
+    // large items, with the bucket headers inline, split from the items, or
+    // pointing into a slab
+    struct rec *recs = xmalloc(N * sizeof(struct rec));
+    for (int i = 0; i < N; i++) {
+        recs[i] = (struct rec){ .key = vals[i] };
+    }
+    static const char *layouts[][4] = {
+        { "set (inline)", "get (inline)", "delete (inline)",
+          "emplace (inline)" },
+        { "set (split)", "get (split)", "delete (split)", "emplace (split)" },
+        { "set (indir)", "get (indir)", "delete (indir)", "emplace (indir)" },
+    };
+    for (int layout = 0; layout < 3; layout++) {
+        map = hashmap_new_with_options(&(struct hashmap_options){
+                .layout = layout,
+            }, sizeof(struct rec), 0, seed, seed, hash_rec, compare_recs,
+            NULL, NULL);
+        bench(layouts[layout][0], N, {
+            struct rec *v = hashmap_set(map, &recs[i]);
+            assert(!v);
+        })
+        shuffle(recs, N, sizeof(struct rec));
+        bench(layouts[layout][1], N, {
+            struct rec *v = hashmap_get(map, &recs[i]);
+            assert(v && v->key == recs[i].key);
+        })
+        shuffle(recs, N, sizeof(struct rec));
+        bench(layouts[layout][2], N, {
+            struct rec *v = hashmap_delete(map, &recs[i]);
+            assert(v && v->key == recs[i].key);
+        })
+        hashmap_free(map);
+        map = hashmap_new_with_options(&(struct hashmap_options){
+                .layout = layout,
+            }, sizeof(struct rec), N, seed, seed, hash_rec, compare_recs,
+            NULL, NULL);
+        bench(layouts[layout][3], N, {
+            bool existed;
+            struct rec *v = hashmap_emplace(map, &recs[i], &existed);
+            assert(v && !existed);
+            v->val = i;
+        })
+        hashmap_free(map);
+    }
+    xfree(recs);
+
+    // Compares per lookup on a table of 2^40 buckets, emulated by clearing
+    // the bits of the hashes that only such a table would use for the home
+    // bucket. The buckets keep about 8 bits that tell apart the items in a
+    // cluster, or 24 bits with HASHMAP_WIDE_BUCKETS.
+    scaled_bits = 1;
+    while (((size_t)1 << scaled_bits) < (size_t)N*4) {
+        scaled_bits++;
+    }
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int_scaled,
+                      compare_ints_counted, NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &vals[i]));
+    }
+    compare_calls = 0;
+    bench("get (2^40)", N, {
+        int *v = hashmap_get(map, &vals[i]);
+        assert(v && *v == vals[i]);
+    })
+    printf("               %.6f compares per hit\n", (double)compare_calls/N);
+    compare_calls = 0;
+    bench("get (2^40,miss)", N, {
+        int key = N+vals[i];
+        assert(!hashmap_get(map, &key));
+    })
+    printf("               %.6f compares per miss\n", (double)compare_calls/N);
+    hashmap_free(map);
+
+    // hashmap_stats walks the whole table
+    map = hashmap_new(sizeof(int), 0, seed, seed, hash_int,
+                      compare_ints_udata, NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &vals[i]));
+    }
+    for (int i = 0; i < N; i++) {
+        assert(hashmap_get(map, &vals[i]));
+    }
+    struct hashmap_stats stats;
+    bench("stats", 10, {
+        hashmap_stats(map, &stats);
+    })
+    printf("               %.3f avg dib, %zu max dib, %zu grows, "
+           "%.3f ms resizing\n", stats.avg_dib, stats.max_dib, stats.grows,
+           stats.resize_ns/1e6);
+#ifdef HASHMAP_STATS
+    printf("               %.3f probes per set, %.3f per get, "
+           "%.3f compares per op\n", (double)stats.set_probes/stats.sets,
+           (double)stats.get_probes/stats.gets,
+           (double)stats.compares/(stats.sets+stats.gets));
+#endif
+    hashmap_free(map);
+
+    // Keys that collide for a known seed, which cost a probe of the whole
+    // cluster per insert until max_probe makes the map reseed. The monitor
+    // costs nothing for keys that don't collide.
+    int nflood = N < 20000 ? N : 20000;
+    uint64_t *flood = xmalloc(nflood*sizeof(uint64_t));
+    for (int i = 0; i < nflood; i++) {
+        flood[i] = (uint64_t)i << 48;
+    }
+    for (int probe = 0; probe < 2; probe++) {
+        struct hashmap_options opts = { .max_probe = probe ? 32 : 0 };
+        map = hashmap_new_with_options(&opts, sizeof(uint64_t), 0, 0, 0,
+                                       hash_weak, compare_u64, NULL, NULL);
+        bench(probe ? "set (reseed)" : "set (flood)", nflood, {
+            assert(!hashmap_set(map, &flood[i]));
+        })
+        bench(probe ? "get (reseed)" : "get (flood)", nflood, {
+            assert(hashmap_get(map, &flood[i]));
+        })
+        hashmap_free(map);
+    }
+    xfree(flood);
+    map = hashmap_new_with_options(&(struct hashmap_options){
+        .max_probe = 32,
+    }, sizeof(int), 0, seed, seed, hash_int, compare_ints_udata, NULL, NULL);
+    bench("set (max_probe)", N, {
+        assert(!hashmap_set(map, &vals[i]));
+    })
+    hashmap_free(map);
+
+    // a set of the ints, whose keys are compared by compare_ints_udata or
+    // inline
+    for (int keycmp = 0; keycmp < 2; keycmp++) {
+        map = hashmap_kv_new(sizeof(int), 0, 0, seed, seed, hash_int,
+                             keycmp ? NULL : compare_ints_udata, NULL);
+        shuffle(vals, N, sizeof(int));
+        bench(keycmp ? "kv set (memcmp)" : "kv set (compare)", N, {
+            assert(hashmap_kv_set(map, &vals[i], NULL, NULL));
+        })
+        shuffle(vals, N, sizeof(int));
+        bench(keycmp ? "kv get (memcmp)" : "kv get (compare)", N, {
+            assert(hashmap_kv_get(map, &vals[i]));
+        })
+        hashmap_free(map);
+    }
+
+    // Maps of a few items that are made and freed over and over, with and
+    // without the table inside the allocation of the map.
+    int ntiny = N/8;
+    for (int small = 0; small < 2; small++) {
+        struct hashmap_options opts = {
+            .malloc = xmalloc, .free = xfree, .small = small ? 6 : 0,
+        };
+        struct hashmap_stats stats;
+        uintptr_t allocs = 0;
+        bench(small ? "tiny maps (small)" : "tiny maps", ntiny, {
+            uintptr_t before = total_allocs;
+            map = hashmap_new_with_options(&opts, sizeof(int), 0, seed, seed,
+                                           hash_int, compare_ints_udata,
+                                           NULL, NULL);
+            for (int j = 0; j < 5; j++) {
+                assert(!hashmap_set(map, &vals[(i+j)%N]));
+            }
+            for (int j = 0; j < 5; j++) {
+                assert(hashmap_get(map, &vals[(i+j)%N]));
+            }
+            hashmap_stats(map, &stats);
+            allocs = total_allocs-before;
+            hashmap_free(map);
+        })
+        printf("               %zu bytes in %zu allocations per map\n",
+               stats.memory, (size_t)allocs);
+    }
+
+    // the hash helpers on keys of 8, 16 and 64 bytes
+    volatile uint64_t hsink = 0;
+    uint64_t hkey[8] = { 0 };
+    for (int l = 0; l < 3; l++) {
+        size_t len = l == 0 ? 8 : l == 1 ? 16 : 64;
+        char name[32];
+        snprintf(name, sizeof(name), "sip (%zu)", len);
+        bench(name, N, {
+            hkey[0] = i;
+            hsink += hashmap_sip(hkey, len, seed, seed);
+            bytes += len;
+        })
+        snprintf(name, sizeof(name), "murmur (%zu)", len);
+        bench(name, N, {
+            hkey[0] = i;
+            hsink += hashmap_murmur(hkey, len, seed, seed);
+            bytes += len;
+        })
+        snprintf(name, sizeof(name), "xxhash3 (%zu)", len);
+        bench(name, N, {
+            hkey[0] = i;
+            hsink += hashmap_xxhash3(hkey, len, seed, seed);
+            bytes += len;
+        })
+    }
+    bench("mix64", N, {
+        hsink += hashmap_mix64(i, seed, seed);
+        bytes += 8;
+    })
+
+#ifndef HASHMAP_NO_THREADS
+    // one shard is the same as a single map behind a global lock
+    for (int nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        bench_sharded("(1)", 1, HASHMAP_LOCK_RWLOCK, nthreads, vals, N);
+        bench_sharded("(rw)", 64, HASHMAP_LOCK_RWLOCK, nthreads, vals, N);
+        bench_sharded("(spin)", 64, HASHMAP_LOCK_SPINLOCK, nthreads, vals, N);
+    }
+    for (int nreaders = 1; nreaders <= 8; nreaders *= 2) {
+        bench_concurrent(nreaders, false, vals, N);
+        bench_concurrent(nreaders, true, vals, N);
+    }
+    for (int nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        bench_build(nthreads, vals, N);
+    }
+    map = hashmap_new(sizeof(int), 0, 0, 0, hash_int, compare_ints_udata,
+                      NULL, NULL);
+    assert(hashmap_build(map, vals, N));
+    for (int nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        bench_scan(nthreads, map, N);
+    }
+    hashmap_free(map);
+#endif
+
     xfree(vals);
 
     if (total_allocs != 0) {
@@ -1014,10 +7712,452 @@ static void benchmarks() {
     }
 }
 
+//-----------------------------------------------------------------------------
+// Benchmark suite
+//
+// $ cc -DHASHMAP_TEST -O3 hashmap.c -lpthread && BENCH=suite ./a.out > out.csv
+//
+// Runs every workload on int and string keys, for elements of 8 to 512 bytes
+// and tables from 1K items, which fit in L1, up to N items, which defaults to
+// 4M, and prints a CSV row per run. Latencies are percentiles of single
+// operations, which include reading the clock, as the clock row shows. Runs
+// whose table would take more than SUITE_MEM bytes, which defaults to 1 GB,
+// are skipped, so going past the size of RAM takes raising both. Every run
+// does at least OPS operations, which defaults to 1M, and the threaded runs
+// go up to THREADS threads, which defaults to 8.
+//-----------------------------------------------------------------------------
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#define SUITE_ELSIZE_MAX 512
+#define SUITE_WRITE ((size_t)1 << (sizeof(size_t)*8-1)) // op that sets
+
+enum suite_op { SUITE_SET, SUITE_GET, SUITE_DELETE };
+
+struct suite {
+    bool strs;      // string keys rather than ints
+    size_t elsize;
+    size_t n;       // items in the table
+    size_t ops;     // operations in a run
+    uint64_t *keys; // 2n keys, the first n of which are in the table
+    char *pool;     // the strings of string keys
+    double *zipf;   // cumulative distribution of key ranks
+    size_t *idx;    // the keys of the operations of a run
+    uint64_t *lat;  // the latency of every operation of a run
+    uint64_t rng;
+};
+
+static uint64_t suite_rand(struct suite *s) {
+    return hashmap_mix64(s->rng++, 0, 0);
+}
+
+static uint64_t suite_hash_int(const void *item, uint64_t seed0,
+                               uint64_t seed1)
+{
+    uint64_t key;
+    memcpy(&key, item, sizeof(uint64_t));
+    return hashmap_mix64(key, seed0, seed1);
+}
+
+static uint64_t suite_hash_str(const void *item, uint64_t seed0,
+                               uint64_t seed1)
+{
+    const char *str;
+    memcpy(&str, item, sizeof(char*));
+    return hashmap_xxhash3(str, strlen(str), seed0, seed1);
+}
+
+static int suite_compare_str(const void *a, const void *b, void *udata) {
+    const char *x, *y;
+    memcpy(&x, a, sizeof(char*));
+    memcpy(&y, b, sizeof(char*));
+    return strcmp(x, y);
+}
+
+// Makes a map for the keys of the suite, which allocates with xmalloc unless
+// opts tell otherwise.
+static struct hashmap *suite_map(struct suite *s,
+                                 const struct hashmap_options *opts)
+{
+    struct hashmap_options xopts = { .malloc = xmalloc, .free = xfree };
+    opts = opts ? opts : &xopts;
+    struct hashmap *map = hashmap_new_with_options(opts, s->elsize, 0, 0, 0,
+        s->strs ? suite_hash_str : suite_hash_int,
+        s->strs ? suite_compare_str : compare_u64, NULL, NULL);
+    assert(map);
+    return map;
+}
+
+// Puts key i into the first bytes of item.
+static void suite_item(struct suite *s, size_t i, char *item) {
+    memcpy(item, &s->keys[i], sizeof(uint64_t));
+}
+
+static long suite_rss_kb(void) {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+    return ru.ru_maxrss/1024;
+#else
+    return ru.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+static void suite_header(void) {
+    printf("bench,keys,elsize,n,threads,ops,ns_op,mops,p50_ns,p99_ns,"
+           "p999_ns,max_ns,mem_bytes,peak_bytes,rss_kb\n");
+}
+
+// Prints the row of a run of nops operations that took secs, with the
+// latencies in lat.
+static void suite_row(const char *bench, struct suite *s, int threads,
+                      size_t nops, double secs, uint64_t *lat, size_t mem,
+                      size_t peak)
+{
+    qsort(lat, nops, sizeof(uint64_t), compare_uint64s);
+    printf("%s,%s,%zu,%zu,%d,%zu,%.1f,%.3f,%llu,%llu,%llu,%llu,%zu,%zu,%ld\n",
+           bench, s->strs ? "str" : "int", s->elsize, s->n, threads, nops,
+           secs*1e9/nops, nops/secs/1e6,
+           (unsigned long long)lat[nops/2],
+           (unsigned long long)lat[nops-1-nops/100],
+           (unsigned long long)lat[nops-1-nops/1000],
+           (unsigned long long)lat[nops-1], mem, peak, suite_rss_kb());
+    fflush(stdout);
+}
+
+// Fills in the keys of a run: uniform hits, uniform misses, hits with a
+// Zipfian distribution, or hits of which a share are sets.
+static void suite_fill(struct suite *s, const char *dist, int write_pct) {
+    for (size_t i = 0; i < s->ops; i++) {
+        uint64_t r = suite_rand(s);
+        size_t k;
+        if (strcmp(dist, "miss") == 0) {
+            k = s->n+r%s->n;
+        } else if (strcmp(dist, "zipf") == 0) {
+            double u = (double)(r >> 11)/(double)((uint64_t)1 << 53);
+            size_t lo = 0, hi = s->n-1;
+            while (lo < hi) {
+                size_t mid = (lo+hi)/2;
+                if (s->zipf[mid] > u) {
+                    hi = mid;
+                } else {
+                    lo = mid+1;
+                }
+            }
+            k = lo;
+        } else {
+            k = r%s->n;
+        }
+        if (write_pct && (int)(suite_rand(s)%100) < write_pct) {
+            k |= SUITE_WRITE;
+        }
+        s->idx[i] = k;
+    }
+}
+
+// Runs nops operations with the keys in idx and times every one of them into
+// lat. Sets of a new key return NULL, all others find keys that are in the
+// first n.
+static void suite_run(struct suite *s, struct hashmap *map, enum suite_op op,
+                      const size_t *idx, size_t nops, uint64_t *lat)
+{
+    char item[SUITE_ELSIZE_MAX] = { 0 };
+    for (size_t i = 0; i < nops; i++) {
+        size_t k = idx[i] & ~SUITE_WRITE;
+        suite_item(s, k, item);
+        void *v;
+        uint64_t start = clock_ns();
+        if (op == SUITE_DELETE) {
+            v = hashmap_delete(map, item);
+        } else if (op == SUITE_SET || (idx[i] & SUITE_WRITE)) {
+            v = hashmap_set(map, item);
+        } else {
+            v = hashmap_get(map, item);
+        }
+        lat[i] = clock_ns()-start;
+        assert((v != NULL) == (op != SUITE_SET && k < s->n));
+    }
+}
+
+// Inserts or deletes all n keys, over as many rounds as it takes to reach
+// the number of operations of a run. Only the inserts or deletes are timed.
+static void suite_rounds(struct suite *s, const char *bench,
+                         enum suite_op op)
+{
+    size_t rounds = (s->ops+s->n-1)/s->n;
+    size_t *seq = s->idx;
+    for (size_t i = 0; i < s->n; i++) {
+        seq[i] = i;
+    }
+    shuffle(seq, s->n, sizeof(size_t));
+    size_t base = total_mem, peak = 0, mem = 0;
+    double secs = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        struct hashmap *map = suite_map(s, NULL);
+        if (op == SUITE_DELETE) {
+            suite_run(s, map, SUITE_SET, seq, s->n, s->lat);
+        }
+        peak_mem = total_mem;
+        uint64_t start = clock_ns();
+        suite_run(s, map, op, seq, s->n, s->lat+r*s->n);
+        secs += (clock_ns()-start)/1e9;
+        struct hashmap_stats stats;
+        hashmap_stats(map, &stats);
+        mem = stats.memory;
+        peak = peak_mem-base > peak ? peak_mem-base : peak;
+        hashmap_free(map);
+    }
+    suite_row(bench, s, 1, rounds*s->n, secs, s->lat, mem, peak);
+}
+
+// Runs the operations of a distribution on a table of n keys.
+static void suite_lookups(struct suite *s, struct hashmap *map,
+                          const char *bench, const char *dist, int write_pct)
+{
+    suite_fill(s, dist, write_pct);
+    size_t base = total_mem;
+    peak_mem = total_mem;
+    uint64_t start = clock_ns();
+    suite_run(s, map, SUITE_GET, s->idx, s->ops, s->lat);
+    double secs = (clock_ns()-start)/1e9;
+    struct hashmap_stats stats;
+    hashmap_stats(map, &stats);
+    suite_row(bench, s, 1, s->ops, secs, s->lat, stats.memory,
+              peak_mem-base);
+}
+
+#ifndef HASHMAP_NO_THREADS
+
+struct suite_thread {
+    pthread_t thread;
+    struct suite *s;
+    struct hashmap *map;
+    struct hashmap_sharded *sharded;
+    const size_t *idx;
+    size_t nops;
+    uint64_t *lat;
+    volatile bool *done;
+};
+
+// Gets keys with hashmap_get_concurrent, or runs the operations on a sharded
+// map.
+static void *suite_reader(void *arg) {
+    struct suite_thread *t = arg;
+    char item[SUITE_ELSIZE_MAX] = { 0 };
+    char out[SUITE_ELSIZE_MAX];
+    for (size_t i = 0; i < t->nops; i++) {
+        size_t k = t->idx[i] & ~SUITE_WRITE;
+        suite_item(t->s, k, item);
+        bool found;
+        uint64_t start = clock_ns();
+        if (!t->sharded) {
+            found = hashmap_get_concurrent(t->map, item, out);
+        } else if (t->idx[i] & SUITE_WRITE) {
+            found = hashmap_sharded_set(t->sharded, item, NULL, NULL);
+        } else {
+            found = hashmap_sharded_get(t->sharded, item, out);
+        }
+        t->lat[i] = clock_ns()-start;
+        assert(found);
+    }
+    return NULL;
+}
+
+// Keeps replacing items of a concurrent map until the readers are done.
+static void *suite_writer(void *arg) {
+    struct suite_thread *t = arg;
+    char item[SUITE_ELSIZE_MAX] = { 0 };
+    for (size_t i = 0; !*t->done; i = (i+1)%t->s->n) {
+        suite_item(t->s, i, item);
+        assert(hashmap_set(t->map, item));
+    }
+    return NULL;
+}
+
+// Splits the operations of a run over nthreads readers of a concurrent map
+// that a writer keeps updating, or over nthreads users of a sharded map that
+// set 10% of the time.
+static void suite_threads(struct suite *s, bool sharded, int nthreads) {
+    struct hashmap *map = NULL;
+    struct hashmap_sharded *smap = NULL;
+    char item[SUITE_ELSIZE_MAX] = { 0 };
+    if (sharded) {
+        smap = hashmap_sharded_new(16, HASHMAP_LOCK_RWLOCK,
+            &(struct hashmap_options){ .malloc = malloc, .free = free },
+            s->elsize, 0, 0, 0, s->strs ? suite_hash_str : suite_hash_int,
+            s->strs ? suite_compare_str : compare_u64, NULL, NULL);
+        assert(smap);
+    } else {
+        map = suite_map(s, &(struct hashmap_options){
+            .malloc = malloc, .free = free, .concurrent = true,
+        });
+    }
+    for (size_t i = 0; i < s->n; i++) {
+        suite_item(s, i, item);
+        if (sharded) {
+            assert(hashmap_sharded_set(smap, item, NULL, NULL));
+        } else {
+            assert(!hashmap_set(map, item));
+        }
+    }
+    suite_fill(s, "uniform", sharded ? 10 : 0);
+    struct suite_thread *threads = xmalloc(nthreads*sizeof(*threads));
+    volatile bool done = false;
+    struct suite_thread writer = { .s = s, .map = map, .done = &done };
+    if (!sharded) {
+        assert(!pthread_create(&writer.thread, NULL, suite_writer, &writer));
+    }
+    size_t per = s->ops/nthreads;
+    uint64_t start = clock_ns();
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = (struct suite_thread){
+            .s = s, .map = map, .sharded = smap, .idx = s->idx+i*per,
+            .nops = per, .lat = s->lat+i*per,
+        };
+        assert(!pthread_create(&threads[i].thread, NULL, suite_reader,
+                               &threads[i]));
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    double secs = (clock_ns()-start)/1e9;
+    done = true;
+    size_t mem = 0;
+    if (sharded) {
+        hashmap_sharded_free(smap);
+    } else {
+        pthread_join(writer.thread, NULL);
+        struct hashmap_stats stats;
+        hashmap_stats(map, &stats);
+        mem = stats.memory;
+        hashmap_free(map);
+    }
+    suite_row(sharded ? "sharded_90_10" : "concurrent_get", s, nthreads,
+              per*nthreads, secs, s->lat, mem, 0);
+    xfree(threads);
+}
+
+#endif
+
+// Runs all workloads on a table of n keys.
+static void suite_table(struct suite *s, int max_threads) {
+    suite_rounds(s, "insert", SUITE_SET);
+    struct hashmap *map = suite_map(s, NULL);
+    for (size_t i = 0; i < s->n; i++) {
+        s->idx[i] = i;
+    }
+    suite_run(s, map, SUITE_SET, s->idx, s->n, s->lat);
+    suite_lookups(s, map, "get_hit", "uniform", 0);
+    suite_lookups(s, map, "get_miss", "miss", 0);
+    suite_lookups(s, map, "get_zipf", "zipf", 0);
+    suite_lookups(s, map, "mixed_90_10", "uniform", 10);
+    suite_lookups(s, map, "mixed_50_50", "uniform", 50);
+    hashmap_free(map);
+    suite_rounds(s, "delete", SUITE_DELETE);
+#ifndef HASHMAP_NO_THREADS
+    if (s->elsize == sizeof(uint64_t)) {
+        for (int t = 1; t <= max_threads; t *= 2) {
+            suite_threads(s, false, t);
+            suite_threads(s, true, t);
+        }
+    }
+#else
+    (void)max_threads;
+#endif
+}
+
+static void suite(void) {
+    size_t N = getenv("N") ? strtoull(getenv("N"), NULL, 10) : 1 << 22;
+    size_t ops = getenv("OPS") ? strtoull(getenv("OPS"), NULL, 10) : 1 << 20;
+    size_t max_mem = getenv("SUITE_MEM") ?
+                     strtoull(getenv("SUITE_MEM"), NULL, 10) : 1 << 30;
+    int max_threads = getenv("THREADS") ? atoi(getenv("THREADS")) : 8;
+    int seed = getenv("SEED") ? atoi(getenv("SEED")) : time(NULL);
+    srand(seed);
+    suite_header();
+
+    // the cost of reading the clock, which every latency includes
+    struct suite s = { .n = 1, .ops = ops, .elsize = sizeof(uint64_t) };
+    s.lat = xmalloc(ops*sizeof(uint64_t));
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < ops; i++) {
+        uint64_t t = clock_ns();
+        s.lat[i] = clock_ns()-t;
+    }
+    suite_row("clock", &s, 1, ops, (clock_ns()-start)/1e9, s.lat, 0, 0);
+    xfree(s.lat);
+
+    size_t sizes[] = { 1 << 10, 1 << 13, 1 << 16, 1 << 19, N };
+    size_t elsizes[] = { 8, 32, 128, 512 };
+    for (size_t si = 0; si < sizeof(sizes)/sizeof(sizes[0]); si++) {
+        size_t n = sizes[si];
+        if (n > N || (si > 0 && n <= sizes[si-1])) {
+            continue;
+        }
+        for (int strs = 0; strs < 2; strs++) {
+            s = (struct suite){
+                .strs = strs, .n = n, .ops = ops > n ? ops : n,
+                .rng = (uint64_t)seed << 32,
+            };
+            s.keys = xmalloc(2*n*sizeof(uint64_t));
+            s.idx = xmalloc((s.ops+n)*sizeof(size_t));
+            s.lat = xmalloc((s.ops+n)*sizeof(uint64_t));
+            s.zipf = xmalloc(n*sizeof(double));
+            if (strs) {
+                s.pool = xmalloc(2*n*24);
+            }
+            for (size_t i = 0; i < 2*n; i++) {
+                if (strs) {
+                    char *str = s.pool+i*24;
+                    snprintf(str, 24, "key:%016llx",
+                             (unsigned long long)hashmap_mix64(i, 0, 0));
+                    s.keys[i] = 0;
+                    memcpy(&s.keys[i], &str, sizeof(char*));
+                } else {
+                    s.keys[i] = hashmap_mix64(i+((uint64_t)seed << 40), 0, 0);
+                }
+            }
+            // a rank is hit in proportion to 1/rank
+            double sum = 0;
+            for (size_t i = 0; i < n; i++) {
+                sum += 1.0/(i+1);
+                s.zipf[i] = sum;
+            }
+            for (size_t i = 0; i < n; i++) {
+                s.zipf[i] /= sum;
+            }
+            for (size_t ei = 0; ei < sizeof(elsizes)/sizeof(elsizes[0]);
+                 ei++)
+            {
+                s.elsize = elsizes[ei];
+                if (n*(s.elsize+sizeof(uint64_t))*3 > max_mem) {
+                    continue;
+                }
+                suite_table(&s, max_threads);
+            }
+            xfree(s.keys);
+            xfree(s.idx);
+            xfree(s.lat);
+            xfree(s.zipf);
+            if (strs) {
+                xfree(s.pool);
+            }
+        }
+    }
+}
+
 int main() {
     hashmap_set_allocator(xmalloc, xfree);
 
-    if (getenv("BENCH")) {
+    if (getenv("BENCH") && strcmp(getenv("BENCH"), "suite") == 0) {
+        suite();
+    } else if (getenv("BENCH")) {
         printf("Running hashmap.c benchmarks...\n");
         benchmarks();
     } else {
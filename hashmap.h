@@ -8,6 +8,14 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The sharded map, the lock-free concurrent readers and the parallel build
+// and scan use pthreads, so they are only built with HASHMAP_THREADS.
+#if !defined(HASHMAP_THREADS) && !defined(HASHMAP_NO_THREADS)
+#define HASHMAP_NO_THREADS
+#endif
 
 /// \author Joshua J Baker
 /// An open addressed hash map using robinhood hashing.
@@ -58,6 +66,219 @@ struct hashmap *hashmap_new_with_allocator(
                             void (*elfree)(void *item),
                             void *udata);
 
+/// Memory layout of the buckets in a hashmap.
+enum hashmap_layout {
+    /// Each item is stored directly after its bucket header (default).
+    HASHMAP_LAYOUT_INLINE = 0,
+    /// Bucket headers are stored in a dense array, separate from the items.
+    /// Probes only touch the items on a hash match, which is faster for
+    /// large items.
+    HASHMAP_LAYOUT_SPLIT,
+    /// Buckets only hold a header and the index of their item, which is 
+    /// stored in a separate slab. Moving a bucket never moves its item, and
+    /// items keep their address until they're deleted. Not available 
+    /// together with the incremental or concurrent options.
+    HASHMAP_LAYOUT_INDIRECT,
+};
+
+/// Probing strategy used by hashmap_get.
+enum hashmap_probe {
+    /// Compares one bucket at a time (default).
+    HASHMAP_PROBE_LINEAR = 0,
+    /// Keeps an additional control byte per bucket, holding 7 bits of the 
+    /// hash, and compares groups of 16 or 32 control bytes at once using
+    /// SSE2, AVX2 or NEON, as detected at runtime, or a portable fallback.
+    HASHMAP_PROBE_GROUP,
+};
+
+/// An allocator that receives a context, such as an arena or a pool.
+struct hashmap_allocator {
+    /// Allocates size bytes, or returns NULL.
+    void *(*malloc)(size_t size, void *udata);
+    /// Frees an allocation of size bytes. An arena may ignore this and 
+    /// release all of its memory at once instead, without hashmap_free.
+    void (*free)(void *ptr, size_t size, void *udata);
+    /// Optionally resizes an allocation of size bytes to new_size bytes, or
+    /// returns NULL and leaves it as is. Bucket tables are then resized in
+    /// place rather than copied into a new allocation.
+    void *(*realloc)(void *ptr, size_t size, size_t new_size, void *udata);
+    /// The context that is passed to malloc, realloc and free.
+    void *udata;
+};
+
+/// Optional settings for hashmap_new_with_options.
+/// \details A zero-initialized struct selects the defaults.
+struct hashmap_options {
+    /// A pointer to the allocation function. Defaults to malloc.
+    void *(*malloc)(size_t);
+    /// A pointer to the reallocation function. Defaults to realloc when
+    /// malloc is the default too. Without one, resizing copies the items
+    /// into a new bucket table rather than resizing the table in place.
+    void *(*realloc)(void *, size_t);
+    /// A pointer to the free function. Defaults to free.
+    void (*free)(void*);
+    /// The bucket layout.
+    enum hashmap_layout layout;
+    /// The probing strategy.
+    enum hashmap_probe probe;
+    /// Resize incrementally. Rather than moving all items into a new table
+    /// at once, the old table is kept alongside the new one and a bounded 
+    /// number of its buckets are moved by each hashmap_set and hashmap_delete,
+    /// which avoids latency spikes on large maps. Lookups consult both tables
+    /// until the old one is drained.
+    bool incremental;
+    /// Allow lock-free readers. One thread may modify the map while any 
+    /// number of other threads use hashmap_get_concurrent. Only available
+    /// when built with HASHMAP_THREADS, and not together with incremental.
+    bool concurrent;
+    /// An allocator with a context, which is used instead of malloc and 
+    /// free when provided. It's copied into the map.
+    const struct hashmap_allocator *allocator;
+    /// The alignment of the bucket tables, which must be a power of two, or
+    /// zero for the alignment of the allocator.
+    size_t align;
+    /// Advise the system to back bucket tables of 2 MB or more with huge 
+    /// pages, which also aligns them to 2 MB. This only has an effect on 
+    /// Linux.
+    bool hugepages;
+    /// Keep the bucket tables that are released by resizing or clearing the
+    /// map, one of each size, and reuse them for later tables of the same 
+    /// size. They are freed with the map.
+    bool recycle;
+    /// Keep a map of up to this many items in a table inside the allocation
+    /// of the map itself, so that a tiny map costs a single allocation. With
+    /// so few buckets, a lookup is a short scan of adjacent bucket headers. 
+    /// The map moves to a table of its own when it grows past this, and back
+    /// when it shrinks to it. The default capacity becomes that of the small
+    /// table. Zero for none. Not available together with the concurrent, 
+    /// incremental, align and hugepages options or HASHMAP_PROBE_GROUP.
+    size_t small;
+    /// The load factor at which the table grows, between 0 and 1. Zero 
+    /// selects 0.75. A higher load saves memory and suits 
+    /// HASHMAP_PROBE_GROUP, a lower load keeps probes short.
+    double max_load;
+    /// The load factor at which the table shrinks, below max_load. Zero
+    /// selects 0.10.
+    double min_load;
+    /// Never shrink the table when items are deleted, which suits maps that
+    /// fill up again after emptying out.
+    bool no_shrink;
+    /// The factor by which the table grows, a power of two. Zero selects 2.
+    size_t growth;
+    /// The least margin between max_load and the load of the table right 
+    /// after shrinking, so that a shrink isn't soon followed by a grow. A 
+    /// shrink halves the table for as long as the margin holds. Zero selects
+    /// max_load minus twice min_load, which halves the table once.
+    double hysteresis;
+    /// Bound the map to this many items, for use as a cache, or zero for no 
+    /// bound. The table is sized for max_count items up front and never 
+    /// grows or shrinks by itself. Inserting a new item into a full map 
+    /// evicts an item with the CLOCK algorithm: every bucket has a reference
+    /// bit that is set when hashmap_get finds its item or hashmap_set 
+    /// replaces it, and a hand sweeping over the buckets evicts the first 
+    /// item whose bit is clear, clearing the bits it passes. New items start
+    /// out unreferenced, so that a burst of items that are used only once 
+    /// doesn't flush the rest. An evicted item is passed to the 
+    /// element-freeing function given in hashmap_new, if present. Not 
+    /// available together with the incremental or concurrent options. A 
+    /// sharded map divides the bound among its shards.
+    size_t max_count;
+    /// Keep a deadline with every item, which hashmap_set_ttl sets. An item
+    /// whose deadline has passed is removed by the first hashmap_get or
+    /// hashmap_set that finds it, or by hashmap_expire_step, and passed to 
+    /// the element-freeing function given in hashmap_new, if present. Until
+    /// then it's still counted, iterated and scanned. The deadline takes 8
+    /// bytes per bucket. Not available together with the concurrent option
+    /// or for sharded maps.
+    bool expiry;
+    /// The clock that deadlines are measured by, which is passed the udata
+    /// of the map. Defaults to a monotonic clock in milliseconds.
+    uint64_t (*clock)(void *udata);
+    /// Defend against hash flooding: when an insert probes more than this
+    /// many buckets, the map picks new seeds and rehashes its items in
+    /// place, which breaks up a cluster of keys that were crafted to
+    /// collide. Zero never reseeds. A few dozen is well above the probes of
+    /// a hash that spreads the keys evenly. When the longest probe after a
+    /// reseed is still above the limit, the limit doubles, so that a hash
+    /// which ignores its seeds can't make every insert rehash the map. The
+    /// new seeds mix the previous ones with the address of the map, the
+    /// number of reseeds and the time, which only has whole seconds without
+    /// a monotonic clock. Keys passed to the _with_hash functions must then
+    /// be hashed with hashmap_hash, which follows the current seeds of the
+    /// map, and an incremental resize finishes before the map reseeds. Not
+    /// available together with the concurrent option.
+    size_t max_probe;
+    /// The hash function that the map switches to at its first reseed, such
+    /// as one that is based on hashmap_sip, or NULL to keep the hash given
+    /// in hashmap_new. This keeps a fast hash in the common case and bounds
+    /// the probes of a map whose hash is flooded. A snapshot of the map must
+    /// then be opened with this hash.
+    uint64_t (*reseed_hash)(const void *item, uint64_t seed0, uint64_t seed1);
+};
+
+/// Creates a hashmap with additional options.
+/// \param opts The options for the hashmap, or NULL for the defaults.
+/// \param elsize The size of each element in the tree.
+/// \param cap The default lower capacity of the hashmap. Setting this to zero will default to 16.
+/// \param seed0 Optional seed value passed on to the hash function.
+/// \param seed1 Optional seed value passed on to the hash function.
+/// \param hash The hash function used for the hashmap.
+/// \param compare The function that compares items in the tree. See the qsort stdlib function for an example.
+/// \param elfree The function that frees a specific item. This should be NULL unless referenced data is stored in the hash.
+/// \param udata A pointer to user-defined data that can be passed to the element comparison and element free functions.
+/// \return A pointer to a new hashmap.
+struct hashmap *hashmap_new_with_options(
+                            const struct hashmap_options *opts,
+                            size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
+
+/// Creates a key/value map, whose lookups take only the bytes of a key.
+/// \details Each item is a key of keysize bytes followed by a value of 
+/// valsize bytes, which starts at the next offset that is aligned like a 
+/// type of its size, up to 8 bytes. Besides the hashmap_kv functions, 
+/// hashmap_get and hashmap_delete take a bare key too, while the functions 
+/// that insert take complete items. A valsize of zero makes a set, whose 
+/// buckets hold just a key.
+/// \param keysize The size of each key, which may not be zero.
+/// \param valsize The size of each value.
+/// \param cap The default lower capacity of the hashmap. Setting this to zero will default to 16.
+/// \param seed0 Optional seed value passed on to the hash function.
+/// \param seed1 Optional seed value passed on to the hash function.
+/// \param hash The hash function, which must only read the first keysize 
+/// bytes. NULL hashes those with hashmap_xxhash3.
+/// \param compare The function that compares a key with an item, which must
+/// only read the first keysize bytes of each. NULL compares the bytes of the
+/// keys inline, without a call.
+/// \param udata A pointer to user-defined data that is passed to compare.
+/// \return A pointer to a new hashmap, or NULL when out of memory or keysize
+/// is zero.
+struct hashmap *hashmap_kv_new(size_t keysize, size_t valsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *key,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata);
+
+/// Creates a key/value map with additional options, like hashmap_kv_new.
+/// \return A pointer to a new hashmap, or NULL when out of memory, keysize
+/// is zero or the options are invalid.
+struct hashmap *hashmap_kv_new_with_options(
+                            const struct hashmap_options *opts,
+                            size_t keysize, size_t valsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *key,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata);
+
 /// Frees the hash map.
 /// \param map The hash map to be freed.
 void hashmap_free(struct hashmap *map);
@@ -72,6 +293,22 @@ void hashmap_free(struct hashmap *map);
 /// that this operation does not perform any allocations.
 void hashmap_clear(struct hashmap *map, bool update_cap);
 
+/// Grows the table so that it holds n items without resizing again.
+/// \details Inserting until the map holds n items then never resizes. A table
+/// that is large enough already stays as it is.
+/// \param map A pointer to the map.
+/// \param n The number of items the map should hold.
+/// \return True on success, or false when the system is out of memory,
+/// which hashmap_oom also reports. The map is unchanged then.
+bool hashmap_reserve(struct hashmap *map, size_t n);
+
+/// Shrinks the table to the smallest one that holds the items of the map,
+/// though not below the capacity given when the map was created.
+/// \param map A pointer to the map.
+/// \return True on success, or false when the system is out of memory,
+/// which hashmap_oom also reports. The map keeps its table then.
+bool hashmap_shrink_to_fit(struct hashmap *map);
+
 /// Getter for the number of items in the hash map.
 /// \param map A pointer to the to get the count from.
 /// \return The number of elements in the map.
@@ -82,6 +319,62 @@ size_t hashmap_count(struct hashmap *map);
 /// \return True if the system is out of memory, false if not.
 bool hashmap_oom(struct hashmap *map);
 
+/// The number of distances from the home bucket that the histogram of
+/// hashmap_stats tells apart.
+#define HASHMAP_STATS_DIBS 32
+
+/// Statistics of a hash map, which hashmap_stats fills in.
+struct hashmap_stats {
+    /// The number of items.
+    size_t count;
+    /// The number of buckets, including those of a table that an incremental
+    /// resize is still draining.
+    size_t nbuckets;
+    /// The number of items per bucket.
+    double load;
+    /// The bytes that the map allocated for itself, its tables, the slab of
+    /// HASHMAP_LAYOUT_INDIRECT and recycled tables.
+    size_t memory;
+    /// The number of times the table grew.
+    size_t grows;
+    /// The number of times the table shrank.
+    size_t shrinks;
+    /// The time spent resizing, in nanoseconds. An incremental resize only
+    /// counts the allocation of a table, as later operations move the items.
+    uint64_t resize_ns;
+    /// The number of times the map picked new seeds, see max_probe.
+    size_t reseeds;
+    /// The average distance of an item from its home bucket, or dib.
+    double avg_dib;
+    /// The longest distance of an item from its home bucket.
+    size_t max_dib;
+    /// The number of items at each distance from their home bucket. The
+    /// last entry also counts the items that are further away.
+    size_t dibs[HASHMAP_STATS_DIBS];
+    /// The number of gets, sets and deletes, including those of the bulk
+    /// functions, and excluding hashmap_get_concurrent. These counters and
+    /// the ones below are only kept when built with HASHMAP_STATS, which adds
+    /// a few instructions to every probe, and are zero otherwise.
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t deletes;
+    /// The number of buckets that each kind of operation visited, or groups
+    /// of control bytes for HASHMAP_PROBE_GROUP. Sets include the items that
+    /// they move for an incremental resize.
+    uint64_t get_probes;
+    uint64_t set_probes;
+    uint64_t delete_probes;
+    /// The number of calls to the compare function.
+    uint64_t compares;
+};
+
+/// Gets the statistics of the hash map.
+/// \details The distances are collected by visiting every bucket, which
+/// takes time in proportion to the size of the table.
+/// \param map A pointer to the hash map.
+/// \param stats The statistics to fill in.
+void hashmap_stats(struct hashmap *map, struct hashmap_stats *stats);
+
 /// Gets an item out of the map with the given key.
 /// \param map A pointer to he map to get an element out of.
 /// \param key The key of the item to be found.
@@ -89,6 +382,45 @@ bool hashmap_oom(struct hashmap *map);
 /// \pre Key may not be NULL.
 void *hashmap_get(struct hashmap *map, const void *key);
 
+#ifndef HASHMAP_NO_THREADS
+/// Gets a copy of an item out of a concurrent map, while another thread may
+/// be modifying it.
+/// \details Readers never take a lock. A read that overlaps with a write is
+/// retried, and a replaced bucket array is only freed once no reader can
+/// still see it. Items are compared on a private copy, but any data that the 
+/// items reference must outlive the readers.
+/// \param map A pointer to a map created with the concurrent option.
+/// \param key The key of the item to be found.
+/// \param item Storage of elsize bytes that receives a copy of the item. Its
+/// contents are undefined when the item is not found.
+/// \return True if the item was found.
+/// \pre Key and item may not be NULL.
+bool hashmap_get_concurrent(struct hashmap *map, const void *key, void *item);
+#endif
+
+/// Hashes a key the way the map does, with its current hash function and 
+/// seeds.
+/// \details A map with max_probe in hashmap_options changes them when it 
+/// reseeds, after which hashes that were taken before no longer find keys.
+/// \param map A pointer to the map.
+/// \param key The key to hash.
+/// \return The hash of the key, to be passed to the _with_hash functions.
+/// \pre Key may not be NULL.
+uint64_t hashmap_hash(struct hashmap *map, const void *key);
+
+/// Gets an item out of the map using a hash that the caller already
+/// computed.
+/// \details The hash must be the value that the hash function of the map 
+/// returns for the key, which allows for hashing a key once for several maps
+/// that share a hash function and seeds.
+/// \param map A pointer to the map to get an element out of.
+/// \param key The key of the item to be found.
+/// \param hash The hash of the key.
+/// \return The item if found, NULL if the item is not found.
+/// \pre Key may not be NULL.
+void *hashmap_get_with_hash(struct hashmap *map, const void *key, 
+                            uint64_t hash);
+
 /// Inserts or replaces an item in the hash map.
 /// \param map A pointer to the map to insert or replace an item in.
 /// \param item The item to be added to the list.
@@ -98,12 +430,230 @@ void *hashmap_get(struct hashmap *map, const void *key);
 /// it resizes the map to double its current size to make room for new entries.
 void *hashmap_set(struct hashmap *map, const void *item);
 
+/// Inserts or replaces an item in the hash map using a hash that the caller
+/// already computed.
+/// \param map A pointer to the map to insert or replace an item in.
+/// \param item The item to be added.
+/// \param hash The hash of the item, as returned by the hash function of the
+/// map.
+/// \return The item that is replaced, NULL if no item is replaced.
+/// \pre Item may not be NULL.
+void *hashmap_set_with_hash(struct hashmap *map, const void *item, 
+                            uint64_t hash);
+
+/// Inserts or replaces an item that expires after ttl.
+/// \param map A pointer to a map created with the expiry option.
+/// \param item The item to be added.
+/// \param ttl The time to live of the item in the units of the clock of the 
+/// map, or zero for an item that never expires, like one that is set by 
+/// hashmap_set.
+/// \return The item that is replaced, NULL if no item is replaced or the 
+/// replaced one had expired.
+/// \pre Item may not be NULL.
+void *hashmap_set_ttl(struct hashmap *map, const void *item, uint64_t ttl);
+
+/// Inserts or replaces an item in the hash map, copying a replaced item 
+/// directly into caller storage.
+/// \details Unlike hashmap_set, the result doesn't live in storage of the map
+/// that is reused by the next operation.
+/// \param map A pointer to the map to insert or replace an item in.
+/// \param item The item to be added.
+/// \param old Storage of elsize bytes that receives the replaced item.
+/// \return True if an item was replaced. False if the item was added or the
+/// system is out of memory, which hashmap_oom tells apart.
+/// \pre Item and old may not be NULL.
+bool hashmap_set_into(struct hashmap *map, const void *item, void *old);
+
+/// Finds an item, or inserts a new one, and returns it to be filled in place.
+/// \details A new item starts out as a copy of key, and the caller completes
+/// it through the returned pointer, which avoids the copies of hashmap_set
+/// for large items. The key fields of the item must not be changed, and the
+/// pointer is only valid until the map is modified again.
+/// \param map A pointer to the map.
+/// \param key The key of the item, laid out as a complete item.
+/// \param existed Set to true if the item was already in the map (optional).
+/// \return A pointer to the item in the map, or NULL if the system is out of
+/// memory.
+/// \pre Key may not be NULL. The map may not be concurrent.
+void *hashmap_emplace(struct hashmap *map, const void *key, bool *existed);
+
 /// Deletes an item from the hash map.
 /// \param map A pointer to the map to delete an item from.
 /// \param key The key of the item to be deleted.
 /// \return The deleted item, NULL if the item is not found.
 void *hashmap_delete(struct hashmap *map, void *key);
 
+/// Deletes an item from the hash map using a hash that the caller already
+/// computed.
+/// \param map A pointer to the map to delete an item from.
+/// \param key The key of the item to be deleted.
+/// \param hash The hash of the key, as returned by the hash function of the
+/// map.
+/// \return The deleted item, NULL if the item is not found.
+/// \pre Key may not be NULL.
+void *hashmap_delete_with_hash(struct hashmap *map, const void *key, 
+                               uint64_t hash);
+
+/// Deletes an item from the hash map, copying it directly into caller 
+/// storage.
+/// \param map A pointer to the map to delete an item from.
+/// \param key The key of the item to be deleted.
+/// \param old Storage of elsize bytes that receives the deleted item.
+/// \return True if the item was deleted, false if it was not found.
+/// \pre Key and old may not be NULL.
+bool hashmap_delete_into(struct hashmap *map, const void *key, void *old);
+
+/// Gets the value of a key out of a key/value map.
+/// \param map A pointer to a map made by hashmap_kv_new.
+/// \param key The keysize bytes of the key.
+/// \return A pointer to the value in the map, NULL if the key is not found.
+/// The pointer of a set is only good for telling it apart from NULL.
+/// \pre Key may not be NULL.
+void *hashmap_kv_get(struct hashmap *map, const void *key);
+
+/// Inserts a key into a key/value map, or replaces the value of a key.
+/// \details The key and value are copied straight into the bucket.
+/// \param map A pointer to a map made by hashmap_kv_new.
+/// \param key The keysize bytes of the key.
+/// \param value The valsize bytes of the value, which may be NULL for a set.
+/// \param existed Set to true if the key was already in the map (optional).
+/// \return A pointer to the value in the map, or NULL if the system is out 
+/// of memory.
+/// \pre Key may not be NULL. The map may not be concurrent.
+void *hashmap_kv_set(struct hashmap *map, const void *key, const void *value,
+                     bool *existed);
+
+/// Deletes a key from a key/value map.
+/// \param map A pointer to a map made by hashmap_kv_new.
+/// \param key The keysize bytes of the key.
+/// \param value Storage of valsize bytes that receives the deleted value 
+/// (optional).
+/// \return True if the key was deleted, false if it was not found.
+/// \pre Key may not be NULL.
+bool hashmap_kv_delete(struct hashmap *map, const void *key, void *value);
+
+/// Gets the value of an item of a key/value map, such as one that 
+/// hashmap_iter returns.
+/// \param map A pointer to a map made by hashmap_kv_new.
+/// \param item The item, whose key comes first.
+/// \return A pointer to the value of the item.
+void *hashmap_kv_value(struct hashmap *map, const void *item);
+
+/// Removes the expired items from a number of buckets of a map with expiry.
+/// \details Every call goes on where the previous one stopped and wraps 
+/// around at the end of the table, so that calling it regularly, such as 
+/// from an event loop, sweeps the whole map in small steps. It also moves 
+/// up to budget buckets of an incremental resize into the new table, and 
+/// shrinks the table when enough items are gone.
+/// \param map A pointer to the map.
+/// \param budget The number of buckets to look at.
+/// \return The number of items that were removed.
+size_t hashmap_expire_step(struct hashmap *map, size_t budget);
+
+/// Gets many items out of the map at once.
+/// \details All keys in a batch are hashed and their home buckets are
+/// prefetched before any of them is probed, which lets cache misses on large
+/// maps overlap.
+/// \param map A pointer to the map to get the elements out of.
+/// \param keys An array of n keys, each being elsize bytes.
+/// \param n The number of keys.
+/// \param items An array of n pointers that is populated with the found items,
+/// or NULL for the keys that are not found.
+void hashmap_get_many(struct hashmap *map, const void *keys, size_t n,
+                      void **items);
+
+/// Inserts or replaces many items in the hash map at once.
+/// \param map A pointer to the map to insert or replace the items in.
+/// \param items An array of n items, each being elsize bytes.
+/// \param n The number of items.
+/// \return The number of items that were stored. This is less than n when 
+/// the system is out of memory.
+/// \note Replaced items are passed to the element-freeing function given in
+/// hashmap_new, if present.
+size_t hashmap_set_many(struct hashmap *map, const void *items, size_t n);
+
+/// Deletes many items from the hash map at once.
+/// \param map A pointer to the map to delete the items from.
+/// \param keys An array of n keys, each being elsize bytes.
+/// \param n The number of keys.
+/// \return The number of items that were deleted.
+/// \note Deleted items are passed to the element-freeing function given in
+/// hashmap_new, if present.
+size_t hashmap_delete_many(struct hashmap *map, const void *keys, size_t n);
+
+/// Fills an empty map with many items at once.
+/// \details The items are sorted by their buckets and the table is written 
+/// front to back in one pass, rather than inserting the items in random 
+/// order. Of the items with equal keys the last one is kept, and the others
+/// are passed to the element-freeing function given in hashmap_new, if 
+/// present. A map that is not empty, that is bounded by max_count, or that
+/// has expiry gets the items from hashmap_set_many, which keeps the items it
+/// placed before running out of memory. So does a map with max_probe whose
+/// items would probe further than that, which makes hashmap_set_many reseed.
+/// The sort uses two temporary arrays that hold the hash of each item with
+/// either the item itself, up to 16 bytes, or its index.
+/// \param map A pointer to the map to fill.
+/// \param items An array of n items, each being elsize bytes.
+/// \param n The number of items.
+/// \return True on success, or false when the system is out of memory, 
+/// which hashmap_oom also reports. An empty map stays empty then, unless it
+/// got the items from hashmap_set_many. The build also fails, setting errno
+/// to EOVERFLOW, when a cluster of items probes further than a bucket can
+/// record, which hashmap_set would panic on. The map stays empty and no
+/// items are freed then.
+bool hashmap_build(struct hashmap *map, const void *items, size_t n);
+
+#ifndef HASHMAP_NO_THREADS
+/// Fills an empty map with many items at once, like hashmap_build, using up
+/// to nthreads threads to hash, sort and place the items.
+/// \param map A pointer to the map to fill.
+/// \param items An array of n items, each being elsize bytes.
+/// \param n The number of items.
+/// \param nthreads The number of threads, including the calling one.
+/// \return True on success, or false when the system is out of memory or
+/// errno is set to EOVERFLOW, as with hashmap_build.
+bool hashmap_build_parallel(struct hashmap *map, const void *items, size_t n,
+                            int nthreads);
+#endif
+
+/// Exports the items of the hash map as records that hashmap_import places
+/// without hashing them again.
+/// \details Every record is the hash of an item as its bucket keeps it, the
+/// low 48 bits or all 64 with HASHMAP_WIDE_BUCKETS, stored as a uint64_t and
+/// followed by the item, which is padded with zeros to a multiple of 8 bytes.
+/// Every call goes on where the previous one stopped, so that a large map is
+/// streamed in chunks of any size. The map may not be modified in the
+/// meantime. Records are in the byte order of the machine.
+/// \param map A pointer to the map to export.
+/// \param cursor A pointer to a size_t cursor that starts out at 0.
+/// \param buf The buffer that records are written to.
+/// \param size The size of buf, which must hold at least one record of 
+/// 8 + elsize bytes, rounded up to a multiple of 8.
+/// \return The number of bytes written, which is a multiple of the record 
+/// size, or zero when all items have been exported.
+size_t hashmap_export(struct hashmap *map, size_t *cursor, void *buf,
+                      size_t size);
+
+/// Inserts or replaces the items of records that hashmap_export wrote.
+/// \details The items are placed by the hashes in the records, which must
+/// come from a map with the same hash function, seeds and element size. The
+/// hash of the first record is checked, and a stream that fails the check
+/// is turned down without consuming anything. A map that reseeded, see 
+/// max_probe in hashmap_options, hashes the items instead. Only whole 
+/// records are consumed, so a stream that is read in pieces is imported by
+/// keeping the bytes that were not consumed in front of the next piece.
+/// \param map A pointer to the map to insert the items in.
+/// \param data The records, aligned to 8 bytes.
+/// \param size The size of data.
+/// \return The number of bytes consumed. Less than the whole records are 
+/// consumed when the system is out of memory, which hashmap_oom reports.
+/// Zero is returned, with errno set to EINVAL when data is not aligned or 
+/// to EILSEQ when the first record is from a map with another hash or 
+/// other seeds, such as one that reseeded.
+/// \note Replaced items are passed to the element-freeing function given in
+/// hashmap_new, if present.
+size_t hashmap_import(struct hashmap *map, const void *data, size_t size);
+
 /// Gets the item in the bucket at a certain position.
 /// \param map A pointer to the hashmap.
 /// \param position The position of the bucket.
@@ -127,10 +677,211 @@ bool hashmap_scan(struct hashmap *map,
 /// \return True if an item was retrieved, false if the end of the iteration has been reached.
 /// \note Note that if hashmap_delete() is called on the hashmap being iterated,
 /// the buckets are rearranged and the iterator must be reset to 0, otherwise
-/// unexpected results may be returned after deletion.
+/// unexpected results may be returned after deletion. Use hashmap_sweep() and
+/// hashmap_iter_delete() to delete items while iterating.
 /// \warning This function has not been tested for thread safety.
 bool hashmap_iter(struct hashmap *map, size_t *i, void **item);
 
+/// Iterator for a sweep that may delete the items it retrieves with
+/// hashmap_iter_delete.
+/// \details This works like hashmap_iter, but its cursor ranges over twice
+/// the buckets of each table. An item that wrapped around from the last
+/// buckets to the first ones is visited after the rest of the table, so the
+/// items that a delete shifts are always still ahead of the cursor. The
+/// cursor can't be mixed with the one of hashmap_iter.
+/// \param map A pointer to the hash map to be iterated.
+/// \param i A pointer to a size_t cursor that is 0 at the beginning.
+/// \param item Set to the retrieved item, which is not a copy.
+/// \return True if an item was retrieved, false at the end of the sweep.
+bool hashmap_sweep(struct hashmap *map, size_t *i, void **item);
+
+/// Deletes the item that hashmap_sweep last retrieved and moves the cursor
+/// back so that the sweep goes on with the item that took its place.
+/// \details Deleting any number of items this way during one iteration still
+/// visits every other item exactly once, so that a sweep over the map is a 
+/// single pass. The map is not shrunk while iterating, which may be done with 
+/// hashmap_shrink_to_fit afterwards. Any other change to the map during the 
+/// iteration requires the cursor to be reset to 0.
+/// \param map A pointer to the hash map being iterated.
+/// \param i A pointer to the cursor that was passed to hashmap_sweep.
+/// \return The deleted item, or NULL if there is no current item. The item
+/// is a copy that is valid until the next change to the map.
+/// \pre The last call with the cursor was a hashmap_sweep that returned true.
+void *hashmap_iter_delete(struct hashmap *map, size_t *i);
+
+/// Gets the number of bucket positions that hashmap_scan_range ranges over.
+/// \param map A pointer to the hash map.
+/// \return The number of positions, which includes the buckets of a table
+/// that an incremental resize is still draining.
+size_t hashmap_bucket_count(struct hashmap *map);
+
+/// Scanner for a range of bucket positions of the hash map.
+/// \details Ranges that together cover 0 up to hashmap_bucket_count visit 
+/// every item exactly once, provided that the map isn't modified in the 
+/// meantime. Disjoint ranges may be scanned by different threads at the same
+/// time, as long as no thread modifies the map.
+/// \param map A pointer to the map to be scanned.
+/// \param begin The first position of the range.
+/// \param end The position after the range. Positions at or past 
+/// hashmap_bucket_count are ignored.
+/// \param iter A pointer to the user-provided callback function to be called for each item.
+/// \param udata A pointer to user-provided data, which will be passed to the callback function.
+/// \return True if the iteration was completed normally, false if it was stopped early.
+bool hashmap_scan_range(struct hashmap *map, size_t begin, size_t end,
+                        bool (*iter)(const void *item, void *udata),
+                        void *udata);
+
+#ifndef HASHMAP_NO_THREADS
+/// Scans the hash map on up to nthreads threads.
+/// \details The buckets are split into chunks that the threads take in turn,
+/// and every item is visited exactly once by one of the threads. The map 
+/// must not be modified during the scan. A callback that returns false 
+/// stops its thread right away and the other threads after their current 
+/// chunk.
+/// \param map A pointer to the map to be scanned.
+/// \param nthreads The number of threads, including the calling one.
+/// \param iter A pointer to the user-provided callback function to be called
+/// for each item. It's called from several threads at once.
+/// \param udata An array of nthreads pointers to user-provided data. Calls 
+/// on the t-th thread are passed udata[t], which allows for per-thread
+/// results that are combined after the scan.
+/// \return True if the iteration was completed normally, false if it was stopped early.
+bool hashmap_scan_parallel(struct hashmap *map, int nthreads,
+                           bool (*iter)(const void *item, void *udata),
+                           void **udata);
+#endif
+
+/// Saves the hash map to a file that hashmap_open_mmap can map.
+/// \details The file is a small header, which holds the element size, the
+/// seeds and the options of the map, followed by the bucket table as it is in
+/// memory. It can only be opened on a machine with the same byte order, and
+/// by the same version of the file format. A pending incremental resize is 
+/// finished first. Only available on POSIX systems.
+/// \param map A pointer to the map to save.
+/// \param fd A file descriptor open for writing, which the file is written 
+/// to from its current offset.
+/// \return True on success, or false when writing failed, with errno set.
+/// A map that can't be saved, or a system without mmap, gives false with 
+/// errno set to ENOTSUP.
+/// \pre The map has no element-freeing function, no expiry and no 
+/// HASHMAP_LAYOUT_INDIRECT.
+bool hashmap_save(struct hashmap *map, int fd);
+
+/// Opens a hash map that hashmap_save wrote, by mapping the file into memory.
+/// \details Lookups are served right away, and the pages of the table are 
+/// read from the file as they're first touched. The seeds and options of the
+/// saved map are restored, but the functions are not, so the hash function
+/// must be the one the map was saved with. It's checked against the hashes of
+/// a few items. A key/value map made without hash or compare functions is 
+/// opened with NULL for those. The map has no element-freeing function. The
+/// file stays mapped until the table is replaced by a resize or the map is
+/// freed, and it may be removed but not changed in the meantime.
+/// \param path The path of the file.
+/// \param writable Map the file copy-on-write so that the map may be 
+/// modified, which never changes the file. Otherwise the map is read-only
+/// and must not be modified.
+/// \param hash The hash function the map was saved with.
+/// \param compare The function that compares items.
+/// \param udata A pointer to user-defined data that is passed to compare.
+/// \return The map, or NULL when the file can't be mapped or isn't a
+/// snapshot of a map with this hash function.
+struct hashmap *hashmap_open_mmap(const char *path, bool writable,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void *udata);
+
+#ifndef HASHMAP_NO_THREADS
+
+/// A thread-safe hash map that routes each key to one of many independently
+/// locked shards.
+struct hashmap_sharded;
+
+/// The lock that guards each shard of a sharded hash map.
+enum hashmap_lock {
+    /// A reader-writer lock, which allows concurrent gets (default).
+    HASHMAP_LOCK_RWLOCK = 0,
+    /// A spinlock, which is cheaper for short, write-heavy critical sections.
+    HASHMAP_LOCK_SPINLOCK,
+};
+
+/// Creates a new sharded hash map.
+/// \param nshards The number of shards, rounded up to a power of two.
+/// \param lock The lock to use for each shard.
+/// \param opts The options for each shard, or NULL for the defaults.
+/// \param elsize The size of each element in the tree.
+/// \param cap The default lower capacity of the whole map, which is divided among the shards.
+/// \param seed0 Optional seed value passed on to the hash function.
+/// \param seed1 Optional seed value passed on to the hash function.
+/// \param hash The hash function used for the hashmap. Its high bits select the shard.
+/// \param compare The function that compares items in the tree. See the qsort stdlib function for an example.
+/// \param elfree The function that frees a specific item. This should be NULL unless referenced data is stored in the hash.
+/// \param udata A pointer to user-defined data that can be passed to the element comparison and element free functions.
+/// \return A pointer to a new sharded hash map, or NULL when out of memory.
+struct hashmap_sharded *hashmap_sharded_new(
+                            size_t nshards, enum hashmap_lock lock,
+                            const struct hashmap_options *opts,
+                            size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
+
+/// Frees the sharded hash map.
+/// \param map The sharded hash map to be freed.
+void hashmap_sharded_free(struct hashmap_sharded *map);
+
+/// Gets a copy of an item out of the sharded map.
+/// \param map A pointer to the sharded map.
+/// \param key The key of the item to be found.
+/// \param item Storage of elsize bytes that receives a copy of the item (optional).
+/// \return True if the item was found.
+bool hashmap_sharded_get(struct hashmap_sharded *map, const void *key, 
+                         void *item);
+
+/// Inserts or replaces an item in the sharded map.
+/// \param map A pointer to the sharded map.
+/// \param item The item to be added.
+/// \param old Storage of elsize bytes that receives a copy of the replaced 
+/// item (optional). When NULL, a replaced item is passed to the element-freeing
+/// function instead, if present.
+/// \param replaced Set to true if an item was replaced (optional).
+/// \return True if the item was stored, false if the system is out of memory.
+bool hashmap_sharded_set(struct hashmap_sharded *map, const void *item,
+                         void *old, bool *replaced);
+
+/// Deletes an item from the sharded map.
+/// \param map A pointer to the sharded map.
+/// \param key The key of the item to be deleted.
+/// \param old Storage of elsize bytes that receives a copy of the deleted 
+/// item (optional). When NULL, the deleted item is passed to the 
+/// element-freeing function instead, if present.
+/// \return True if the item was deleted.
+bool hashmap_sharded_delete(struct hashmap_sharded *map, const void *key,
+                            void *old);
+
+/// Scanner for the sharded map.
+/// \details Each shard is read-locked while it's scanned, so the callback 
+/// must not modify the sharded map.
+/// \param map A pointer to the sharded map.
+/// \param iter A pointer to the user-provided callback function to be called for each item.
+/// \param udata A pointer to user-provided data, which will be passed to the callback function.
+/// \return True if the iteration was completed normally, false if it was stopped early.
+bool hashmap_sharded_scan(struct hashmap_sharded *map,
+                          bool (*iter)(const void *item, void *udata), 
+                          void *udata);
+
+/// Getter for the number of items in the sharded map.
+/// \param map A pointer to the sharded map.
+/// \return The number of elements in the map.
+size_t hashmap_sharded_count(struct hashmap_sharded *map);
+
+#endif // HASHMAP_NO_THREADS
+
 /// Creates a hash value using SipHash-2-4.
 /// \param data The data used for hash generation.
 /// \param len The length of the data.
@@ -149,6 +900,28 @@ uint64_t hashmap_sip(const void *data, size_t len,
 uint64_t hashmap_murmur(const void *data, size_t len, 
                         uint64_t seed0, uint64_t seed1);
 
+/// Creates a hash value using XXH3, the 64-bit variant of xxHash3.
+/// \details Inputs of up to 16, 128 and 240 bytes each take a path of their
+/// own, which makes short keys much cheaper to hash than with SipHash. The
+/// values are those of XXH3_64bits_withSeed in the reference implementation.
+/// \param data The data used for hash generation.
+/// \param len The length of the data.
+/// \param seed0 A seed for the hashing algorithm (optional).
+/// \param seed1 Unused.
+/// \return The hash of the data.
+uint64_t hashmap_xxhash3(const void *data, size_t len,
+                         uint64_t seed0, uint64_t seed1);
+
+/// Creates a hash value of a 64-bit integer using the mixer of wyhash.
+/// \details Two multiplications make this the cheapest helper for maps that 
+/// are keyed by integers or pointers. It's not meant to withstand keys that 
+/// are chosen to collide.
+/// \param key The integer to hash.
+/// \param seed0 A seed for the hashing algorithm (optional).
+/// \param seed1 A seed for the hashing algorithm (optional).
+/// \return The hash of the key.
+uint64_t hashmap_mix64(uint64_t key, uint64_t seed0, uint64_t seed1);
+
 
 /// This function allows for configuring a custom allocator for all hashmap library operations.
 /// \param malloc A pointer to the allocation function.
@@ -156,4 +929,289 @@ uint64_t hashmap_murmur(const void *data, size_t len,
 /// \deprecated Use `hashmap_new_with_allocator`
 void hashmap_set_allocator(void *(*malloc)(size_t), void (*free)(void*));
 
+#ifndef HASHMAP_DEFINE_CALLOC
+/// The allocation function of the maps made by HASHMAP_DEFINE.
+#define HASHMAP_DEFINE_CALLOC calloc
+#endif
+#ifndef HASHMAP_DEFINE_FREE
+/// The function that frees the buckets of the maps made by HASHMAP_DEFINE.
+#define HASHMAP_DEFINE_FREE free
+#endif
+
+// The bucket header of the maps made by HASHMAP_DEFINE, which is the one of
+// struct hashmap.
+#ifdef HASHMAP_WIDE_BUCKETS
+#define HASHMAP_DEFINE_HEADER uint64_t hash; uint32_t dib;
+#define HASHMAP_DEFINE_HASH_BITS 64
+#define HASHMAP_DEFINE_DIB_MAX UINT32_MAX
+#else
+#define HASHMAP_DEFINE_HEADER uint64_t hash:48; uint64_t dib:16;
+#define HASHMAP_DEFINE_HASH_BITS 48
+#define HASHMAP_DEFINE_DIB_MAX 0xFFFF
+#endif
+
+/// Defines a hash map type for fixed key and value types.
+/// \details The map uses the same robin-hood hashing as struct hashmap, but
+/// the hash and equality functions are inlined and the buckets have a fixed
+/// size, so that the compiler can specialize every operation. This emits 
+/// `struct name` and the static functions name_init, name_destroy, 
+/// name_clear, name_count, name_get, name_set, name_delete and name_iter,
+/// which follow the conventions of the other functions in this library. A
+/// probe distance that overflows the bucket header aborts, like the panic of
+/// struct hashmap. The map grows at a load of 0.75 and shrinks at 0.10,
+/// which HASHMAP_DEFINE_WITH_LOAD changes. None of the other hashmap_options
+/// apply. In particular there is no max_probe flood defense, so keys that
+/// an attacker picks need a hashfn that is seeded with a secret.
+/// \param name The name of the map type, which also prefixes its functions.
+/// \param K The type of the keys, which are copied by value.
+/// \param V The type of the values, which are copied by value.
+/// \param hashfn A function or macro of the form `uint64_t hashfn(K key)`.
+/// \param eqfn A function or macro of the form `bool eqfn(K a, K b)`.
+/// \code
+/// HASHMAP_DEFINE(u64map, uint64_t, uint64_t, my_hash, my_eq)
+/// struct u64map map;
+/// u64map_init(&map, 0);
+/// u64map_set(&map, 1, 100, NULL, NULL);
+/// uint64_t *val = u64map_get(&map, 1);
+/// u64map_destroy(&map);
+/// \endcode
+#define HASHMAP_DEFINE(name, K, V, hashfn, eqfn) \
+    HASHMAP_DEFINE_WITH_LOAD(name, K, V, hashfn, eqfn, 0.75, 0.10)
+
+/// Defines a hash map type like HASHMAP_DEFINE, with the load factors of
+/// max_load and min_load in hashmap_options.
+/// \param maxload The load at which the table doubles, between 0 and 1.
+/// \param minload The load at which the table halves, below half of
+/// maxload, or zero to never shrink, like no_shrink.
+#define HASHMAP_DEFINE_WITH_LOAD(name, K, V, hashfn, eqfn, maxload, \
+                                 minload) \
+struct name##_bucket { \
+    HASHMAP_DEFINE_HEADER \
+    K key; \
+    V val; \
+}; \
+ \
+struct name { \
+    struct name##_bucket *buckets; \
+    size_t cap; \
+    size_t nbuckets; \
+    size_t mask; \
+    size_t count; \
+    size_t growat; \
+    size_t shrinkat; \
+}; \
+ \
+static inline bool name##_alloc(struct name *map, size_t nbuckets) { \
+    struct name##_bucket *buckets = (struct name##_bucket*) \
+        HASHMAP_DEFINE_CALLOC(nbuckets, sizeof(struct name##_bucket)); \
+    if (!buckets) { \
+        return false; \
+    } \
+    map->buckets = buckets; \
+    map->nbuckets = nbuckets; \
+    map->mask = nbuckets-1; \
+    map->growat = nbuckets*(maxload); \
+    map->shrinkat = nbuckets*(minload); \
+    return true; \
+} \
+ \
+/** Initializes the map, returning false if the system is out of memory. */ \
+static inline bool name##_init(struct name *map, size_t cap) { \
+    size_t ncap = 16; \
+    while (ncap < cap) { \
+        ncap *= 2; \
+    } \
+    map->cap = ncap; \
+    map->count = 0; \
+    return name##_alloc(map, ncap); \
+} \
+ \
+static inline void name##_destroy(struct name *map) { \
+    HASHMAP_DEFINE_FREE(map->buckets); \
+    map->buckets = NULL; \
+} \
+ \
+static inline void name##_clear(struct name *map) { \
+    memset(map->buckets, 0, sizeof(struct name##_bucket)*map->nbuckets); \
+    map->count = 0; \
+} \
+ \
+static inline size_t name##_count(struct name *map) { \
+    return map->count; \
+} \
+ \
+static inline uint64_t name##_hash(K key) { \
+    return (uint64_t)(hashfn(key)) << (64-HASHMAP_DEFINE_HASH_BITS) >> \
+        (64-HASHMAP_DEFINE_HASH_BITS); \
+} \
+ \
+static inline bool name##_resize(struct name *map, size_t new_cap) { \
+    struct name##_bucket *old = map->buckets; \
+    size_t nold = map->nbuckets; \
+    if (!name##_alloc(map, new_cap)) { \
+        return false; \
+    } \
+    for (size_t i = 0; i < nold; i++) { \
+        if (!old[i].dib) { \
+            continue; \
+        } \
+        struct name##_bucket entry = old[i]; \
+        entry.dib = 1; \
+        size_t j = entry.hash & map->mask; \
+        for (;;) { \
+            struct name##_bucket *bucket = &map->buckets[j]; \
+            if (!bucket->dib) { \
+                *bucket = entry; \
+                break; \
+            } \
+            if (bucket->dib < entry.dib) { \
+                struct name##_bucket tmp = *bucket; \
+                *bucket = entry; \
+                entry = tmp; \
+            } \
+            if (entry.dib >= HASHMAP_DEFINE_DIB_MAX-1) { \
+                abort(); \
+            } \
+            j = (j + 1) & map->mask; \
+            entry.dib++; \
+        } \
+    } \
+    HASHMAP_DEFINE_FREE(old); \
+    return true; \
+} \
+ \
+static inline V *name##_get(struct name *map, K key) { \
+    uint64_t hash = name##_hash(key); \
+    size_t i = hash & map->mask; \
+    for (;;) { \
+        struct name##_bucket *bucket = &map->buckets[i]; \
+        if (!bucket->dib) { \
+            return NULL; \
+        } \
+        if (bucket->hash == hash && eqfn(bucket->key, key)) { \
+            return &bucket->val; \
+        } \
+        i = (i + 1) & map->mask; \
+    } \
+} \
+ \
+/** Inserts or replaces a value. The replaced value is copied into old and */ \
+/** replaced is set, when provided. Returns false when out of memory. */ \
+static inline bool name##_set(struct name *map, K key, V val, V *old, \
+                              bool *replaced) \
+{ \
+    if (map->count == map->growat) { \
+        if (!name##_resize(map, map->nbuckets*2)) { \
+            return false; \
+        } \
+    } \
+    uint64_t hash = name##_hash(key); \
+    size_t i = hash & map->mask; \
+    size_t dib = 1; \
+    for (;;) { \
+        struct name##_bucket *bucket = &map->buckets[i]; \
+        if (!bucket->dib) { \
+            break; \
+        } \
+        if (bucket->hash == hash && eqfn(bucket->key, key)) { \
+            if (old) { \
+                *old = bucket->val; \
+            } \
+            bucket->val = val; \
+            if (replaced) { \
+                *replaced = true; \
+            } \
+            return true; \
+        } \
+        if (bucket->dib < dib) { \
+            size_t j = i; \
+            while (map->buckets[j].dib) { \
+                j = (j + 1) & map->mask; \
+            } \
+            while (j != i) { \
+                size_t k = (j - 1) & map->mask; \
+                if (map->buckets[k].dib >= HASHMAP_DEFINE_DIB_MAX-1) { \
+                    abort(); \
+                } \
+                map->buckets[j] = map->buckets[k]; \
+                map->buckets[j].dib++; \
+                j = k; \
+            } \
+            break; \
+        } \
+        i = (i + 1) & map->mask; \
+        dib++; \
+    } \
+    if (dib >= HASHMAP_DEFINE_DIB_MAX) { \
+        abort(); \
+    } \
+    struct name##_bucket *bucket = &map->buckets[i]; \
+    bucket->hash = hash; \
+    bucket->dib = dib; \
+    bucket->key = key; \
+    bucket->val = val; \
+    map->count++; \
+    if (replaced) { \
+        *replaced = false; \
+    } \
+    return true; \
+} \
+ \
+/** Deletes a value, which is copied into old when provided. Returns false */ \
+/** if the key was not found. */ \
+static inline bool name##_delete(struct name *map, K key, V *old) { \
+    uint64_t hash = name##_hash(key); \
+    size_t i = hash & map->mask; \
+    for (;;) { \
+        struct name##_bucket *bucket = &map->buckets[i]; \
+        if (!bucket->dib) { \
+            return false; \
+        } \
+        if (bucket->hash == hash && eqfn(bucket->key, key)) { \
+            break; \
+        } \
+        i = (i + 1) & map->mask; \
+    } \
+    if (old) { \
+        *old = map->buckets[i].val; \
+    } \
+    for (;;) { \
+        size_t prev = i; \
+        i = (i + 1) & map->mask; \
+        if (map->buckets[i].dib <= 1) { \
+            map->buckets[prev].dib = 0; \
+            break; \
+        } \
+        map->buckets[prev] = map->buckets[i]; \
+        map->buckets[prev].dib--; \
+    } \
+    map->count--; \
+    if ((minload) > 0 && map->nbuckets > map->cap && \
+        map->count <= map->shrinkat) \
+    { \
+        name##_resize(map, map->nbuckets/2); \
+    } \
+    return true; \
+} \
+ \
+/** Iterates over the map like hashmap_iter. */ \
+static inline bool name##_iter(struct name *map, size_t *i, K **key, \
+                               V **val) \
+{ \
+    for (; *i < map->nbuckets; (*i)++) { \
+        struct name##_bucket *bucket = &map->buckets[*i]; \
+        if (bucket->dib) { \
+            (*i)++; \
+            if (key) { \
+                *key = &bucket->key; \
+            } \
+            if (val) { \
+                *val = &bucket->val; \
+            } \
+            return true; \
+        } \
+    } \
+    return false; \
+}
+
 #endif